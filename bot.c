@@ -0,0 +1,437 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/ioctl.h>
+#include <dev/usb/usb.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "bot.h"
+#include "fdcache.h"
+#include "log.h"
+#include "profile.h"
+
+#define BOT_PENDING_STAGE 1
+#define BOT_PENDING_RA 2
+
+#define BOT_RA_TAG 0x44484152
+
+// what the host would read from the bulk in endpoint after the last
+// command: the data phase, then the status
+struct bot_stage
+{
+  char *data;
+  int data_len;
+  int data_off;
+  int data_done;
+  int data_err;
+  char csw[BOT_CSW_LEN];
+  int csw_len;
+  int csw_err;
+  int valid;
+};
+
+static int bot_enabled = 0;
+static int bot_out = -1;
+static int bot_in = -1;
+static char bot_cmd[BOT_CBW_LEN];
+static int bot_pending = 0;
+static struct bot_stage bot_stage;
+
+// read-ahead of the next sequential READ(10), only done within the
+// capacity reported by the device
+static char *bot_ra;
+static int bot_ra_valid = 0;
+static int bot_ra_len;
+static char bot_ra_cbw[BOT_CBW_LEN];
+static char bot_ra_csw[BOT_CSW_LEN];
+static uint32_t bot_last_lba;
+static uint32_t bot_blk_len = 0;
+static unsigned long bot_hits = 0;
+static unsigned long bot_misses = 0;
+
+uint32_t bot_le32(char *p)
+{
+  u_char *b = (u_char *)p;
+
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+void bot_set_le32(char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+uint32_t bot_be32(char *p)
+{
+  u_char *b = (u_char *)p;
+
+  return ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+int bot_enable(void)
+{
+  bot_stage.data = malloc(BOT_BUF_MAX);
+  bot_ra = malloc(BOT_BUF_MAX);
+  if (bot_stage.data == NULL || bot_ra == NULL)
+    return -1;
+  bot_enabled = 1;
+  return 0;
+}
+
+// staging needs both bulk endpoints in the same process
+void bot_disable(void)
+{
+  bot_enabled = 0;
+}
+
+void bot_reset(void)
+{
+  bot_pending = 0;
+  bot_stage.valid = 0;
+  bot_ra_valid = 0;
+}
+
+// called for every control request, only a bulk-only mass storage reset,
+// a clear halt of one of the bulk endpoints or a set interface change
+// what the device does next, anything else leaves the staged data alone
+void bot_ctl(u_char *setup)
+{
+  int endp;
+
+  if (bot_in == -1)
+    return;
+  endp = setup[4] & 0x0f;
+  if ((setup[0] == 0x21 && setup[1] == 0xff) ||
+      (setup[0] == 0x02 && setup[1] == 1 &&
+       (endp == bot_in || endp == bot_out)) ||
+      (setup[0] == 0x01 && setup[1] == 11))
+    bot_reset();
+}
+
+// find the bulk endpoints of the first mass storage bulk-only interface
+void bot_probe(int *fd)
+{
+  struct usb_interface_desc idesc;
+  struct usb_endpoint_desc edesc;
+  struct usb_config_desc cdesc;
+  int addr;
+  int i;
+  int e;
+
+  bot_reset();
+  bot_out = -1;
+  bot_in = -1;
+  bot_blk_len = 0;
+  if (!bot_enabled)
+    return;
+
+  cdesc.ucd_config_index = USB_CURRENT_CONFIG_INDEX;
+  if (ioctl(fd[0], USB_GET_CONFIG_DESC, &cdesc) == -1)
+    return;
+
+  for (i = 0; i < cdesc.ucd_desc.bNumInterface && bot_in == -1; i++)
+  {
+    idesc.uid_config_index = USB_CURRENT_CONFIG_INDEX;
+    idesc.uid_interface_index = i;
+    idesc.uid_alt_index = USB_CURRENT_ALT_INDEX;
+    if (ioctl(fd[0], USB_GET_INTERFACE_DESC, &idesc) == -1)
+      return;
+    if (idesc.uid_desc.bInterfaceClass != 0x08 ||
+	idesc.uid_desc.bInterfaceProtocol != 0x50)
+      continue;
+
+    bot_out = -1;
+    for (e = 0; e < idesc.uid_desc.bNumEndpoints; e++)
+    {
+      edesc.ued_config_index = USB_CURRENT_CONFIG_INDEX;
+      edesc.ued_interface_index = i;
+      edesc.ued_alt_index = USB_CURRENT_ALT_INDEX;
+      edesc.ued_endpoint_index = e;
+      if (ioctl(fd[0], USB_GET_ENDPOINT_DESC, &edesc) == -1)
+	return;
+      if ((edesc.ued_desc.bmAttributes & 3) != 2)
+	continue;
+      addr = edesc.ued_desc.bEndpointAddress;
+      if (addr & 0x80)
+	bot_in = addr & 0x0f;
+      else
+	bot_out = addr & 0x0f;
+    }
+    if (bot_out == -1 || fdcache_get(fd, bot_out) == -1 || bot_in == -1 ||
+	fdcache_get(fd, bot_in) == -1)
+      bot_in = -1;
+  }
+
+  if (bot_in == -1)
+  {
+    bot_out = -1;
+    return;
+  }
+  fdcache_ioctl(fd, bot_in, USB_SET_SHORT_XFER, 1);
+}
+
+// a halted bulk in endpoint must be cleared before the status is read
+void bot_clear_halt(int *fd)
+{
+  struct usb_ctl_request req;
+
+  bzero(&req, sizeof(req));
+  req.ucr_request.bmRequestType = 0x02;
+  req.ucr_request.bRequest = 1;
+  USETW(req.ucr_request.wValue, 0);
+  USETW(req.ucr_request.wIndex, bot_in | 0x80);
+  USETW(req.ucr_request.wLength, 0);
+  ioctl(fd[0], USB_DO_REQUEST, &req);
+}
+
+void bot_fetch(int *fd, struct bot_stage *stage)
+{
+  uint32_t dlen;
+  int n;
+
+  dlen = bot_le32(bot_cmd + 8);
+  stage->data_len = 0;
+  stage->data_off = 0;
+  stage->data_done = dlen == 0;
+  stage->data_err = 0;
+  stage->csw_len = 0;
+  stage->csw_err = 0;
+  stage->valid = 1;
+
+  if (dlen)
+  {
+    n = read(fdcache_get(fd, bot_in), stage->data, dlen);
+    if (n < 0)
+    {
+      // the host sees the error and recovers, the status is then read
+      // from the device
+      stage->data_err = -errno;
+      return;
+    }
+    stage->data_len = n;
+  }
+
+  n = read(fdcache_get(fd, bot_in), stage->csw, BOT_CSW_LEN);
+  if (n < 0)
+    stage->csw_err = -errno;
+  else
+    stage->csw_len = n;
+
+  // remember the capacity, it bounds the read-ahead
+  if (bot_cmd[15] == 0x25 && stage->data_len >= 8 &&
+      stage->csw_len == BOT_CSW_LEN && stage->csw[12] == 0)
+  {
+    bot_last_lba = bot_be32(stage->data);
+    bot_blk_len = bot_be32(stage->data + 4);
+  }
+}
+
+void bot_readahead(int *fd)
+{
+  uint32_t blocks;
+  uint32_t dlen;
+  uint32_t lba;
+  char *cb;
+  int n;
+
+  // the host may already have read the stage, it still holds the
+  // outcome of the command
+  cb = bot_cmd + 15;
+  if (bot_blk_len == 0 || cb[0] != 0x28 ||
+      bot_stage.csw_len != BOT_CSW_LEN ||
+      bot_stage.csw[12] != 0 || !profile_readahead())
+    return;
+  lba = bot_be32(cb + 2);
+  blocks = ((u_char)cb[7] << 8) | (u_char)cb[8];
+  dlen = bot_le32(bot_cmd + 8);
+  if (blocks == 0 || dlen != blocks * bot_blk_len || dlen > BOT_BUF_MAX ||
+      bot_stage.data_len != dlen || lba + blocks > bot_last_lba ||
+      bot_last_lba - (lba + blocks) < blocks - 1)
+    return;
+
+  memcpy(bot_ra_cbw, bot_cmd, BOT_CBW_LEN);
+  bot_set_le32(bot_ra_cbw + 4, BOT_RA_TAG);
+  lba += blocks;
+  bot_ra_cbw[17] = lba >> 24;
+  bot_ra_cbw[18] = lba >> 16;
+  bot_ra_cbw[19] = lba >> 8;
+  bot_ra_cbw[20] = lba;
+
+  if (write(fdcache_get(fd, bot_out), bot_ra_cbw, BOT_CBW_LEN) !=
+      BOT_CBW_LEN)
+  {
+    bot_blk_len = 0;
+    return;
+  }
+  bot_ra_len = read(fdcache_get(fd, bot_in), bot_ra, dlen);
+  if (bot_ra_len < 0)
+    bot_clear_halt(fd);
+  n = read(fdcache_get(fd, bot_in), bot_ra_csw, BOT_CSW_LEN);
+  if (bot_ra_len != dlen || n != BOT_CSW_LEN ||
+      bot_le32(bot_ra_csw) != BOT_CSW_SIG ||
+      bot_le32(bot_ra_csw + 4) != BOT_RA_TAG || bot_ra_csw[12] != 0)
+  {
+    // never guess twice on a device which does not behave
+    bot_blk_len = 0;
+    return;
+  }
+  bot_ra_valid = 1;
+}
+
+// called for every bulk out transfer, returns 1 if it was a command
+// handled here, 0 to let the caller write it, -1 on error
+int bot_cbw(int *fd, int endp, char *buf, int len)
+{
+  uint32_t dlen;
+  char *tmp;
+
+  if (endp != bot_out || len != BOT_CBW_LEN ||
+      bot_le32(buf) != BOT_CBW_SIG)
+    return 0;
+
+  bot_pending = 0;
+  bot_stage.valid = 0;
+  memcpy(bot_cmd, buf, BOT_CBW_LEN);
+
+  // same command as the read-ahead one, only the tag differs
+  if (bot_ra_valid && !memcmp(buf + 8, bot_ra_cbw + 8, BOT_CBW_LEN - 8))
+  {
+    tmp = bot_stage.data;
+    bot_stage.data = bot_ra;
+    bot_ra = tmp;
+    bot_stage.data_len = bot_ra_len;
+    bot_stage.data_off = 0;
+    bot_stage.data_done = 0;
+    bot_stage.data_err = 0;
+    memcpy(bot_stage.csw, bot_ra_csw, BOT_CSW_LEN);
+    memcpy(bot_stage.csw + 4, buf + 4, 4);
+    bot_stage.csw_len = BOT_CSW_LEN;
+    bot_stage.csw_err = 0;
+    bot_stage.valid = 1;
+    bot_ra_valid = 0;
+    bot_hits++;
+    profile_ra(1);
+    bot_pending = BOT_PENDING_RA;
+    return 1;
+  }
+  if (bot_ra_valid)
+  {
+    bot_misses++;
+    profile_ra(0);
+  }
+  bot_ra_valid = 0;
+
+  if (write(fdcache_get(fd, endp), buf, len) == -1)
+    return -1;
+
+  // data in or no data at all, the rest of the command can be fetched
+  // before the host asks for it
+  dlen = bot_le32(buf + 8);
+  if (dlen == 0 || ((buf[12] & 0x80) && dlen <= BOT_BUF_MAX))
+    bot_pending = BOT_PENDING_STAGE | BOT_PENDING_RA;
+  return 1;
+}
+
+// called once the answer to a URB is sent, the device then works while
+// the host processes it
+void bot_done(int *fd)
+{
+  if (bot_pending & BOT_PENDING_STAGE)
+    bot_fetch(fd, &bot_stage);
+  bot_pending &= ~BOT_PENDING_STAGE;
+}
+
+// called when no request is waiting, the read-ahead takes a whole command
+// and would delay one already sent by the host
+void bot_idle(int *fd)
+{
+  bot_done(fd);
+  if (bot_pending & BOT_PENDING_RA)
+    bot_readahead(fd);
+  bot_pending = 0;
+}
+
+// called for every bulk in transfer, returns the length served from the
+// staged command or -1 to let the caller read the device
+int bot_read(int *fd, int endp, char *buf, int len, int *res)
+{
+  int n;
+
+  if (endp != bot_in)
+    return -1;
+  if (bot_pending)
+    bot_done(fd);
+  if (!bot_stage.valid)
+    return -1;
+
+  if (!bot_stage.data_done)
+  {
+    if (bot_stage.data_err)
+    {
+      *res = bot_stage.data_err;
+      bot_stage.valid = 0;
+      return 0;
+    }
+    n = bot_stage.data_len - bot_stage.data_off;
+    if (n > len)
+      n = len;
+    memcpy(buf, bot_stage.data + bot_stage.data_off, n);
+    bot_stage.data_off += n;
+    if (bot_stage.data_off == bot_stage.data_len || n < len)
+      bot_stage.data_done = 1;
+    return n;
+  }
+
+  bot_stage.valid = 0;
+  if (bot_stage.csw_err)
+  {
+    *res = bot_stage.csw_err;
+    return 0;
+  }
+  n = bot_stage.csw_len > len ? len : bot_stage.csw_len;
+  memcpy(buf, bot_stage.csw, n);
+  return n;
+}
+
+void bot_report(char *addr)
+{
+  if (bot_hits || bot_misses)
+    log_printf(LOG_INFO, "%s: bot read-ahead %lu hits, %lu misses\n", addr,
+	       bot_hits, bot_misses);
+}
@@ -0,0 +1,286 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "budget.h"
+#include "log.h"
+#include "wheel.h"
+
+// what one session holds, so that a session which died without giving
+// its share back does not keep it
+struct budget_slot
+{
+  volatile pid_t pid;
+  volatile uint64_t used;
+};
+
+// payload bytes of the URBs read from the clients and not answered yet,
+// in this session and in all of them, and the sessions waiting for the
+// others to give some back
+struct budget_shm
+{
+  volatile uint64_t used;
+  volatile uint64_t peak;
+  volatile uint32_t waiters;
+  struct budget_slot slot[BUDGET_SESSIONS];
+};
+
+static uint64_t budget_session = 0;
+static uint64_t budget_global = 0;
+static uint64_t budget_used = 0;
+static struct budget_shm *budget_shm = NULL;
+static struct budget_slot *budget_slot = NULL;
+static int budget_readonly = 0;
+static volatile uint64_t *budget_charged = NULL;
+static int budget_db[2] = { -1, -1 };
+
+// budgets are given in KB, 0 means no limit
+int budget_set(char *arg, int global)
+{
+  char *end;
+  uint64_t v;
+
+  v = strtoull(arg, &end, 10) * 1024;
+  if (*end != '\0')
+    return -1;
+  if (global)
+    budget_global = v;
+  else
+    budget_session = v;
+  return 0;
+}
+
+// the doorbell is written when budget is given back while sessions wait
+// for it, all of them share it
+int budget_init(void)
+{
+  budget_shm = mmap(NULL, sizeof(*budget_shm), PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_SHARED, -1, 0);
+  if (budget_shm == MAP_FAILED)
+  {
+    perror("mmap()");
+    budget_shm = NULL;
+    return -1;
+  }
+  if (pipe(budget_db) == -1)
+  {
+    perror("pipe()");
+    return -1;
+  }
+  fcntl(budget_db[0], F_SETFL, fcntl(budget_db[0], F_GETFL) | O_NONBLOCK);
+  fcntl(budget_db[1], F_SETFL, fcntl(budget_db[1], F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+
+// an unprivileged process still sees the global use but only keeps its
+// own accounts, its parent charges them and tells what it charged
+void budget_confine(volatile uint64_t *charged)
+{
+  budget_charged = charged;
+  if (budget_shm != NULL &&
+      mprotect(budget_shm, sizeof(*budget_shm), PROT_READ) == 0)
+    budget_readonly = 1;
+  else if (budget_shm != NULL)
+  {
+    munmap(budget_shm, sizeof(*budget_shm));
+    budget_shm = NULL;
+  }
+  budget_slot = NULL;
+}
+
+// give back the share of the sessions which are gone, an owner running
+// as another user is still alive
+void budget_reclaim(void)
+{
+  struct budget_slot *slot;
+  pid_t owner;
+  int i;
+
+  for (i = 0; i < BUDGET_SESSIONS; i++)
+  {
+    slot = &budget_shm->slot[i];
+    owner = slot->pid;
+    if (owner <= 0 || kill(owner, 0) == 0 || errno != ESRCH ||
+	!__sync_bool_compare_and_swap(&slot->pid, owner, -1))
+      continue;
+    __sync_sub_and_fetch(&budget_shm->used, slot->used);
+    slot->used = 0;
+    __sync_synchronize();
+    slot->pid = 0;
+  }
+}
+
+// a session without a slot is still accounted for globally, but its
+// share is lost if it dies
+void budget_start(void)
+{
+  pid_t pid;
+  int i;
+
+  budget_used = 0;
+  if (budget_shm == NULL || budget_readonly)
+    return;
+  budget_reclaim();
+  pid = getpid();
+  for (i = 0; i < BUDGET_SESSIONS && budget_slot == NULL; i++)
+    if (__sync_bool_compare_and_swap(&budget_shm->slot[i].pid, 0, pid))
+      budget_slot = &budget_shm->slot[i];
+}
+
+// what the global use already counts of this session, it lags behind
+// budget_used in an unprivileged process
+uint64_t budget_own(void)
+{
+  uint64_t charged;
+
+  if (budget_readonly)
+    charged = *budget_charged;
+  else
+    charged = budget_used;
+  return charged < budget_shm->used ? charged : budget_shm->used;
+}
+
+// bytes this session holds
+uint64_t budget_held(void)
+{
+  return budget_used;
+}
+
+// no more URB should be read from the client while this is true, the
+// client then blocks on its TCP window
+int budget_full(void)
+{
+  if (budget_session && budget_used >= budget_session)
+    return 1;
+  if (budget_global && budget_shm != NULL &&
+      budget_shm->used - budget_own() + budget_used >= budget_global)
+    return 1;
+  return 0;
+}
+
+// the timers go on firing, answers they send free budget. The other
+// sessions ring the doorbell when they give some back, the wait doubles
+// up to BUDGET_WAIT_MAX in case a session died holding its share
+void budget_wait(void)
+{
+  struct pollfd pfd;
+  char c[64];
+  int ms;
+
+  pfd.fd = budget_db[0];
+  pfd.events = POLLIN;
+  for (ms = 1; budget_full(); ms = ms < BUDGET_WAIT_MAX ? ms * 2 : ms)
+  {
+    if (budget_shm == NULL || budget_readonly)
+    {
+      wheel_poll(NULL, 0, ms);
+      continue;
+    }
+    __sync_add_and_fetch(&budget_shm->waiters, 1);
+    if (budget_full() && wheel_poll(&pfd, 1, ms) > 0)
+      while (read(budget_db[0], c, sizeof(c)) > 0)
+	;
+    __sync_sub_and_fetch(&budget_shm->waiters, 1);
+    if (ms == BUDGET_WAIT_MAX)
+      budget_reclaim();
+  }
+}
+
+void budget_take(int len)
+{
+  uint64_t used;
+  uint64_t peak;
+
+  budget_used += len;
+  if (budget_shm == NULL || budget_readonly)
+    return;
+  if (budget_slot != NULL)
+    budget_slot->used += len;
+  used = __sync_add_and_fetch(&budget_shm->used, len);
+  do
+    peak = budget_shm->peak;
+  while (used > peak &&
+	 !__sync_bool_compare_and_swap(&budget_shm->peak, peak, used));
+}
+
+void budget_release(int len)
+{
+  budget_used -= len;
+  if (budget_shm == NULL || budget_readonly || len == 0)
+    return;
+  if (budget_slot != NULL)
+    budget_slot->used -= len;
+  __sync_sub_and_fetch(&budget_shm->used, len);
+  __sync_synchronize();
+  if (budget_global && budget_shm->waiters)
+    write(budget_db[1], "", 1);
+}
+
+void budget_report(char *addr)
+{
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) == 0)
+    log_printf(LOG_INFO, "%s: peak rss %ld KB\n", addr, ru.ru_maxrss);
+}
+
+void budget_dump(void)
+{
+  if (budget_shm == NULL)
+    return;
+  printf("budget: %llu KB in flight, peak %llu KB, global budget %llu KB\n",
+	 (unsigned long long)budget_shm->used / 1024,
+	 (unsigned long long)budget_shm->peak / 1024,
+	 (unsigned long long)budget_global / 1024);
+  fflush(stdout);
+}
+
+// give back what a finished session still holds
+void budget_stop(void)
+{
+  if (budget_used)
+    budget_release(budget_used);
+  if (budget_slot != NULL)
+    budget_slot->pid = 0;
+  budget_slot = NULL;
+}
@@ -0,0 +1,501 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <dev/usb/usb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+
+#include "net.h"
+#include "discover.h"
+#include "log.h"
+#include "query.h"
+#include "timing.h"
+
+#define DISCOVER_MAGIC "OUSD"
+#define DISCOVER_VERSION 1
+#define DISCOVER_PORT 3240
+// an answer fits in a datagram, the devices past that are left out
+#define DISCOVER_DEV_MAX 16
+#define DISCOVER_RESCAN 1000000
+
+#define DISCOVER_QUERY 1
+#define DISCOVER_ANSWER 2
+
+// the generation of the query is still current, no device follows
+#define DISCOVER_UNCHANGED 0x01
+// the query was shorter than the answer, no device follows
+#define DISCOVER_PAD 0x02
+
+struct discover_hdr
+{
+  char magic[4];
+  uint8_t v;
+  uint8_t type;
+  uint8_t flags;
+  uint8_t ndev;
+  uint32_t gen;
+  uint32_t nonce;
+  uint16_t port;
+  uint16_t pad;
+} __attribute__((packed));
+
+struct discover_dev
+{
+  char bus[NET_USB_BUS_MAX];
+  uint16_t vid;
+  uint16_t pid;
+  uint16_t bcd;
+  uint8_t class;
+  uint8_t sub_class;
+  uint8_t proto;
+  uint8_t used;
+  uint16_t pad;
+} __attribute__((packed));
+
+struct discover_shm
+{
+  volatile uint32_t gen;
+  volatile uint32_t used[QUERY_UNITS];
+};
+
+static struct sockaddr_in discover_saddr;
+static struct discover_shm *discover_shm = NULL;
+
+// the exported devices as last seen, in a ready to send answer
+static char discover_buf[sizeof(struct discover_hdr) +
+			 DISCOVER_DEV_MAX * sizeof(struct discover_dev)];
+static int discover_len = 0;
+// the last record of each unit, an imported device cannot be opened by
+// the scans and is answered from it
+static struct discover_dev discover_devs[QUERY_UNITS];
+static char discover_known[QUERY_UNITS];
+static int discover_cut = 0;
+
+// address[:port], the address is either a multicast group to join and
+// announce to, or a local address to answer unicast queries on
+int discover_parse(char *arg, struct sockaddr_in *saddr)
+{
+  char *port;
+
+  bzero(saddr, sizeof(*saddr));
+  saddr->sin_family = AF_INET;
+  saddr->sin_port = htons(DISCOVER_PORT);
+  port = strchr(arg, ':');
+  if (port != NULL)
+  {
+    *port++ = '\0';
+    if (atoi(port) <= 0 || atoi(port) > 65535)
+      return -1;
+    saddr->sin_port = htons(atoi(port));
+  }
+  saddr->sin_addr.s_addr = inet_addr(arg);
+  if (saddr->sin_addr.s_addr == INADDR_NONE &&
+      strcmp(arg, "255.255.255.255"))
+    return -1;
+  return 0;
+}
+
+int discover_set(char *arg)
+{
+  return discover_parse(arg, &discover_saddr);
+}
+
+// sessions count themselves in and out, scanners see it through the
+// generation
+void discover_use(char *ugen, int n)
+{
+  int unit;
+
+  unit = atoi(ugen);
+  if (discover_shm == NULL || unit < 0 || unit >= QUERY_UNITS)
+    return;
+  __sync_add_and_fetch(&discover_shm->used[unit], n);
+  __sync_add_and_fetch(&discover_shm->gen, 1);
+}
+
+// rescan the devices, the ones in use keep their last record
+void discover_update(unsigned short tport)
+{
+  struct discover_dev devs[DISCOVER_DEV_MAX];
+  struct discover_dev *dev;
+  struct discover_hdr *hdr;
+  struct query_dev *qds;
+  char found[QUERY_UNITS];
+  int total;
+  int ndev;
+  int unit;
+  int n;
+  int i;
+
+  qds = malloc(QUERY_UNITS * sizeof(*qds));
+  if (qds == NULL)
+    return;
+  bzero(found, sizeof(found));
+  n = query_scan(qds, QUERY_UNITS, "discover");
+  for (i = 0; i < n; i++)
+  {
+    unit = qds[i].unit;
+    dev = &discover_devs[unit];
+    bzero(dev, sizeof(*dev));
+    strlcpy(dev->bus, qds[i].dev.bus, NET_USB_BUS_MAX);
+    dev->vid = qds[i].dev.vid;
+    dev->pid = qds[i].dev.pid;
+    dev->bcd = qds[i].dev.bcd;
+    dev->class = qds[i].dev.class;
+    dev->sub_class = qds[i].dev.sub_class;
+    dev->proto = qds[i].dev.proto;
+    found[unit] = 1;
+    discover_known[unit] = 1;
+  }
+  free(qds);
+
+  // a unit that did not answer is gone unless a session holds it
+  bzero(devs, sizeof(devs));
+  total = 0;
+  ndev = 0;
+  for (unit = 0; unit < QUERY_UNITS; unit++)
+  {
+    if (!found[unit] && !discover_shm->used[unit])
+      discover_known[unit] = 0;
+    if (!discover_known[unit])
+      continue;
+    discover_devs[unit].used = discover_shm->used[unit] != 0;
+    if (ndev < DISCOVER_DEV_MAX)
+      memcpy(&devs[ndev++], &discover_devs[unit], sizeof(*devs));
+    total++;
+  }
+  if (total > DISCOVER_DEV_MAX && total != discover_cut)
+    log_printf(LOG_WARNING, "discover: %d devices, only %d announced\n",
+	       total, DISCOVER_DEV_MAX);
+  discover_cut = total > DISCOVER_DEV_MAX ? total : 0;
+
+  // a plugged, unplugged or changed device makes a new generation too
+  hdr = (struct discover_hdr *)discover_buf;
+  if (discover_len != sizeof(*hdr) + ndev * sizeof(*devs) ||
+      memcmp(hdr + 1, devs, ndev * sizeof(*devs)))
+    __sync_add_and_fetch(&discover_shm->gen, 1);
+  memcpy(hdr->magic, DISCOVER_MAGIC, sizeof(hdr->magic));
+  hdr->v = DISCOVER_VERSION;
+  hdr->type = DISCOVER_ANSWER;
+  hdr->flags = 0;
+  hdr->ndev = ndev;
+  hdr->port = htons(tport);
+  memcpy(hdr + 1, devs, ndev * sizeof(*devs));
+  discover_len = sizeof(*hdr) + ndev * sizeof(*devs);
+}
+
+int discover_check(char *buf, int len, int type)
+{
+  struct discover_hdr *hdr = (struct discover_hdr *)buf;
+
+  return len < sizeof(*hdr) || memcmp(hdr->magic, DISCOVER_MAGIC, 4) ||
+    hdr->v != DISCOVER_VERSION || hdr->type != type ||
+    len < sizeof(*hdr) + hdr->ndev * sizeof(struct discover_dev);
+}
+
+// a query is answered with no more bytes than it had, so that a forged
+// source address cannot be flooded through the daemon: scanners pad
+// their queries to the largest answer, shorter ones only get the header
+void discover_send(int s, struct sockaddr_in *to, uint32_t nonce,
+		   uint32_t known, int qlen)
+{
+  struct discover_hdr *hdr = (struct discover_hdr *)discover_buf;
+  struct discover_hdr small;
+  uint32_t gen;
+
+  gen = discover_shm->gen;
+  hdr->gen = htonl(gen);
+  hdr->nonce = nonce;
+  if ((known && known == gen) || qlen < discover_len)
+  {
+    memcpy(&small, hdr, sizeof(small));
+    small.flags = qlen < discover_len ? DISCOVER_PAD : DISCOVER_UNCHANGED;
+    small.ndev = 0;
+    sendto(s, &small, sizeof(small), 0, (struct sockaddr *)to,
+	   sizeof(*to));
+  }
+  else
+    sendto(s, discover_buf, discover_len, 0, (struct sockaddr *)to,
+	   sizeof(*to));
+}
+
+void discover_loop(int s, struct sockaddr_in *group, unsigned short tport,
+		   int intv)
+{
+  struct discover_hdr *hdr;
+  struct sockaddr_in from;
+  struct pollfd pfd;
+  socklen_t flen;
+  uint64_t rescan;
+  uint64_t next;
+  uint64_t now;
+  uint32_t sent;
+  char buf[sizeof(discover_buf)];
+  int timeout;
+  int len;
+
+  pfd.fd = s;
+  pfd.events = POLLIN;
+  rescan = 0;
+  next = 0;
+  sent = 0;
+  // exit with the daemon
+  while (getppid() != 1)
+  {
+    // the rescans run on their own timer, not on the queries
+    now = timing_usec();
+    if (now >= rescan)
+    {
+      discover_update(tport);
+      now = timing_usec();
+      rescan = now + DISCOVER_RESCAN;
+    }
+    timeout = (rescan - now) / 1000 + 1;
+    if (group != NULL && next > now && (next - now) / 1000 + 1 < timeout)
+      timeout = (next - now) / 1000 + 1;
+    if (poll(&pfd, 1, timeout) == -1)
+      continue;
+    if (pfd.revents & POLLIN)
+    {
+      flen = sizeof(from);
+      len = recvfrom(s, buf, sizeof(buf), 0, (struct sockaddr *)&from,
+		     &flen);
+      hdr = (struct discover_hdr *)buf;
+      // answers go to the scanner only, not to the whole group
+      if (len > 0 && !discover_check(buf, len, DISCOVER_QUERY))
+	discover_send(s, &from, hdr->nonce, ntohl(hdr->gen), len);
+    }
+    // announce periodically and as soon as something changed
+    if (group != NULL &&
+	(timing_usec() >= next || sent != discover_shm->gen))
+    {
+      sent = discover_shm->gen;
+      discover_send(s, group, 0, 0, sizeof(discover_buf));
+      next = timing_usec() + intv * 1000000ULL;
+    }
+  }
+  exit(EXIT_SUCCESS);
+}
+
+int discover_socket(struct sockaddr_in *saddr, int *multicast)
+{
+  struct sockaddr_in baddr;
+  struct ip_mreq mreq;
+  int opt = 1;
+  int s;
+
+  s = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s == -1)
+  {
+    perror("socket()");
+    return -1;
+  }
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+  // several daemons on a host share the group port
+  setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+#endif
+
+  memcpy(&baddr, saddr, sizeof(baddr));
+  *multicast = IN_MULTICAST(ntohl(saddr->sin_addr.s_addr));
+  if (*multicast)
+    baddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(s, (struct sockaddr *)&baddr, sizeof(baddr)) == -1)
+  {
+    perror("bind()");
+    close(s);
+    return -1;
+  }
+
+  if (*multicast)
+  {
+    mreq.imr_multiaddr = saddr->sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+		   sizeof(mreq)) == -1)
+    {
+      perror("setsockopt()");
+      close(s);
+      return -1;
+    }
+  }
+  return s;
+}
+
+int discover_start(unsigned short tport, int intv)
+{
+  int multicast;
+  int s;
+
+  if (discover_saddr.sin_family == 0)
+    return 0;
+  discover_shm = mmap(NULL, sizeof(*discover_shm), PROT_READ | PROT_WRITE,
+		      MAP_ANON | MAP_SHARED, -1, 0);
+  if (discover_shm == MAP_FAILED)
+  {
+    perror("mmap()");
+    discover_shm = NULL;
+    return -1;
+  }
+
+  s = discover_socket(&discover_saddr, &multicast);
+  if (s == -1)
+    return -1;
+
+  switch (fork())
+  {
+  case -1:
+    perror("fork()");
+    return -1;
+  case 0:
+    discover_loop(s, multicast ? &discover_saddr : NULL, tport, intv);
+    break;
+  }
+  close(s);
+  return 0;
+}
+
+void discover_confine(void)
+{
+  if (discover_shm != NULL)
+    munmap(discover_shm, sizeof(*discover_shm));
+  discover_shm = NULL;
+}
+
+// query a host, a group or a broadcast address and print the answers,
+// every intv seconds if intv is set, printing only the hosts that changed
+int discover_scan(char *arg, int intv)
+{
+  struct discover_hdr hosts[1024];
+  struct in_addr haddrs[1024];
+  struct discover_hdr *query;
+  struct discover_hdr *hdr;
+  struct discover_dev *dev;
+  struct sockaddr_in saddr;
+  struct sockaddr_in from;
+  struct pollfd pfd;
+  socklen_t flen;
+  uint64_t end;
+  uint32_t nonce;
+  char qbuf[sizeof(discover_buf)];
+  char buf[sizeof(discover_buf)];
+  int opt = 1;
+  int nhost;
+  int len;
+  int h;
+  int i;
+  int s;
+
+  if (discover_parse(arg, &saddr))
+    return -1;
+  s = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s == -1)
+  {
+    perror("socket()");
+    return -1;
+  }
+  setsockopt(s, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(opt));
+
+  nhost = 0;
+  nonce = getpid();
+  pfd.fd = s;
+  pfd.events = POLLIN;
+  for (;;)
+  {
+    // a single host is asked whether its generation is still current,
+    // the query is padded to the largest answer
+    bzero(qbuf, sizeof(qbuf));
+    query = (struct discover_hdr *)qbuf;
+    memcpy(query->magic, DISCOVER_MAGIC, sizeof(query->magic));
+    query->v = DISCOVER_VERSION;
+    query->type = DISCOVER_QUERY;
+    query->nonce = htonl(++nonce);
+    if (nhost == 1 && !IN_MULTICAST(ntohl(saddr.sin_addr.s_addr)))
+      query->gen = hosts[0].gen;
+    if (sendto(s, qbuf, sizeof(qbuf), 0, (struct sockaddr *)&saddr,
+	       sizeof(saddr)) == -1)
+    {
+      perror("sendto()");
+      return -1;
+    }
+
+    for (end = timing_usec() + 1000000; timing_usec() < end;)
+    {
+      if (poll(&pfd, 1, (end - timing_usec()) / 1000 + 1) < 1)
+	continue;
+      flen = sizeof(from);
+      len = recvfrom(s, buf, sizeof(buf), 0, (struct sockaddr *)&from,
+		     &flen);
+      hdr = (struct discover_hdr *)buf;
+      if (len < 0 || discover_check(buf, len, DISCOVER_ANSWER) ||
+	  hdr->nonce != query->nonce || hdr->flags & DISCOVER_PAD)
+	continue;
+
+      // daemons sharing an address are told apart by their port
+      for (h = 0; h < nhost; h++)
+	if (haddrs[h].s_addr == from.sin_addr.s_addr &&
+	    hosts[h].port == hdr->port)
+	  break;
+      if (h < nhost && (hdr->flags & DISCOVER_UNCHANGED ||
+			hosts[h].gen == hdr->gen))
+	continue;
+      if (h == 1024)
+	continue;
+      if (h == nhost)
+	nhost++;
+      haddrs[h] = from.sin_addr;
+      memcpy(&hosts[h], hdr, sizeof(*hdr));
+
+      printf("%s:%hu generation %u, %d devices\n", inet_ntoa(from.sin_addr),
+	     ntohs(hdr->port), ntohl(hdr->gen), hdr->ndev);
+      dev = (struct discover_dev *)(hdr + 1);
+      for (i = 0; i < hdr->ndev; i++, dev++)
+	printf("  %.*s %04x:%04x class %02x%s\n", NET_USB_BUS_MAX, dev->bus,
+	       ntohs(dev->vid), ntohs(dev->pid), dev->class,
+	       dev->used ? " in use" : "");
+      fflush(stdout);
+    }
+    if (!intv)
+      break;
+    sleep(intv);
+  }
+  close(s);
+  return 0;
+}
@@ -0,0 +1,454 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <dev/usb/usb.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "fdcache.h"
+#include "log.h"
+#include "timing.h"
+
+// an endpoint the cache knows about, open or not, with what must be set
+// again when it is reopened; a pinned endpoint is never closed
+struct fdcache_ep
+{
+  int mode;
+  int short_xfer;
+  int timeout;
+  int pin;
+  uint64_t last;
+};
+
+struct fdcache_dev
+{
+  int *fd;
+  char ugen[16];
+  struct fdcache_ep eps[16];
+};
+
+// the endpoints a session holds open, and how many of them the others
+// asked it to close
+struct fdcache_slot
+{
+  volatile pid_t pid;
+  volatile int open;
+  volatile int evict;
+};
+
+// the endpoints open in all the sessions, -F bounds them daemon-wide
+struct fdcache_shm
+{
+  volatile int open;
+  volatile uint64_t requests;
+  struct fdcache_slot slot[FDCACHE_SESSIONS];
+};
+
+static struct fdcache_dev fdcache_devs[FDCACHE_DEVS];
+static struct fdcache_dev *fdcache_last = NULL;
+static struct fdcache_shm *fdcache_shm = NULL;
+static struct fdcache_slot *fdcache_slot = NULL;
+static pid_t fdcache_pid = 0;
+static int fdcache_max = 0;
+static int fdcache_open_n = 0;
+static uint64_t fdcache_hits = 0;
+static uint64_t fdcache_misses = 0;
+static uint64_t fdcache_evicts = 0;
+static uint64_t fdcache_usec = 0;
+static uint64_t fdcache_usec_max = 0;
+
+// the most endpoint fds the sessions keep open, 0 leaves it to the fd
+// limit of each process
+int fdcache_set(char *arg)
+{
+  char *end;
+  long v;
+
+  v = strtol(arg, &end, 10);
+  if (*end != '\0' || v < 1)
+    return -1;
+  fdcache_max = v;
+  return 0;
+}
+
+int fdcache_init(void)
+{
+  if (!fdcache_max)
+    return 0;
+  fdcache_shm = mmap(NULL, sizeof(*fdcache_shm), PROT_READ | PROT_WRITE,
+		     MAP_ANON | MAP_SHARED, -1, 0);
+  if (fdcache_shm == MAP_FAILED)
+  {
+    perror("mmap()");
+    fdcache_shm = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+void fdcache_confine(void)
+{
+  if (fdcache_shm != NULL)
+    munmap(fdcache_shm, sizeof(*fdcache_shm));
+  fdcache_shm = NULL;
+  fdcache_slot = NULL;
+}
+
+// forget the endpoints of the sessions which are gone
+void fdcache_reclaim(void)
+{
+  struct fdcache_slot *slot;
+  pid_t owner;
+  int i;
+
+  for (i = 0; i < FDCACHE_SESSIONS; i++)
+  {
+    slot = &fdcache_shm->slot[i];
+    owner = slot->pid;
+    if (owner <= 0 || kill(owner, 0) == 0 || errno != ESRCH ||
+	!__sync_bool_compare_and_swap(&slot->pid, owner, -1))
+      continue;
+    __sync_sub_and_fetch(&fdcache_shm->open, slot->open);
+    slot->open = 0;
+    slot->evict = 0;
+    __sync_synchronize();
+    slot->pid = 0;
+  }
+}
+
+// count endpoints opened or closed by this process, in a slot of its
+// own: a process forked by a session does not count in its parent's
+void fdcache_count(int n)
+{
+  pid_t pid;
+  int i;
+
+  fdcache_open_n += n;
+  if (fdcache_shm == NULL)
+    return;
+  pid = getpid();
+  if (fdcache_pid != pid)
+  {
+    fdcache_pid = pid;
+    fdcache_slot = NULL;
+    fdcache_reclaim();
+    for (i = 0; i < FDCACHE_SESSIONS && fdcache_slot == NULL; i++)
+      if (__sync_bool_compare_and_swap(&fdcache_shm->slot[i].pid, 0, pid))
+	fdcache_slot = &fdcache_shm->slot[i];
+  }
+  if (fdcache_slot != NULL)
+    fdcache_slot->open += n;
+  __sync_add_and_fetch(&fdcache_shm->open, n);
+}
+
+struct fdcache_dev *fdcache_find(int *fd, char *ugen)
+{
+  struct fdcache_dev *free_dev;
+  int i;
+
+  if (fdcache_last != NULL && fdcache_last->fd == fd)
+    return fdcache_last;
+  free_dev = NULL;
+  for (i = 0; i < FDCACHE_DEVS; i++)
+  {
+    if (fdcache_devs[i].fd == fd)
+      return fdcache_last = &fdcache_devs[i];
+    if (fdcache_devs[i].fd == NULL && free_dev == NULL)
+      free_dev = &fdcache_devs[i];
+  }
+  if (ugen == NULL || free_dev == NULL)
+    return NULL;
+  bzero(free_dev, sizeof(*free_dev));
+  for (i = 0; i < 16; i++)
+    fd[i] = -1;
+  free_dev->fd = fd;
+  strlcpy(free_dev->ugen, ugen, sizeof(free_dev->ugen));
+  return fdcache_last = free_dev;
+}
+
+// close the least recently used endpoint, the control endpoints and the
+// pinned ones are never closed and the ones in use are spared unless
+// forced
+int fdcache_evict(int force)
+{
+  struct fdcache_dev *dev;
+  uint64_t now;
+  int *lru;
+  int i;
+  int e;
+
+  now = timing_usec();
+  lru = NULL;
+  dev = NULL;
+  for (i = 0; i < FDCACHE_DEVS; i++)
+  {
+    if (fdcache_devs[i].fd == NULL)
+      continue;
+    for (e = 1; e < 16; e++)
+    {
+      if (fdcache_devs[i].fd[e] == -1 || fdcache_devs[i].eps[e].pin ||
+	  (!force && now - fdcache_devs[i].eps[e].last < FDCACHE_HOT * 1000))
+	continue;
+      if (lru == NULL ||
+	  fdcache_devs[i].eps[e].last < dev->eps[lru - dev->fd].last)
+      {
+	dev = &fdcache_devs[i];
+	lru = &dev->fd[e];
+      }
+    }
+  }
+  if (lru == NULL)
+    return -1;
+  close(*lru);
+  *lru = -1;
+  fdcache_count(-1);
+  fdcache_evicts++;
+  return 0;
+}
+
+// the sessions are over the limit and this one has nothing to close:
+// the session holding the most endpoints not already asked for is asked
+// to close one
+void fdcache_request(void)
+{
+  struct fdcache_slot *victim;
+  struct fdcache_slot *slot;
+  int i;
+
+  fdcache_reclaim();
+  victim = NULL;
+  for (i = 0; i < FDCACHE_SESSIONS; i++)
+  {
+    slot = &fdcache_shm->slot[i];
+    if (slot->pid > 0 && slot != fdcache_slot &&
+	(victim == NULL ||
+	 slot->open - slot->evict > victim->open - victim->evict))
+      victim = slot;
+  }
+  if (victim == NULL || victim->open - victim->evict <= 0)
+    return;
+  __sync_add_and_fetch(&victim->evict, 1);
+  __sync_add_and_fetch(&fdcache_shm->requests, 1);
+}
+
+// close what the other sessions asked for while the sessions are still
+// over the limit; a request this session cannot honor yet, all its
+// endpoints being in use, waits for them to cool down
+void fdcache_honor(void)
+{
+  while (fdcache_slot->evict > 0)
+  {
+    if (fdcache_shm->open <= fdcache_max)
+    {
+      fdcache_slot->evict = 0;
+      break;
+    }
+    if (fdcache_evict(0))
+      break;
+    __sync_sub_and_fetch(&fdcache_slot->evict, 1);
+  }
+}
+
+// open an endpoint as it was first opened, making room if needed
+int fdcache_reopen(struct fdcache_dev *dev, int endp, int mode)
+{
+  char path[64];
+  int fd;
+
+  snprintf(path, sizeof(path), "/dev/ugen%s.%02d", dev->ugen, endp);
+  if (fdcache_max && (fdcache_shm != NULL ? fdcache_shm->open :
+		      fdcache_open_n) >= fdcache_max &&
+      fdcache_evict(0) && fdcache_shm != NULL)
+    fdcache_request();
+  while ((fd = open(path, mode)) == -1 && (errno == EMFILE ||
+					    errno == ENFILE))
+    if (fdcache_evict(1))
+      return -1;
+  if (fd == -1)
+    return -1;
+  fdcache_count(1);
+  dev->fd[endp] = fd;
+  if (dev->eps[endp].short_xfer)
+    ioctl(fd, USB_SET_SHORT_XFER, &dev->eps[endp].short_xfer);
+  if (dev->eps[endp].timeout)
+    ioctl(fd, USB_SET_TIMEOUT, &dev->eps[endp].timeout);
+  return 0;
+}
+
+// open an endpoint read-write if possible, in one direction otherwise,
+// fd[endp] is -1 for a missing endpoint
+int fdcache_open(char *ugen, int *fd, int endp, char *addr)
+{
+  static int modes[3] = { O_RDWR, O_RDONLY, O_WRONLY };
+  struct fdcache_dev *dev;
+  int i;
+
+  fd[endp] = -1;
+  dev = fdcache_find(fd, ugen);
+  if (dev == NULL)
+    return -1;
+  bzero(&dev->eps[endp], sizeof(dev->eps[endp]));
+  for (i = 0; i < (endp ? 3 : 1) && fd[endp] == -1; i++)
+    if (fdcache_reopen(dev, endp, modes[i]) == 0)
+      dev->eps[endp].mode = modes[i] + 1;
+  if (fd[endp] == -1 || endp == 0)
+    return 0;
+  dev->eps[endp].last = timing_usec();
+  if (fdcache_ioctl(fd, endp, USB_SET_SHORT_XFER, 1) == -1)
+    log_printf(LOG_ERR, "%s: cannot set short transfers on endp%d\n",
+	       addr, endp);
+  return 0;
+}
+
+// the fd of an endpoint, reopened if it was closed to make room
+int fdcache_get(int *fd, int endp)
+{
+  struct fdcache_dev *dev;
+  uint64_t t0;
+  uint64_t t;
+
+  dev = fdcache_find(fd, NULL);
+  if (fd[endp] != -1 || endp == 0)
+  {
+    fdcache_hits++;
+    if (dev != NULL)
+      dev->eps[endp].last = timing_usec();
+    // the endpoint is now the most recent one, it is not closed
+    if (fdcache_slot != NULL && fdcache_slot->evict)
+      fdcache_honor();
+    return fd[endp];
+  }
+  if (dev == NULL || dev->eps[endp].mode == 0)
+    return -1;
+
+  fdcache_misses++;
+  t0 = timing_usec();
+  if (fdcache_reopen(dev, endp, dev->eps[endp].mode - 1))
+    return -1;
+  dev->eps[endp].last = timing_usec();
+  t = dev->eps[endp].last - t0;
+  fdcache_usec += t;
+  if (t > fdcache_usec_max)
+    fdcache_usec_max = t;
+  if (fdcache_slot != NULL && fdcache_slot->evict)
+    fdcache_honor();
+  return fd[endp];
+}
+
+// pin the interrupt, isochronous and control endpoints of the current
+// configuration: a reopen loses their timing and the data the device
+// queued for them, only bulk endpoints can wait for one
+void fdcache_types(int *fd, uint8_t *types)
+{
+  struct fdcache_dev *dev;
+  int e;
+
+  dev = fdcache_find(fd, NULL);
+  if (dev == NULL)
+    return;
+  for (e = 1; e < 16; e++)
+    dev->eps[e].pin = dev->eps[e].mode != 0 && types[e] != UE_BULK;
+}
+
+// settings of an endpoint survive its reopening
+int fdcache_ioctl(int *fd, int endp, unsigned long req, int val)
+{
+  struct fdcache_dev *dev;
+  int f;
+
+  f = fdcache_get(fd, endp);
+  if (f == -1)
+    return -1;
+  dev = fdcache_find(fd, NULL);
+  if (dev != NULL && req == USB_SET_SHORT_XFER)
+    dev->eps[endp].short_xfer = val;
+  if (dev != NULL && req == USB_SET_TIMEOUT)
+    dev->eps[endp].timeout = val;
+  return ioctl(f, req, &val);
+}
+
+void fdcache_close(int *fd, int endp)
+{
+  struct fdcache_dev *dev;
+  int e;
+
+  if (fd[endp] != -1)
+  {
+    close(fd[endp]);
+    fd[endp] = -1;
+    fdcache_count(-1);
+  }
+  dev = fdcache_find(fd, NULL);
+  if (dev == NULL)
+    return;
+  dev->eps[endp].mode = 0;
+  for (e = 0; e < 16 && dev->eps[e].mode == 0; e++)
+    ;
+  if (e == 16)
+  {
+    dev->fd = NULL;
+    fdcache_last = NULL;
+  }
+}
+
+void fdcache_report(char *addr)
+{
+  if (!fdcache_misses)
+    return;
+  log_printf(LOG_INFO, "%s: fd cache hit rate %.1f%%, %llu reopens of "
+	     "%llu usec on average, %llu max, %llu evictions\n", addr,
+	     100.0 * fdcache_hits / (fdcache_hits + fdcache_misses),
+	     (unsigned long long)fdcache_misses,
+	     (unsigned long long)(fdcache_usec / fdcache_misses),
+	     (unsigned long long)fdcache_usec_max,
+	     (unsigned long long)fdcache_evicts);
+}
+
+void fdcache_dump(void)
+{
+  if (fdcache_shm == NULL)
+    return;
+  // the sessions which ended no longer count
+  fdcache_reclaim();
+  printf("fdcache: %d endpoints open, limit %d, %llu close requests\n",
+	 fdcache_shm->open, fdcache_max,
+	 (unsigned long long)fdcache_shm->requests);
+  fflush(stdout);
+}
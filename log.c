@@ -0,0 +1,400 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "log.h"
+#include "timing.h"
+
+#define LOG_RINGS 256
+#define LOG_RING_SIZE 16384
+#define LOG_LINE_MAX 512
+#define LOG_SITES 256
+#define LOG_BURST 10
+#define LOG_WINDOW 1000000
+#define LOG_DRAIN 10000
+
+// messages of one process, written by it only and read by the writer
+struct log_ring
+{
+  volatile pid_t pid;
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  volatile uint32_t dropped;
+  char data[LOG_RING_SIZE];
+};
+
+// a call site, told apart by its format string
+struct log_site
+{
+  const char *fmt;
+  uint64_t t;
+  int n;
+  int suppressed;
+};
+
+static int log_level = LOG_INFO;
+static int log_syslog = 0;
+static char *log_rings = NULL;
+static size_t log_stride;
+static struct log_ring *log_ring = NULL;
+static pid_t log_pid = 0;
+static struct log_site log_sites[LOG_SITES];
+
+static char *log_levels[] =
+{
+  "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+int log_set_level(char *arg)
+{
+  int i;
+
+  for (i = 0; i <= LOG_DEBUG; i++)
+    if (strcmp(arg, log_levels[i]) == 0)
+    {
+      log_level = i;
+      return 0;
+    }
+  return -1;
+}
+
+void log_set_syslog(void)
+{
+  log_syslog = 1;
+  openlog("openusbipd", LOG_NDELAY, LOG_DAEMON);
+}
+
+void log_output(int level, char *line)
+{
+  if (log_syslog)
+    syslog(level, "%s", line);
+  else
+    fputs(line, stdout);
+}
+
+// copy in or out of a ring, across its end if needed
+void log_copy(char *dst, char *src, int len, int to_ring, uint32_t off)
+{
+  int n;
+
+  off %= LOG_RING_SIZE;
+  n = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : len;
+  if (to_ring)
+  {
+    memcpy(dst + off, src, n);
+    memcpy(dst, src + n, len - n);
+  }
+  else
+  {
+    memcpy(dst, src + off, n);
+    memcpy(dst + n, src, len - n);
+  }
+}
+
+// rings start on a page of their own, so that a process can be left
+// with access to its own ring only
+struct log_ring *log_ring_at(int i)
+{
+  return (struct log_ring *)(log_rings + i * log_stride);
+}
+
+// the ring of this process, taken at its first message
+struct log_ring *log_claim(void)
+{
+  pid_t pid;
+  int i;
+
+  pid = getpid();
+  if (pid == log_pid)
+    return log_ring;
+  log_pid = pid;
+  log_ring = NULL;
+  bzero(log_sites, sizeof(log_sites));
+  for (i = 0; i < LOG_RINGS; i++)
+    if (__sync_bool_compare_and_swap(&log_ring_at(i)->pid, 0, pid))
+    {
+      log_ring = log_ring_at(i);
+      break;
+    }
+  return log_ring;
+}
+
+void log_put(int level, char *line, int len)
+{
+  struct log_ring *ring;
+  uint8_t hdr[3];
+
+  // before the writer runs, and for the processes left without a ring
+  if (log_rings == NULL || (ring = log_claim()) == NULL)
+  {
+    log_output(level, line);
+    if (!log_syslog)
+      fflush(stdout);
+    return;
+  }
+
+  if (LOG_RING_SIZE - (ring->head - ring->tail) < sizeof(hdr) + len)
+  {
+    ring->dropped++;
+    return;
+  }
+  hdr[0] = len >> 8;
+  hdr[1] = len;
+  hdr[2] = level;
+  log_copy(ring->data, (char *)hdr, sizeof(hdr), 1, ring->head);
+  log_copy(ring->data, line, len, 1, ring->head + sizeof(hdr));
+  __sync_synchronize();
+  ring->head += sizeof(hdr) + len;
+}
+
+struct log_site *log_site(const char *fmt)
+{
+  struct log_site *site;
+  int i;
+  int n;
+
+  i = ((uintptr_t)fmt >> 3) % LOG_SITES;
+  for (n = 0; n < LOG_SITES; n++, i = (i + 1) % LOG_SITES)
+  {
+    site = &log_sites[i];
+    if (site->fmt == fmt)
+      return site;
+    if (site->fmt == NULL)
+    {
+      site->fmt = fmt;
+      return site;
+    }
+  }
+  return NULL;
+}
+
+void log_suppressed(struct log_site *site)
+{
+  char line[LOG_LINE_MAX];
+  int len;
+
+  len = snprintf(line, sizeof(line), "log: %d more messages like \"%.*s\"\n",
+		 site->suppressed, (int)strcspn(site->fmt, "\n"), site->fmt);
+  if (len >= sizeof(line))
+    len = sizeof(line) - 1;
+  site->suppressed = 0;
+  log_put(LOG_NOTICE, line, len);
+}
+
+// no more than LOG_BURST messages per site and second, the others are
+// counted and summed up once the site logs again or the process exits
+void log_printf(int level, const char *fmt, ...)
+{
+  char line[LOG_LINE_MAX];
+  struct log_site *site;
+  va_list ap;
+  uint64_t now;
+  int len;
+
+  if (level > log_level)
+    return;
+
+  if (log_rings != NULL)
+    log_claim();
+  site = log_site(fmt);
+  if (site != NULL)
+  {
+    now = timing_usec();
+    if (now - site->t >= LOG_WINDOW)
+    {
+      if (site->suppressed)
+	log_suppressed(site);
+      site->t = now;
+      site->n = 0;
+    }
+    if (++site->n > LOG_BURST)
+    {
+      site->suppressed++;
+      return;
+    }
+  }
+
+  va_start(ap, fmt);
+  len = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  if (len < 0)
+    return;
+  if (len >= sizeof(line))
+    len = sizeof(line) - 1;
+  log_put(level, line, len);
+}
+
+void log_drain(void)
+{
+  char line[LOG_LINE_MAX];
+  struct log_ring *ring;
+  uint8_t hdr[3];
+  uint32_t dropped;
+  uint32_t head;
+  uint32_t tail;
+  uint32_t len;
+  int i;
+
+  for (i = 0; i < LOG_RINGS; i++)
+  {
+    ring = log_ring_at(i);
+    if (ring->pid == 0)
+      continue;
+    head = ring->head;
+    tail = ring->tail;
+    while (tail != head)
+    {
+      __sync_synchronize();
+      // the ring is written by a process which may not be trusted, its
+      // content is checked against what fits in the ring and in a line
+      len = LOG_LINE_MAX;
+      if (head - tail >= sizeof(hdr) && head - tail <= LOG_RING_SIZE)
+      {
+	log_copy((char *)hdr, ring->data, sizeof(hdr), 0, tail);
+	len = hdr[0] << 8 | hdr[1];
+      }
+      if (len >= LOG_LINE_MAX || len > head - tail - sizeof(hdr))
+      {
+	snprintf(line, sizeof(line), "log: ring of process %d corrupted, "
+		 "its messages are dropped\n", (int)ring->pid);
+	log_output(LOG_WARNING, line);
+	ring->tail = head;
+	break;
+      }
+      log_copy(line, ring->data, len, 0, tail + sizeof(hdr));
+      line[len] = '\0';
+      tail += sizeof(hdr) + len;
+      __sync_synchronize();
+      ring->tail = tail;
+      log_output(hdr[2], line);
+    }
+    dropped = ring->dropped;
+    if (dropped)
+    {
+      __sync_sub_and_fetch(&ring->dropped, dropped);
+      snprintf(line, sizeof(line), "log: %u messages of process %d lost\n",
+	       dropped, (int)ring->pid);
+      log_output(LOG_WARNING, line);
+    }
+    // the ring of a finished process is free once read
+    if (kill(ring->pid, 0) == -1 && errno == ESRCH &&
+	ring->tail == ring->head)
+      ring->pid = 0;
+  }
+  if (!log_syslog)
+    fflush(stdout);
+}
+
+// give the summaries of the suppressed messages before exiting
+void log_stop(void)
+{
+  int i;
+
+  if (log_pid != getpid())
+    return;
+  for (i = 0; i < LOG_SITES; i++)
+    if (log_sites[i].suppressed)
+      log_suppressed(&log_sites[i]);
+}
+
+// an unprivileged process keeps access to its own ring only, the rings of
+// the other processes are no longer mapped for it
+void log_confine(void)
+{
+  struct log_ring *ring;
+  char *start;
+  char *end;
+
+  if (log_rings == NULL)
+    return;
+  ring = log_claim();
+  end = log_rings + LOG_RINGS * log_stride;
+  if (ring == NULL)
+  {
+    munmap(log_rings, end - log_rings);
+    log_rings = NULL;
+    return;
+  }
+  start = (char *)ring;
+  if (start > log_rings)
+    munmap(log_rings, start - log_rings);
+  if (start + log_stride < end)
+    munmap(start + log_stride, end - start - log_stride);
+}
+
+// the writer drains the rings of all the processes of the daemon, which
+// never wait on stdout or syslog themselves
+int log_start(void)
+{
+  long page;
+
+  page = sysconf(_SC_PAGESIZE);
+  if (page <= 0)
+    page = 4096;
+  log_stride = (sizeof(struct log_ring) + page - 1) / page * page;
+  log_rings = mmap(NULL, LOG_RINGS * log_stride,
+		   PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+  if (log_rings == MAP_FAILED)
+  {
+    perror("mmap()");
+    log_rings = NULL;
+    return -1;
+  }
+  atexit(log_stop);
+
+  fflush(stdout);
+  switch (fork())
+  {
+  case -1:
+    perror("fork()");
+    return -1;
+  case 0:
+    // exit with the daemon, after a last look at the rings
+    while (getppid() != 1)
+    {
+      log_drain();
+      usleep(LOG_DRAIN);
+    }
+    log_drain();
+    _exit(EXIT_SUCCESS);
+  }
+  return 0;
+}
@@ -31,16 +31,223 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
 
+#include "bot.h"
+#include "budget.h"
+#include "discover.h"
+#include "fdcache.h"
+#include "log.h"
 #include "net.h"
+#include "privsep.h"
 #include "process.h"
+#include "profile.h"
+#include "query.h"
+#include "record.h"
+#include "relay.h"
+#include "replay.h"
+#include "session.h"
+#include "shaper.h"
+#include "tune.h"
+#include "tunnel.h"
+
+volatile sig_atomic_t info_pending = 0;
+
+void info_handler(int sig)
+{
+  info_pending = 1;
+}
+
+// SIGUSR1 dumps the live counters of the daemon
+void info(void)
+{
+  if (!info_pending)
+    return;
+  info_pending = 0;
+  shaper_dump();
+  budget_dump();
+  query_dump();
+  fdcache_dump();
+}
+
+void usage(void)
+{
+  fprintf(stderr, "usage: openusbipd [-AbfPSTW] [-C address] "
+	  "[-d address[:port]] [-F fds]\n"
+	  "                  [-g seconds] [-i seconds] [-L level] "
+	  "[-l address]\n"
+	  "                  [-M kbytes] [-m kbytes] [-p port] "
+	  "[-Q address[:port]]\n"
+	  "                  [-R file] [-r file] "
+	  "[-s level[@key]=rate[/burst]] [-t unit]\n"
+	  "                  [-u address[:port]] [-w min[:max]]\n");
+  exit(EXIT_FAILURE);
+}
 
 int main(int ac, char **av)
 {
+  char *laddr = "0.0.0.0";
+  char *caddr = NULL;
+  char *replay = NULL;
+  char *scan = NULL;
+  char *probe = NULL;
+  struct sigaction sa;
+  int port = 3240;
+  int fast = 0;
+  int intv = 5;
+  int repeat = 0;
+  int ch;
   int s;
 
-  s = net_listen(3240, "0.0.0.0");
-  net_serve(s, process_client);
+  while ((ch = getopt(ac, av, "AbC:d:F:fg:i:L:l:M:m:Pp:Q:R:r:Ss:Tt:u:Ww:")) != -1)
+    switch (ch)
+    {
+    case 'A':
+      if (profile_enable())
+	return EXIT_FAILURE;
+      break;
+    case 'b':
+      if (bot_enable())
+      {
+	perror("malloc()");
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'C':
+      caddr = optarg;
+      break;
+    case 'd':
+      if (discover_set(optarg))
+	usage();
+      break;
+    case 'F':
+      if (fdcache_set(optarg))
+	usage();
+      break;
+    case 'f':
+      fast = 1;
+      break;
+    case 'g':
+      if (atoi(optarg) < 0)
+	usage();
+      session_set_grace(atoi(optarg));
+      break;
+    case 'i':
+      intv = atoi(optarg);
+      if (intv <= 0)
+	usage();
+      repeat = intv;
+      break;
+    case 'L':
+      if (log_set_level(optarg))
+	usage();
+      break;
+    case 'l':
+      laddr = optarg;
+      break;
+    case 'M':
+      if (budget_set(optarg, 1))
+	usage();
+      break;
+    case 'm':
+      if (budget_set(optarg, 0))
+	usage();
+      break;
+    case 'P':
+      privsep_enable();
+      break;
+    case 'p':
+      port = atoi(optarg);
+      if (port <= 0 || port > 65535)
+	usage();
+      break;
+    case 'Q':
+      scan = optarg;
+      break;
+    case 'R':
+      replay = optarg;
+      break;
+    case 'r':
+      record_open(optarg);
+      break;
+    case 'S':
+      log_set_syslog();
+      break;
+    case 's':
+      if (shaper_add(optarg))
+	usage();
+      break;
+    case 'T':
+      tunnel_enable();
+      break;
+    case 't':
+      probe = optarg;
+      break;
+    case 'u':
+      if (relay_add(optarg))
+	usage();
+      break;
+    case 'W':
+      query_persist();
+      break;
+    case 'w':
+      if (tune_set(optarg))
+	usage();
+      break;
+    default:
+      usage();
+    }
+
+  if (replay != NULL && replay_load(replay, fast))
+    return EXIT_FAILURE;
+
+  // replay the client side of a capture against a running daemon
+  if (caddr != NULL)
+  {
+    if (replay == NULL)
+      usage();
+    return replay_client(caddr, port) ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  // measure a device, or the capture's simulated one, without network
+  if (probe != NULL)
+  {
+    if (replay != NULL)
+      return replay_probe() ? EXIT_FAILURE : EXIT_SUCCESS;
+    return process_probe(probe) ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  // look for daemons instead of being one
+  if (scan != NULL)
+    return discover_scan(scan, repeat) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  if (shaper_init() || budget_init() || query_init() || fdcache_init() ||
+      log_start())
+    return EXIT_FAILURE;
+
+  bzero(&sa, sizeof(sa));
+  sa.sa_handler = info_handler;
+  sigaction(SIGUSR1, &sa, NULL);
+
+  s = net_listen(port, laddr);
+  if (replay != NULL)
+    net_serve(s, replay_serve, info);
+  else if (relay_enabled())
+  {
+    // export the devices of the upstream daemons instead of ours
+    if (relay_start(intv))
+      return EXIT_FAILURE;
+    net_serve(s, relay_serve, info);
+  }
+  else
+  {
+    query_start();
+    if (discover_start(port, intv))
+      return EXIT_FAILURE;
+    net_serve(s, process_client, info);
+  }
 
   return EXIT_SUCCESS;
 }
@@ -38,6 +38,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
 
 #include "net.h"
 
@@ -67,7 +68,34 @@ int net_listen(unsigned short port, char *addr)
   return s;
 }
 
-void net_serve(int s, void (*serve_fct)(int s, char *addr))
+int net_connect(char *addr, unsigned short port)
+{
+  struct sockaddr_in saddr;
+  int s;
+
+  s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s == -1)
+  {
+    perror("socket()");
+    return -1;
+  }
+
+  saddr.sin_family = AF_INET;
+  saddr.sin_port = htons(port);
+  saddr.sin_addr.s_addr = inet_addr(addr);
+
+  if (connect(s, (struct sockaddr*)&saddr, sizeof(saddr)) == -1)
+  {
+    perror("connect()");
+    close(s);
+    return -1;
+  }
+
+  return s;
+}
+
+void net_serve(int s, void (*serve_fct)(int s, char *addr),
+	       void (*idle_fct)(void))
 {
   struct sockaddr_in addr;
   socklen_t alen;
@@ -76,12 +104,20 @@ void net_serve(int s, void (*serve_fct)(int s, char *addr))
   int cs;
 
   signal(SIGCHLD, SIG_IGN);
+  // a client gone with answers in flight ends its session through the
+  // write errors, which still get to report and learn from it
+  signal(SIGPIPE, SIG_IGN);
   for (;;)
   {
     alen = sizeof(addr);
     cs = accept(s, (struct sockaddr *)&addr, &alen);
     if (cs == -1)
+    {
+      // interrupted by a signal, let the caller handle it
+      if (idle_fct != NULL)
+	idle_fct();
       continue;
+    }
 
     if (asprintf(&caddr, "%s:%hu", inet_ntoa(addr.sin_addr),
 		 ntohs(addr.sin_port)) < 0)
@@ -92,6 +128,7 @@ void net_serve(int s, void (*serve_fct)(int s, char *addr))
     {
     case 0:
       close(s);
+      signal(SIGUSR1, SIG_IGN);
       serve_fct(cs, caddr);
       exit(EXIT_SUCCESS);
       break;
@@ -153,7 +190,7 @@ int net_read(int s, void *buf, int len)
   while (len > 0)
   {
     ret = read(s, buf + toread, len);
-    if (ret < 0)
+    if (ret <= 0)
       return -1;
     toread += ret;
     len -= ret;
@@ -185,6 +222,16 @@ int net_read_hdr(int s, struct net_generic *hdr)
   return 0;
 }
 
+// whether the next request already waits in the socket
+int net_pending(int s)
+{
+  struct pollfd pfd;
+
+  pfd.fd = s;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) == 1;
+}
+
 void net_no_delay(int s)
 {
   int opt = 1;
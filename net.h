@@ -44,6 +44,10 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define NET_OP_RIMPORT 0x8003
 #define NET_OP_SIMPORT 0x0003
 
+// between two openusbipd, not part of USB/IP
+#define NET_OP_RTUNNEL 0x80f3
+#define NET_OP_STUNNEL 0x00f3
+
 struct net_op
 {
   uint16_t v;
@@ -127,16 +131,20 @@ struct net_unlink_ret
 {
   struct net_hdr hdr;
   int32_t ret;
-};
+  char pad[24];
+} __attribute__((packed));
 
 int net_listen(unsigned short port, char *addr);
-void net_serve(int s, void (*serve_fct)(int s, char *addr));
+int net_connect(char *addr, unsigned short port);
+void net_serve(int s, void (*serve_fct)(int s, char *addr),
+	       void (*idle_fct)(void));
 int net_read_op(int s, struct net_op *op);
 int net_send_op(int s, uint16_t op, uint32_t res);
 int net_send(int s, void *buf, int len);
 int net_read(int s, void *buf, int len);
 int net_read_import(int s, char *bus);
 int net_read_hdr(int s, struct net_generic *hdr);
+int net_pending(int s);
 void net_no_delay(int s);
 
 #endif
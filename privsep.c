@@ -0,0 +1,451 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <grp.h>
+#include <poll.h>
+#include <pwd.h>
+
+#include "budget.h"
+#include "discover.h"
+#include "fdcache.h"
+#include "log.h"
+#include "net.h"
+#include "privsep.h"
+#include "process.h"
+#include "profile.h"
+#include "query.h"
+#include "record.h"
+#include "shaper.h"
+#include "tune.h"
+#include "wheel.h"
+
+// a slot is filled by the network process, executed in place by the
+// device process and sent back from the same memory, payloads are never
+// copied between the processes
+struct privsep_slot
+{
+  struct net_submit submit;
+  int refused;
+  int size;
+  int res;
+  int len;
+  uint64_t due;
+  char buf[PROCESS_BUF_MAX];
+};
+
+// what the network process alone knows of a slot: the timer of its
+// deadline or of its unlink grace, and whether the client already got
+// its answer
+struct privsep_pending
+{
+  struct wheel_timer timer;
+  uint32_t unlink;
+  int answered;
+};
+
+// submitted is only written by the network process and completed only
+// by the device process, the wait flags tell the other side a doorbell
+// byte is needed to wake it up. The network process cannot write the
+// shared accounts, it tells the bytes its session holds and its largest
+// socket buffers here instead, and is told what was charged for it
+struct privsep_ring
+{
+  volatile uint32_t submitted;
+  volatile uint32_t completed;
+  volatile uint32_t dev_wait;
+  volatile uint32_t net_wait;
+  volatile uint64_t used;
+  volatile uint64_t charged;
+  volatile int peak;
+  struct privsep_slot slot[PRIVSEP_SLOTS];
+};
+
+static int privsep = 0;
+static struct privsep_pending privsep_pending[PRIVSEP_SLOTS];
+static struct privsep_ring *privsep_ring;
+static int privsep_s;
+static char *privsep_addr;
+
+void privsep_enable(void)
+{
+  privsep = 1;
+}
+
+int privsep_enabled(void)
+{
+  return privsep;
+}
+
+void privsep_drop(int *fd, int fd_n, struct privsep_ring *ring)
+{
+  struct passwd *pw;
+  int i;
+
+  for (i = 0; i < fd_n; i++)
+    if (fd[i] != -1)
+      close(fd[i]);
+
+  // the network process gets its log ring before anything can go wrong,
+  // and keeps none of the other shared segments root trusts
+  log_confine();
+  shaper_confine();
+  budget_confine(&ring->charged);
+  query_confine();
+  discover_confine();
+  fdcache_confine();
+  profile_confine();
+  pw = getpwnam(PRIVSEP_USER);
+  if (pw == NULL)
+  {
+    log_printf(LOG_ERR, "privsep: unknown user %s\n", PRIVSEP_USER);
+    exit(EXIT_FAILURE);
+  }
+  if (chroot(pw->pw_dir) == -1 || chdir("/") == -1)
+  {
+    perror("chroot()");
+    exit(EXIT_FAILURE);
+  }
+  if (setgroups(1, &pw->pw_gid) == -1 ||
+      setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) == -1 ||
+      setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid) == -1)
+  {
+    perror("cannot drop privileges");
+    exit(EXIT_FAILURE);
+  }
+#ifdef __OpenBSD__
+  if (pledge("stdio", NULL) == -1)
+  {
+    perror("pledge()");
+    exit(EXIT_FAILURE);
+  }
+#endif
+}
+
+// the device did not answer in time: an unlinked URB is given back to
+// the client as such, a control request fails, and the late answer is
+// dropped
+void privsep_expire(void *arg)
+{
+  struct privsep_pending *pending = arg;
+  struct privsep_slot *slot;
+
+  slot = &privsep_ring->slot[pending - privsep_pending];
+  pending->answered = 1;
+  if (pending->unlink)
+  {
+    process_send_unlink_ret(privsep_s, pending->unlink, -ECONNRESET,
+			    privsep_addr);
+    tune_ret(0);
+  }
+  else
+  {
+    log_printf(LOG_WARNING, "%s: control request %u timed out\n",
+	       privsep_addr, slot->submit.hdr.seq);
+    process_send_ret(privsep_s, &slot->submit, -ETIMEDOUT, NULL, 0,
+		     privsep_addr);
+  }
+}
+
+// the URB unlinked gets a grace period to complete, unlinks of answered
+// URBs are answered at once
+void privsep_unlink(struct net_unlink *unlink, uint32_t head, uint32_t tail)
+{
+  struct privsep_pending *pending;
+  uint32_t seq;
+  uint32_t i;
+
+  record_unlink(unlink);
+  seq = ntohl(unlink->seq);
+  if (process_held_unlink(privsep_s, seq, unlink->hdr.seq, privsep_addr))
+    return;
+  for (i = tail; i != head; i++)
+  {
+    pending = &privsep_pending[i % PRIVSEP_SLOTS];
+    if (privsep_ring->slot[i % PRIVSEP_SLOTS].submit.hdr.seq != seq ||
+	pending->answered)
+      continue;
+    pending->unlink = unlink->hdr.seq;
+    wheel_add(&pending->timer, PRIVSEP_GRACE * 1000, privsep_expire,
+	      pending);
+    return;
+  }
+  process_send_unlink_ret(privsep_s, unlink->hdr.seq, 0, privsep_addr);
+}
+
+void privsep_net(int s, int db, struct privsep_ring *ring, char *addr)
+{
+  struct privsep_pending *pending;
+  struct privsep_slot *slot;
+  struct net_generic hdr;
+  struct pollfd pfd[2];
+  char c[64];
+  uint32_t head;
+  uint32_t tail;
+  int full;
+  int size;
+
+  head = 0;
+  tail = 0;
+  privsep_ring = ring;
+  privsep_s = s;
+  privsep_addr = addr;
+  pfd[0].fd = s;
+  pfd[1].fd = db;
+  pfd[1].events = POLLIN;
+  for (;;)
+  {
+    // answers go back in submission order
+    while (tail != ring->completed)
+    {
+      __sync_synchronize();
+      slot = &ring->slot[tail % PRIVSEP_SLOTS];
+      pending = &privsep_pending[tail % PRIVSEP_SLOTS];
+      wheel_del(&pending->timer);
+      size = slot->size;
+      if (!pending->answered && slot->len >= 0 && !pending->unlink &&
+	  process_hold(s, &slot->submit, slot->res, slot->buf, slot->len,
+		       size, slot->due, addr))
+	size = 0;
+      else if (!pending->answered && slot->len >= 0)
+	process_send_ret(s, &slot->submit, slot->res, slot->buf, slot->len,
+			 addr);
+      else if (!pending->answered)
+	tune_ret(0);
+      if (!pending->answered && pending->unlink)
+	process_send_unlink_ret(s, pending->unlink, 0, addr);
+      budget_release(size);
+      tail++;
+    }
+    // answers sent here and by the timers free budget the device process
+    // gives back when it wakes up
+    if (budget_held() < ring->used && ring->dev_wait)
+      write(db, "", 1);
+    ring->used = budget_held();
+
+    ring->net_wait = 1;
+    __sync_synchronize();
+    if (tail != ring->completed)
+    {
+      ring->net_wait = 0;
+      continue;
+    }
+    // once the ring or the budget is full the client is not read, TCP
+    // then pushes back on it
+    full = head - tail == PRIVSEP_SLOTS || budget_full();
+    pfd[0].events = full ? 0 : POLLIN;
+    if (wheel_poll(pfd, 2, full && head == tail ? 10 : -1) == -1)
+      return;
+    ring->net_wait = 0;
+
+    if (pfd[1].revents && read(db, c, sizeof(c)) <= 0)
+      return;
+    if (!pfd[0].revents)
+      continue;
+
+    if (net_read_hdr(s, &hdr))
+      return;
+    switch(hdr.hdr.cmd)
+    {
+    case 1:
+      slot = &ring->slot[head % PRIVSEP_SLOTS];
+      memcpy(&slot->submit, &hdr, sizeof(slot->submit));
+      slot->refused = process_read_submit(s, &slot->submit, slot->buf, addr);
+      if (slot->refused == -1)
+	return;
+      slot->size = slot->refused ? 0 : process_urb_size(&slot->submit);
+      budget_take(slot->size);
+      ring->used = budget_held();
+      pending = &privsep_pending[head % PRIVSEP_SLOTS];
+      pending->unlink = 0;
+      pending->answered = 0;
+      if (slot->submit.hdr.endp == 0 && !slot->refused)
+	wheel_add(&pending->timer, PRIVSEP_DEADLINE * 1000, privsep_expire,
+		  pending);
+      __sync_synchronize();
+      ring->submitted = ++head;
+      __sync_synchronize();
+      if (ring->dev_wait)
+	write(db, "", 1);
+      break;
+    case 2:
+      privsep_unlink((struct net_unlink *)&hdr, head, tail);
+      break;
+    default:
+      log_printf(LOG_WARNING, "%s: unknown request (%u)\n", addr, hdr.hdr.cmd);
+      return;
+    }
+  }
+}
+
+// the session is charged for what its network process says it holds,
+// never more than its ring and as many held answers can hold
+void privsep_charge(struct privsep_ring *ring, uint64_t *charged)
+{
+  uint64_t used;
+
+  used = ring->used;
+  if (used > 2ULL * PRIVSEP_SLOTS * PROCESS_BUF_MAX)
+    used = 2ULL * PRIVSEP_SLOTS * PROCESS_BUF_MAX;
+  if (used > *charged)
+    budget_take(used - *charged);
+  else if (used < *charged)
+    budget_release(*charged - used);
+  *charged = used;
+  ring->charged = used;
+}
+
+void privsep_dev(int db, struct privsep_ring *ring, char *addr,
+		 privsep_urb_fct urb_fct, privsep_done_fct done_fct, void *arg)
+{
+  struct net_submit submit;
+  struct privsep_slot *slot;
+  uint64_t charged;
+  uint32_t cur;
+  char c[64];
+  int res;
+
+  cur = 0;
+  charged = 0;
+  for (;;)
+  {
+    privsep_charge(ring, &charged);
+    while (cur != ring->submitted)
+    {
+      __sync_synchronize();
+      privsep_charge(ring, &charged);
+      slot = &ring->slot[cur % PRIVSEP_SLOTS];
+      // the unprivileged process can still write the slot, only a
+      // private copy of its header is checked and executed
+      memcpy(&submit, &slot->submit, sizeof(submit));
+      slot->due = 0;
+      if (slot->refused)
+      {
+	slot->res = -ENOMEM;
+	slot->len = 0;
+      }
+      else if (!process_valid_submit(&submit))
+      {
+	log_printf(LOG_ERR, "%s: invalid request from the network process\n",
+		   addr);
+	slot->res = -EINVAL;
+	slot->len = 0;
+      }
+      else
+      {
+	slot->len = urb_fct(arg, &submit, slot->buf, &res);
+	slot->res = res;
+	slot->due = shaper_due(submit.hdr.endp);
+      }
+      __sync_synchronize();
+      ring->completed = ++cur;
+      __sync_synchronize();
+      if (ring->net_wait)
+	write(db, "", 1);
+      done_fct(arg, cur == ring->submitted);
+    }
+
+    ring->dev_wait = 1;
+    __sync_synchronize();
+    if (cur != ring->submitted)
+    {
+      ring->dev_wait = 0;
+      continue;
+    }
+    // the network process is gone once its doorbell closes
+    if (read(db, c, sizeof(c)) <= 0)
+      return;
+    ring->dev_wait = 0;
+  }
+}
+
+// run a session with the protocol handled by an unprivileged child, the
+// calling process keeps the device and executes the URBs
+void privsep_session(int s, char *addr, privsep_urb_fct urb_fct,
+		     privsep_done_fct done_fct, void *arg, int *fd, int fd_n)
+{
+  struct privsep_ring *ring;
+  int db[2];
+  pid_t pid;
+
+  ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+	      MAP_ANON | MAP_SHARED, -1, 0);
+  if (ring == MAP_FAILED)
+  {
+    perror("mmap()");
+    return;
+  }
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, db) == -1)
+  {
+    perror("socketpair()");
+    munmap(ring, sizeof(*ring));
+    return;
+  }
+
+  pid = fork();
+  switch (pid)
+  {
+  case -1:
+    perror("fork()");
+    break;
+  case 0:
+    close(db[0]);
+    privsep_drop(fd, fd_n, ring);
+    privsep_net(s, db[1], ring, addr);
+    process_held_drop();
+    budget_stop();
+    ring->peak = tune_peaked();
+    tune_report(addr);
+    exit(EXIT_SUCCESS);
+  default:
+    close(db[1]);
+    db[1] = -1;
+    privsep_dev(db[0], ring, addr, urb_fct, done_fct, arg);
+    waitpid(pid, NULL, 0);
+    profile_peak(ring->peak);
+    break;
+  }
+
+  close(db[0]);
+  if (db[1] != -1)
+    close(db[1]);
+  munmap(ring, sizeof(*ring));
+}
@@ -0,0 +1,143 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "net.h"
+#include "probe.h"
+#include "process.h"
+#include "timing.h"
+
+#define PROBE_USEC 1000000
+#define PROBE_WARMUP 8
+#define PROBE_ERRORS 8
+#define PROBE_URB_MAX 200000
+
+void probe_set(struct probe_ep *ep, char *name, int endp, int dir, int len,
+	       uint8_t *setup)
+{
+  bzero(ep, sizeof(*ep));
+  strlcpy(ep->name, name, sizeof(ep->name));
+  ep->submit.hdr.cmd = 1;
+  ep->submit.hdr.endp = endp;
+  ep->submit.hdr.dir = dir;
+  ep->submit.len = len;
+  if (setup != NULL)
+    memcpy(ep->submit.setup, setup, sizeof(ep->submit.setup));
+}
+
+int probe_urb(struct probe_ep *ep, probe_urb_fct urb_fct, void *arg,
+	      char *buf)
+{
+  struct net_submit submit;
+  int len;
+  int res;
+
+  memcpy(&submit, &ep->submit, sizeof(submit));
+  submit.hdr.seq++;
+  len = urb_fct(arg, &submit, buf, &res);
+  if (len < 0 || res < 0)
+    return -1;
+  return submit.hdr.dir ? len : submit.len;
+}
+
+// run each endpoint back to back for a second, after a few transfers
+// that let the device and the caches settle
+int probe_run(struct probe_ep *eps, int n, probe_urb_fct urb_fct,
+	      void *arg)
+{
+  char buf[PROCESS_BUF_MAX];
+  unsigned long long bytes;
+  uint64_t total;
+  uint64_t start;
+  uint64_t *lat;
+  int errors;
+  int len;
+  int e;
+  int i;
+  int u;
+
+  lat = calloc(PROBE_URB_MAX, sizeof(*lat));
+  if (lat == NULL)
+  {
+    printf("probe: malloc() error\n");
+    return -1;
+  }
+
+  bzero(buf, sizeof(buf));
+  for (e = 0; e < n; e++)
+  {
+    for (i = 0; i < PROBE_WARMUP; i++)
+      if (probe_urb(&eps[e], urb_fct, arg, buf) < 0)
+	break;
+    if (i < PROBE_WARMUP)
+    {
+      printf("probe: %s: no answer\n", eps[e].name);
+      continue;
+    }
+
+    bytes = 0;
+    errors = 0;
+    u = 0;
+    start = timing_usec();
+    for (total = 0; total < PROBE_USEC && u < PROBE_URB_MAX &&
+	   errors < PROBE_ERRORS;)
+    {
+      lat[u] = timing_usec();
+      len = probe_urb(&eps[e], urb_fct, arg, buf);
+      lat[u] = timing_usec() - lat[u];
+      u++;
+      if (len < 0)
+	errors++;
+      else
+	bytes += len;
+      total = timing_usec() - start;
+    }
+
+    qsort(lat, u, sizeof(*lat), timing_cmp);
+    printf("probe: %s: %d urbs, %.2f MB/s, %.0f urb/s, %d errors\n",
+	   eps[e].name, u, bytes / (double)total, u * 1000000.0 / total,
+	   errors);
+    printf("probe: %s: latency usec min %llu p50 %llu p90 %llu p99 %llu "
+	   "max %llu\n", eps[e].name,
+	   (unsigned long long)lat[0],
+	   (unsigned long long)lat[u / 2],
+	   (unsigned long long)lat[u * 9 / 10],
+	   (unsigned long long)lat[u * 99 / 100],
+	   (unsigned long long)lat[u - 1]);
+  }
+  free(lat);
+  return 0;
+}
@@ -40,184 +40,302 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <ctype.h>
 #include <errno.h>
 
+#include "bot.h"
+#include "budget.h"
+#include "discover.h"
+#include "fdcache.h"
+#include "log.h"
+#include "privsep.h"
 #include "process.h"
+#include "profile.h"
+#include "record.h"
+#include "session.h"
+#include "shaper.h"
+#include "timing.h"
+#include "tune.h"
+#include "tunnel.h"
+#include "wheel.h"
 #include "net.h"
+#include "probe.h"
+#include "query.h"
 
-void process_dev_list_request(int s, char *addr)
+int process_get_ifs(int fd, struct net_usb_if *uif, int if_n, char *addr)
 {
   struct usb_interface_desc idesc;
-  usb_device_descriptor_t ddesc;
-  struct usb_config_desc cdesc;
-  struct usb_device_info dinfo;
-  struct net_usb_dev dev;
-  struct net_usb_if uif;
-  uint32_t ndev;
-  int conf;
-  int fd;
   int i;
 
-  if (net_send_op(s, NET_OP_SDEVLIST, NET_RES_OK))
+  for (i = 0; i < if_n; i++)
   {
-    printf("%s: error sending devlist answer\n", addr);
-    return;
+    idesc.uid_config_index = USB_CURRENT_CONFIG_INDEX;
+    idesc.uid_interface_index = i;
+    idesc.uid_alt_index = USB_CURRENT_ALT_INDEX;
+    if (ioctl(fd, USB_GET_INTERFACE_DESC, &idesc) == -1)
+    {
+      log_printf(LOG_ERR, "%s: error getting interface %d\n", addr, i);
+      return -1;
+    }
+    uif[i].class = idesc.uid_desc.bInterfaceClass;
+    uif[i].sub_class = idesc.uid_desc.bInterfaceSubClass;
+    uif[i].proto = idesc.uid_desc.bInterfaceProtocol;
+    uif[i].pad = 0;
   }
+  return 0;
+}
 
-  fd = open("/dev/ugen0.00", O_RDWR);
-  if (fd == -1)
-    ndev = htonl(0);
-  else
-    ndev = htonl(1);
-  if (net_send(s, &ndev, sizeof(ndev)))
+// what the device lists and the imports tell about a device, from its
+// control endpoint, or from what was kept of it when it is still the
+// same device in the same configuration
+int process_dev_query(int fd, int unit, usb_device_descriptor_t *ddesc,
+		      struct query_dev *qd, char *addr)
+{
+  struct usb_config_desc cdesc;
+  struct usb_device_info dinfo;
+  struct net_usb_dev *dev;
+  int conf;
+
+  if (ioctl(fd, USB_GET_DEVICEINFO, &dinfo) == -1)
   {
-    printf("%s: error sending devlist\n", addr);
-    return;
+    log_printf(LOG_ERR, "%s: error getting device info\n", addr);
+    return -1;
   }
-  if (fd == -1)
-    return;
 
-  if (ioctl(fd, USB_GET_DEVICE_DESC, &ddesc) == -1)
+  if (ioctl(fd, USB_GET_CONFIG, &conf) == -1)
   {
-    printf("%s: error getting device desc\n", addr);
-    return;
+    log_printf(LOG_ERR, "%s: error getting device conf\n", addr);
+    return -1;
   }
 
-  if (ioctl(fd, USB_GET_CONFIG, &conf) == -1)
+  bzero(&qd->fp, sizeof(qd->fp));
+  qd->fp.vendor = dinfo.udi_vendorNo;
+  qd->fp.product = dinfo.udi_productNo;
+  qd->fp.release = dinfo.udi_releaseNo;
+  qd->fp.bus = dinfo.udi_bus;
+  qd->fp.addr = dinfo.udi_addr;
+  strlcpy(qd->fp.serial, dinfo.udi_serial, sizeof(qd->fp.serial));
+  qd->unit = unit;
+  if (query_cached(qd, conf) == 0)
   {
-    printf("%s: error getting device conf\n", addr);
-    return;
+    memcpy(ddesc, qd->ddesc, sizeof(*ddesc));
+    return 0;
   }
 
-  if (ioctl(fd, USB_GET_DEVICEINFO, &dinfo) == -1)
+  if (ioctl(fd, USB_GET_DEVICE_DESC, ddesc) == -1)
   {
-    printf("%s: error getting device info\n", addr);
-    return;
+    log_printf(LOG_ERR, "%s: error getting device desc\n", addr);
+    return -1;
   }
 
   cdesc.ucd_config_index = USB_CURRENT_CONFIG_INDEX;
   if (ioctl(fd, USB_GET_CONFIG_DESC, &cdesc) == -1)
   {
-    printf("%s: error getting device config desc\n", addr);
+    log_printf(LOG_ERR, "%s: error getting device config desc\n", addr);
+    return -1;
+  }
+
+  dev = &qd->dev;
+  bzero(dev, sizeof(*dev));
+  snprintf(dev->dev, NET_USB_DEV_MAX, "usb%d", unit);
+  snprintf(dev->bus, NET_USB_BUS_MAX, "usb%d", unit);
+  dev->bus_n = htonl(dinfo.udi_bus);
+  dev->dev_n = htonl(dinfo.udi_addr);
+  dev->dev_speed = htonl(dinfo.udi_speed);
+  dev->vid = htons(dinfo.udi_vendorNo);
+  dev->pid = htons(dinfo.udi_productNo);
+  dev->bcd = htons(dinfo.udi_releaseNo);
+  dev->class = ddesc->bDeviceClass;
+  dev->sub_class = ddesc->bDeviceSubClass;
+  dev->proto = ddesc->bDeviceProtocol;
+  dev->conf = conf;
+  dev->conf_n = ddesc->bNumConfigurations;
+  dev->if_n = cdesc.ucd_desc.bNumInterface;
+  if (process_get_ifs(fd, qd->uif, dev->if_n, addr))
+    return -1;
+  memcpy(qd->ddesc, ddesc, sizeof(qd->ddesc));
+  query_store(qd);
+  return 0;
+}
+
+// run by the query workers, fails quietly for the missing units, with
+// the errno of the open
+int process_query(int unit, struct query_dev *qd, char *addr)
+{
+  usb_device_descriptor_t ddesc;
+  char *path;
+  int res;
+  int fd;
+
+  if (asprintf(&path, "/dev/ugen%d.00", unit) < 0)
+    return -1;
+  fd = open(path, O_RDONLY);
+  free(path);
+  if (fd == -1)
+    return -1;
+  res = process_dev_query(fd, unit, &ddesc, qd, addr);
+  close(fd);
+  // only a failed open tells that the unit has no device
+  if (res)
+    errno = EIO;
+  return res;
+}
+
+void process_dev_list_request(int s, char *addr)
+{
+  struct query_dev *qds;
+  uint32_t ndev;
+  int n;
+  int i;
+
+  if (net_send_op(s, NET_OP_SDEVLIST, NET_RES_OK))
+  {
+    log_printf(LOG_ERR, "%s: error sending devlist answer\n", addr);
     return;
   }
 
-  strlcpy(dev.dev, "usb0", NET_USB_DEV_MAX);
-  snprintf(dev.bus, NET_USB_BUS_MAX, "usb0");
-  dev.bus_n = htonl(dinfo.udi_bus);
-  dev.dev_n = htonl(dinfo.udi_addr);
-  dev.dev_speed = htonl(dinfo.udi_speed);
-  dev.vid = htons(dinfo.udi_vendorNo);
-  dev.pid = htons(dinfo.udi_productNo);
-  dev.bcd = htons(dinfo.udi_releaseNo);
-  dev.class = ddesc.bDeviceClass;
-  dev.sub_class = ddesc.bDeviceSubClass;
-  dev.proto = ddesc.bDeviceProtocol;
-  dev.conf = conf;
-  dev.conf_n = ddesc.bNumConfigurations;
-  dev.if_n = cdesc.ucd_desc.bNumInterface;
-  if (net_send(s, &dev, sizeof(dev)))
-  {
-    printf("%s: error sending dev info\n", addr);
+  qds = malloc(QUERY_UNITS * sizeof(*qds));
+  if (qds == NULL)
+  {
+    log_printf(LOG_ERR, "%s: malloc() error\n", addr);
     return;
   }
+  n = query_scan(qds, QUERY_UNITS, addr);
+  ndev = htonl(n);
+  if (net_send(s, &ndev, sizeof(ndev)))
+    log_printf(LOG_ERR, "%s: error sending devlist\n", addr);
+  else
+    for (i = 0; i < n; i++)
+      if (net_send(s, &qds[i].dev, sizeof(qds[i].dev)) ||
+	  net_send(s, qds[i].uif, qds[i].dev.if_n * sizeof(*qds[i].uif)))
+      {
+	log_printf(LOG_ERR, "%s: error sending dev info\n", addr);
+	break;
+      }
+  free(qds);
+}
+
+// the endpoint descriptors of the current configuration, returns how
+// many were found
+int process_ep_descs(int *fd, usb_endpoint_descriptor_t *eds, int max)
+{
+  struct usb_interface_desc idesc;
+  struct usb_endpoint_desc edesc;
+  struct usb_config_desc cdesc;
+  int n;
+  int i;
+  int e;
 
-  for (i = 0; i < dev.if_n; i++)
+  n = 0;
+  cdesc.ucd_config_index = USB_CURRENT_CONFIG_INDEX;
+  if (ioctl(fd[0], USB_GET_CONFIG_DESC, &cdesc) == -1)
+    return 0;
+
+  for (i = 0; i < cdesc.ucd_desc.bNumInterface; i++)
   {
     idesc.uid_config_index = USB_CURRENT_CONFIG_INDEX;
     idesc.uid_interface_index = i;
     idesc.uid_alt_index = USB_CURRENT_ALT_INDEX;
-    if (ioctl(fd, USB_GET_INTERFACE_DESC, &idesc) == -1)
-    {
-      printf("%s: error getting interface %d:%d\n",
-	     addr, cdesc.ucd_desc.iConfiguration, i);
-      return;
-    }
-    uif.class = idesc.uid_desc.bInterfaceClass;
-    uif.sub_class = idesc.uid_desc.bInterfaceSubClass;
-    uif.proto = idesc.uid_desc.bInterfaceProtocol;
-    if (net_send(s, &uif, sizeof(uif)))
+    if (ioctl(fd[0], USB_GET_INTERFACE_DESC, &idesc) == -1)
+      return n;
+    for (e = 0; e < idesc.uid_desc.bNumEndpoints && n < max; e++)
     {
-      printf("%s: error sending interface\n", addr);
-      return;
+      edesc.ued_config_index = USB_CURRENT_CONFIG_INDEX;
+      edesc.ued_interface_index = i;
+      edesc.ued_alt_index = USB_CURRENT_ALT_INDEX;
+      edesc.ued_endpoint_index = e;
+      if (ioctl(fd[0], USB_GET_ENDPOINT_DESC, &edesc) == -1)
+	return n;
+      memcpy(&eds[n++], &edesc.ued_desc, sizeof(*eds));
     }
   }
+  return n;
+}
+
+// transfer type of each endpoint of the current configuration
+void process_ep_types(int *fd, uint8_t *types)
+{
+  usb_endpoint_descriptor_t eds[32];
+  int n;
+  int i;
+
+  bzero(types, 16);
+  n = process_ep_descs(fd, eds, 32);
+  for (i = 0; i < n; i++)
+    types[eds[i].bEndpointAddress & 0x0f] = eds[i].bmAttributes & 3;
 }
 
-void process_get_desc_dev(int s, usb_device_descriptor_t *ddesc,
-			 struct net_submit *submit, char *addr)
+int process_out_len(struct net_submit *submit)
+{
+  if (submit->hdr.endp == 0)
+  {
+    if (submit->setup[0] & 0x80)
+      return 0;
+    return *(uint16_t *)(submit->setup + 6);
+  }
+  if (submit->hdr.dir)
+    return 0;
+  return submit->len;
+}
+
+void process_send_ret(int s, struct net_submit *submit, int res, char *buf,
+		      int len, char *addr)
 {
   struct net_submit_ret ret;
 
+  bzero(&ret, sizeof(ret));
   ret.hdr.cmd = htonl(3);
   ret.hdr.seq = htonl(submit->hdr.seq);
-  ret.hdr.dev = 0;
-  ret.hdr.dir = 0;
-  ret.hdr.endp = 0;
-  ret.ret = 0;
-  ret.len = htonl(sizeof(*ddesc));
-  ret.sfrm = 0;
-  ret.pkt_n = 0;
-  ret.err_n = 0;
+  ret.ret = htonl(res);
+  ret.len = htonl(len);
 
   if (net_send(s, &ret, sizeof(ret)))
-    printf("%s: pgdd: error sending hdr\n", addr);
-  if (net_send(s, ddesc, sizeof(*ddesc)))
-    printf("%s: pgdd: error sending data\n", addr);
+    log_printf(LOG_ERR, "%s: error sending ret hdr\n", addr);
+  if (len)
+    if (net_send(s, buf, len))
+      log_printf(LOG_ERR, "%s: error sending ret data\n", addr);
+  record_ret(&ret, buf, len);
+  tune_ret(sizeof(ret) + len);
 }
 
-void process_get_desc_conf(int s, int *fd, struct net_submit *submit,
-			   char *addr)
+int process_get_desc_dev(usb_device_descriptor_t *ddesc, char *buf)
+{
+  memcpy(buf, ddesc, sizeof(*ddesc));
+  return sizeof(*ddesc);
+}
+
+int process_get_desc_conf(int *fd, struct net_submit *submit, char *buf,
+			  char *addr)
 {
-  struct net_submit_ret ret;
   struct usb_full_desc full;
-  u_char buf[1024];
   int rlen;
 
   rlen = *(uint16_t *)(submit->setup + 6);
   if (rlen > 1024)
   {
-    printf("%s: too big buffer requested\n", addr);
-    return;
+    log_printf(LOG_ERR, "%s: too big buffer requested\n", addr);
+    return -1;
   }
 
   full.ufd_config_index = submit->setup[2];
   full.ufd_size = 1024;
-  full.ufd_data = buf;
+  full.ufd_data = (u_char *)buf;
   if (ioctl(fd[0], USB_GET_FULL_DESC, &full) == -1)
   {
-    printf("%s: cannot get full descriptors\n", addr);
-    return;
+    log_printf(LOG_ERR, "%s: cannot get full descriptors\n", addr);
+    return -1;
   }
-
-  ret.hdr.cmd = htonl(3);
-  ret.hdr.seq = htonl(submit->hdr.seq);
-  ret.hdr.dev = 0;
-  ret.hdr.dir = 0;
-  ret.hdr.endp = 0;
-  ret.ret = 0;
-  ret.len = htonl(rlen);
-  ret.sfrm = 0;
-  ret.pkt_n = 0;
-  ret.err_n = 0;
-
-  if (net_send(s, &ret, sizeof(ret)))
-    printf("%s: pgdc: error sending hdr\n", addr);
-  if (net_send(s, buf, rlen))
-    printf("%s: pgdc: error sending data\n", addr);
+  return rlen;
 }
 
-void process_get_desc_str(int s, int *fd, struct net_submit *submit,
-			   char *addr)
+int process_get_desc_str(int *fd, struct net_submit *submit, char *buf,
+			 char *addr)
 {
   struct usb_ctl_request req;
-  struct net_submit_ret ret;
-  char buf[1024];
   int rlen;
 
   rlen = *(uint16_t *)(submit->setup + 6);
   if (rlen > 1024)
   {
-    printf("%s: string desc request too big\n", addr);
-    return;
+    log_printf(LOG_ERR, "%s: string desc request too big\n", addr);
+    return -1;
   }
   memcpy(&(req.ucr_request), submit->setup, 8); // copy the setup packet
   req.ucr_addr = 0;
@@ -225,427 +343,800 @@ void process_get_desc_str(int s, int *fd, struct net_submit *submit,
   req.ucr_flags = USBD_SHORT_XFER_OK;
   if (ioctl(fd[0], USB_DO_REQUEST, &req) == -1)
   {
-    printf("%s: cannot get string descriptor\n", addr);
-    return;
+    log_printf(LOG_ERR, "%s: cannot get string descriptor\n", addr);
+    return -1;
   }
-  ret.hdr.cmd = htonl(3);
-  ret.hdr.seq = htonl(submit->hdr.seq);
-  ret.hdr.dev = 0;
-  ret.hdr.dir = 0;
-  ret.hdr.endp = 0;
-  ret.ret = 0;
-  ret.len = htonl(rlen);
-  ret.sfrm = 0;
-  ret.pkt_n = 0;
-  ret.err_n = 0;
-
-  if (net_send(s, &ret, sizeof(ret)))
-    printf("%s: pgds: error sending hdr\n", addr);
-  if (net_send(s, buf, rlen))
-    printf("%s: pgds: error sending data\n", addr);
+  return rlen;
 }
 
-void process_get_desc(int s, int *fd, usb_device_descriptor_t *ddesc,
-		      struct net_submit *submit, char *addr)
+int process_get_desc(int *fd, usb_device_descriptor_t *ddesc,
+		     struct net_submit *submit, char *buf, char *addr)
 {
   switch(submit->setup[3])
   {
   case 1:
-    process_get_desc_dev(s, ddesc, submit, addr);
-    return;
+    return process_get_desc_dev(ddesc, buf);
   case 2:
-    process_get_desc_conf(s, fd, submit, addr);
-    return;
+    return process_get_desc_conf(fd, submit, buf, addr);
   case 3:
-    process_get_desc_str(s, fd, submit, addr);
-    return;
+    return process_get_desc_str(fd, submit, buf, addr);
   }
-  printf("%s: unknown descriptor requested: %x\n", addr, submit->setup[3]);
-  return;
+  log_printf(LOG_WARNING, "%s: unknown descriptor requested: %x\n", addr,
+	     submit->setup[3]);
+  return -1;
 }
 
-void process_set_conf(int s, int *fd, struct net_submit *submit, char *addr,
-		      char *ugen)
+// open the endpoints of a ugen unit from the first one given, the
+// missing ones are left at -1
+int process_open(char *ugen, int *fd, int first, char *addr)
 {
-  struct net_submit_ret ret;
-  char *udev;
+  int i;
+
+  for (i = first; i < 16; i++)
+    if (fdcache_open(ugen, fd, i, addr))
+      return -1;
+  return 0;
+}
+
+int process_set_conf(int *fd, struct net_submit *submit, char *addr,
+		     char *ugen)
+{
+  uint8_t types[16];
   int conf;
   int i;
 
   // first close all opened endpoints, except control
   for (i = 1; i < 16; i++)
-    if (fd[i] != -1)
-    {
-      close(fd[i]);
-      fd[i] = -1;
-    }
+    fdcache_close(fd, i);
 
   // setconf
   conf = *(uint16_t *)(submit->setup + 2);
   if (ioctl(fd[0], USB_SET_CONFIG, &conf) == -1)
   {
-    printf("%s: cannot set conf %d\n", addr, conf);
-    return;
+    log_printf(LOG_ERR, "%s: cannot set conf %d\n", addr, conf);
+    return -1;
   }
-  ret.hdr.cmd = htonl(3);
-  ret.hdr.seq = htonl(submit->hdr.seq);
-  ret.hdr.dev = 0;
-  ret.hdr.dir = 0;
-  ret.hdr.endp = 0;
-  ret.ret = 0;
-  ret.len = 0;
-  ret.sfrm = 0;
-  ret.pkt_n = 0;
-  ret.err_n = 0;
-
-  if (net_send(s, &ret, sizeof(ret)))
-    printf("%s: psc: error sending hdr\n", addr);
 
   // now re-open all endpoints
-  for (i = 1; i < 16; i++)
+  if (process_open(ugen, fd, 1, addr))
   {
-    asprintf(&udev, "/dev/ugen%s.%02d", ugen, i);
-    if (udev == NULL)
-    {
-      printf("%s: malloc() error\n", addr);
-      return;
-    }
-    fd[i] = open(udev, O_RDWR);
-    if (fd[i] == -1)
-      fd[i] = open(udev, O_RDONLY);
-    if (fd[i] == -1)
-      fd[i] = open(udev, O_WRONLY);
-    conf = 1;
-    if (fd[i] != -1)
-      if (ioctl(fd[i], USB_SET_SHORT_XFER, &conf) == -1)
-	printf("%s: cannot set short transfers on endp%d\n", addr, i);
-    free(udev);
+    log_printf(LOG_ERR, "%s: too many open devices\n", addr);
+    return 0;
   }
+  bot_probe(fd);
+  process_ep_types(fd, types);
+  fdcache_types(fd, types);
+  shaper_types(types);
+  return 0;
 }
 
-void process_usb_ctl_req(int s, int *fd, struct net_submit *submit,
-			 char *addr)
+int process_usb_ctl_req(int *fd, struct net_submit *submit, char *buf,
+			char *addr)
 {
   struct usb_ctl_request req;
-  struct net_submit_ret ret;
-  char buf[1024];
   int rlen;
   int dir;
 
   rlen = *(uint16_t *)(submit->setup + 6);
   if (rlen > 1024)
   {
-    printf("%s: ctl request too big\n", addr);
-    return;
+    log_printf(LOG_ERR, "%s: ctl request too big\n", addr);
+    return -1;
   }
 
-  dir = ((submit->setup[0] >> 7) & 1);
-  if (!dir) // host to device
-  {
-    if (net_read(s, buf, rlen))
-    {
-      printf("%s: cannot read ctl payload\n", addr);
-      return;
-    }
-  }
+  // the host may be resetting or recovering the device
+  bot_ctl(submit->setup);
 
+  dir = ((submit->setup[0] >> 7) & 1);
   memcpy(&(req.ucr_request), submit->setup, 8); // copy the setup packet
   req.ucr_addr = 0;
   req.ucr_data = buf;
   req.ucr_flags = USBD_SHORT_XFER_OK;
   if (ioctl(fd[0], USB_DO_REQUEST, &req) == -1)
   {
-    printf("%s: cannot do ctl request %02x%02x%02x%02x%02x%02x%02x%02x: %s\n",
-	   addr,
-	   submit->setup[0],
-	   submit->setup[1],
-	   submit->setup[2],
-	   submit->setup[3],
-	   submit->setup[4],
-	   submit->setup[5],
-	   submit->setup[6],
-	   submit->setup[7],
-	   strerror(errno));
-    return;
+    log_printf(LOG_ERR, "%s: cannot do ctl request "
+	       "%02x%02x%02x%02x%02x%02x%02x%02x: %s\n",
+	       addr,
+	       submit->setup[0],
+	       submit->setup[1],
+	       submit->setup[2],
+	       submit->setup[3],
+	       submit->setup[4],
+	       submit->setup[5],
+	       submit->setup[6],
+	       submit->setup[7],
+	       strerror(errno));
+    return -1;
   }
-  ret.hdr.cmd = htonl(3);
-  ret.hdr.seq = htonl(submit->hdr.seq);
-  ret.hdr.dev = 0;
-  ret.hdr.dir = 0;
-  ret.hdr.endp = 0;
-  ret.ret = 0;
-  ret.len = dir ? htonl(rlen) : 0;
-  ret.sfrm = 0;
-  ret.pkt_n = 0;
-  ret.err_n = 0;
-
-  if (net_send(s, &ret, sizeof(ret)))
-    printf("%s: pucr: error sending hdr\n", addr);
-  if (dir)
-    if (net_send(s, buf, rlen))
-      printf("%s: pucr: error sending data\n", addr);
+  return dir ? rlen : 0;
 }
 
-void process_usb_req(int s, int *fd, struct net_submit *submit,
-		     char *addr)
+int process_usb_req(int *fd, struct net_submit *submit, char *buf, int *res,
+		    char *addr)
 {
-  struct net_submit_ret ret;
-  char buf[32768];
   int endp;
   int rlen;
   int len;
-  int res;
   int dir;
 
   rlen = submit->len;
-  if (rlen > 32768)
+  if (rlen > PROCESS_BUF_MAX)
   {
-    printf("%s: request too big\n", addr);
-    return;
+    log_printf(LOG_ERR, "%s: request too big\n", addr);
+    return -1;
   }
 
-  bzero(buf, rlen);
-  res = 0;
   endp = submit->hdr.endp;
   dir = submit->hdr.dir;
   if (!dir) // host to device
   {
-    if (net_read(s, buf, rlen))
-    {
-      printf("%s: cannot read payload\n", addr);
-      return;
-    }
-    len = write(fd[endp], buf, rlen);
+    len = bot_cbw(fd, endp, buf, rlen);
+    if (len == 0)
+      len = write(fdcache_get(fd, endp), buf, rlen);
     if (len < 0)
     {
-      printf("%s: cannot write to endpoint %d\n", addr, endp);
-      len = 0;
-      res = -errno;
+      *res = -errno;
+      log_printf(LOG_ERR, "%s: cannot write to endpoint %d: %s\n", addr,
+		 endp, strerror(-*res));
     }
+    else
+      shaper_charge(endp, rlen);
+    return 0;
   }
-  else // device to host
+
+  // device to host
+  len = bot_read(fd, endp, buf, rlen, res);
+  if (len < 0)
   {
-    len = read(fd[endp], buf, rlen);
+    bzero(buf, rlen);
+    len = read(fdcache_get(fd, endp), buf, rlen);
     if (len < 0)
     {
-      printf("%s: cannot read from endpoint %d: %s %d\n", addr, endp,
-	     strerror(errno), errno);
+      *res = -errno;
+      log_printf(LOG_ERR, "%s: cannot read from endpoint %d: %s\n", addr,
+		 endp, strerror(-*res));
       len = 0;
-      res = -errno;
     }
   }
+  shaper_charge(endp, len);
+  return len;
+}
 
-  ret.hdr.cmd = htonl(3);
-  ret.hdr.seq = htonl(submit->hdr.seq);
-  ret.hdr.dev = 0;
-  ret.hdr.dir = 0;
-  ret.hdr.endp = 0;
-  ret.ret = htonl(res);
-  ret.len = dir ? htonl(len) : 0;
-  ret.sfrm = 0;
-  ret.pkt_n = 0;
-  ret.err_n = 0;
+int process_urb(int *fd, usb_device_descriptor_t *ddesc,
+		struct net_submit *submit, char *buf, int *res,
+		char *addr, char *ugen)
+{
+  int len;
 
-  if (net_send(s, &ret, sizeof(ret)))
-    printf("%s: pur: error sending hdr\n", addr);
-  if (dir && len)
-    if (net_send(s, buf, len))
-      printf("%s: pur: error sending data\n", addr);
+  *res = 0;
+  profile_urb(submit->hdr.endp, submit->hdr.dir, process_urb_size(submit));
+  if (submit->hdr.endp != 0)
+    len = process_usb_req(fd, submit, buf, res, addr);
+  else if (submit->setup[1] == 6 && submit->setup[0] == 0x80)
+    len = process_get_desc(fd, ddesc, submit, buf, addr);
+  else if (submit->setup[1] == 9 && submit->setup[0] == 0)
+    len = process_set_conf(fd, submit, addr, ugen);
+  else
+    len = process_usb_ctl_req(fd, submit, buf, addr);
+
+  // a request that could not be done is answered as stalled
+  if (len < 0)
+  {
+    *res = -EPIPE;
+    len = 0;
+  }
+  return len;
 }
 
-void process_submit(int s, int *fd, int conf,
-		    usb_device_descriptor_t *ddesc,
-		    struct usb_device_info *dinfo,
-		    struct usb_config_desc *cdesc,
-		    char *addr,
-		    struct net_submit *submit,
-		    char *ugen)
+// buffer needed by a submit, charged to the in flight budget
+int process_urb_size(struct net_submit *submit)
+{
+  int olen;
+
+  olen = process_out_len(submit);
+  return olen > submit->len ? olen : submit->len;
+}
+
+// whether a submit can be executed with a PROCESS_BUF_MAX buffer, the
+// device process checks again what it gets from the network process
+int process_valid_submit(struct net_submit *submit)
 {
+  int olen;
+
+  olen = process_out_len(submit);
+  return submit->hdr.endp < 16 &&
+    submit->len >= 0 && submit->len <= PROCESS_BUF_MAX &&
+    olen >= 0 && olen <= PROCESS_BUF_MAX &&
+    (submit->hdr.endp != 0 || *(uint16_t *)(submit->setup + 6) <= 1024);
+}
+
+// read the rest of a submit and its payload, if any, returns 1 if the
+// submit is refused
+int process_read_submit(int s, struct net_submit *submit, char *buf,
+			char *addr)
+{
+  int olen;
+  int len;
+
   submit->fl = ntohl(submit->fl);
   submit->len = ntohl(submit->len);
   submit->sfrm = ntohl(submit->sfrm);
   submit->pkt_n = ntohl(submit->pkt_n);
   submit->intv = ntohl(submit->intv);
-  if (submit->hdr.endp == 0)
+  tune_submit(sizeof(*submit) + process_out_len(submit));
+
+  // refuse what cannot be buffered or makes no sense, its payload is
+  // skipped and the client gets an error instead of waiting forever
+  olen = process_out_len(submit);
+  if (!process_valid_submit(submit))
   {
-    switch(submit->setup[1])
+    log_printf(LOG_ERR, "%s: invalid request size\n", addr);
+    for (; olen > 0; olen -= len)
     {
-    case 6:
-      if (submit->setup[0] == 0x80)
-      {
-	process_get_desc(s, fd, ddesc, submit, addr);
-	return;
-      }
-      break;
-    case 9:
-      if (submit->setup[0] == 0)
-      {
-	process_set_conf(s, fd, submit, addr, ugen);
-	return;
-      }
-      break;
+      len = olen > PROCESS_BUF_MAX ? PROCESS_BUF_MAX : olen;
+      if (net_read(s, buf, len))
+	return -1;
     }
-    process_usb_ctl_req(s, fd, submit, addr);
+    return 1;
+  }
+  if (olen > 0) // host to device
+    if (net_read(s, buf, olen))
+    {
+      log_printf(LOG_ERR, "%s: cannot read payload\n", addr);
+      return -1;
+    }
+  record_submit(submit, buf, olen);
+  return 0;
+}
+
+void process_submit(int s, int *fd, int conf,
+		    usb_device_descriptor_t *ddesc,
+		    char *addr,
+		    struct net_submit *submit,
+		    char *ugen)
+{
+  char buf[PROCESS_BUF_MAX];
+  int size;
+  int len;
+  int res;
+
+  switch (process_read_submit(s, submit, buf, addr))
+  {
+  case 0:
+    break;
+  case 1:
+    process_send_ret(s, submit, -ENOMEM, buf, 0, addr);
+    return;
+  default:
+    return;
+  }
+
+  size = process_urb_size(submit);
+  budget_take(size);
+  len = process_urb(fd, ddesc, submit, buf, &res, addr, ugen);
+  if (process_hold(s, submit, res, buf, len, size,
+		   shaper_due(submit->hdr.endp), addr))
+    size = 0;
+  else
+    process_send_ret(s, submit, res, buf, len, addr);
+  budget_release(size);
+  bot_done(fd);
+}
+
+// res is 0 when the URB was already answered, -ECONNRESET when it was
+// unlinked and never will be
+void process_send_unlink_ret(int s, uint32_t seq, int res, char *addr)
+{
+  struct net_unlink_ret ret;
+
+  bzero(&ret, sizeof(ret));
+  ret.hdr.cmd = htonl(4);
+  ret.hdr.seq = htonl(seq);
+  ret.ret = htonl(res);
+  if (net_send(s, &ret, sizeof(ret)))
+    log_printf(LOG_ERR, "%s: error sending unlink ret\n", addr);
+}
+
+// answers held back by the shaper, in order for each endpoint, only the
+// first one of an endpoint has its timer armed
+struct process_held
+{
+  struct wheel_timer timer;
+  struct process_held *next;
+  struct net_submit submit;
+  uint64_t due;
+  int s;
+  int res;
+  int len;
+  int size;
+  char *addr;
+  char *buf;
+};
+
+static struct process_held *process_held[16];
+static int process_held_n = 0;
+
+void process_held_send(void *arg);
+
+void process_held_arm(int endp)
+{
+  struct process_held *h;
+  uint64_t now;
+
+  h = process_held[endp];
+  if (h == NULL)
     return;
+  now = timing_usec();
+  wheel_add(&h->timer, h->due > now ? h->due - now : 0, process_held_send,
+	    h);
+}
+
+void process_held_pop(int endp)
+{
+  struct process_held *h;
+
+  h = process_held[endp];
+  process_held[endp] = h->next;
+  process_held_n--;
+  wheel_del(&h->timer);
+  budget_release(h->size);
+  free(h);
+}
+
+// the first answer of an endpoint is due, the next ones may be as well
+void process_held_send(void *arg)
+{
+  struct process_held *h = arg;
+  int endp;
+
+  endp = h->submit.hdr.endp;
+  do
+  {
+    process_send_ret(h->s, &h->submit, h->res, h->buf, h->len, h->addr);
+    process_held_pop(endp);
+    h = process_held[endp];
+  } while (h != NULL && h->due <= timing_usec() + WHEEL_TICK);
+  process_held_arm(endp);
+}
+
+// hold the answer to a submit until the shaper lets its endpoint go on,
+// the other endpoints are served meanwhile, returns 0 if the answer is
+// to be sent now, 1 if it was taken along with its size of budget
+int process_hold(int s, struct net_submit *submit, int res, char *buf,
+		 int len, int size, uint64_t due, char *addr)
+{
+  struct process_held **p;
+  struct process_held *h;
+  int endp;
+
+  endp = submit->hdr.endp;
+  if (endp < 1 || endp > 15 || (process_held[endp] == NULL && due == 0))
+    return 0;
+
+  h = NULL;
+  if (process_held_n < PROCESS_HELD_MAX)
+    h = malloc(sizeof(*h) + len);
+  if (h == NULL)
+  {
+    // too much held already, the whole session waits instead
+    while (process_held[endp] != NULL)
+    {
+      timing_sleep_until(process_held[endp]->due);
+      process_held_send(process_held[endp]);
+    }
+    timing_sleep_until(due);
+    return 0;
   }
-  process_usb_req(s, fd, submit, addr);
+
+  bzero(h, sizeof(*h));
+  memcpy(&h->submit, submit, sizeof(*submit));
+  h->due = due;
+  h->s = s;
+  h->res = res;
+  h->len = len;
+  h->size = size;
+  h->addr = addr;
+  h->buf = (char *)(h + 1);
+  memcpy(h->buf, buf, len);
+  for (p = &process_held[endp]; *p != NULL; p = &(*p)->next)
+    ;
+  *p = h;
+  process_held_n++;
+  if (process_held[endp] == h)
+    process_held_arm(endp);
+  return 1;
+}
+
+// an unlinked URB whose answer is still held is never answered, returns 0
+// if there was none
+int process_held_unlink(int s, uint32_t seq, uint32_t useq, char *addr)
+{
+  struct process_held **p;
+  struct process_held *h;
+  int endp;
+
+  for (endp = 1; endp < 16; endp++)
+    for (p = &process_held[endp]; *p != NULL; p = &(*p)->next)
+    {
+      if ((*p)->submit.hdr.seq != seq)
+	continue;
+      h = *p;
+      *p = h->next;
+      h->next = NULL;
+      process_held_n--;
+      wheel_del(&h->timer);
+      budget_release(h->size);
+      free(h);
+      process_held_arm(endp);
+      process_send_unlink_ret(s, useq, -ECONNRESET, addr);
+      tune_ret(0);
+      return 1;
+    }
+  return 0;
+}
+
+// the session is over, what is still held is dropped
+void process_held_drop(void)
+{
+  int endp;
+
+  for (endp = 1; endp < 16; endp++)
+    while (process_held[endp] != NULL)
+      process_held_pop(endp);
 }
 
+// URBs are done one at a time here, the one unlinked is already answered
+// unless the shaper holds its answer
 void process_unlink(int s, int *fd, char *addr, struct net_unlink *unlink)
 {
+  record_unlink(unlink);
+  if (!process_held_unlink(s, ntohl(unlink->seq), unlink->hdr.seq, addr))
+    process_send_unlink_ret(s, unlink->hdr.seq, 0, addr);
 }
 
 void process_kern_client(int s, int *fd, int conf,
 			 usb_device_descriptor_t *ddesc,
-			 struct usb_device_info *dinfo,
-			 struct usb_config_desc *cdesc,
-			 char *addr, char *ugen)
+			 char *addr, char *ugen, uint64_t t0)
 {
   struct net_generic hdr;
 
   for (;;)
   {
+    // the device works ahead only while no request waits
+    if (!net_pending(s))
+      bot_idle(fd);
+    // leave the requests in the socket while the daemon is over budget
+    budget_wait();
+    wheel_wait(s);
     if (net_read_hdr(s, &hdr))
       return;
     switch(hdr.hdr.cmd)
     {
     case 1:
-      process_submit(s, fd, conf, ddesc, dinfo, cdesc, addr,
+      process_submit(s, fd, conf, ddesc, addr,
 		     (struct net_submit *)&hdr, ugen);
+      if (t0)
+      {
+	log_printf(LOG_INFO, "%s: first urb done %llu usec after import\n",
+		   addr, (unsigned long long)(timing_usec() - t0));
+	t0 = 0;
+      }
       break;
     case 2:
       process_unlink(s, fd, addr, (struct net_unlink *)&hdr);
       break;
     default:
-      printf("%s: unknown request (%u)\n", addr, hdr.hdr.cmd);
+      log_printf(LOG_WARNING, "%s: unknown request (%u)\n", addr, hdr.hdr.cmd);
       return;
     }
   }
 }
 
-void process_import_request(int s, char *addr)
+struct process_dev
 {
+  int *fd;
+  usb_device_descriptor_t *ddesc;
+  char *addr;
+  char *ugen;
+  uint64_t t0;
+};
+
+int process_dev_urb(void *arg, struct net_submit *submit, char *buf,
+		    int *res)
+{
+  struct process_dev *pd = arg;
+  int len;
+
+  len = process_urb(pd->fd, pd->ddesc, submit, buf, res, pd->addr,
+		    pd->ugen);
+  if (pd->t0)
+  {
+    log_printf(LOG_INFO, "%s: first urb done %llu usec after import\n",
+	       pd->addr, (unsigned long long)(timing_usec() - pd->t0));
+    pd->t0 = 0;
+  }
+  return len;
+}
+
+void process_dev_done(void *arg, int idle)
+{
+  struct process_dev *pd = arg;
+
+  bot_done(pd->fd);
+  if (idle)
+    bot_idle(pd->fd);
+}
+
+// measure the device alone with the transfer code of the sessions, the
+// IN endpoints only as writes would change its state
+int process_probe(char *ugen)
+{
+  struct probe_ep eps[PROBE_EP_MAX];
+  usb_endpoint_descriptor_t eds[32];
   usb_device_descriptor_t ddesc;
-  struct usb_config_desc cdesc;
-  struct usb_device_info dinfo;
-  struct net_usb_dev dev;
-  char bus[NET_USB_BUS_MAX + 1];
-  char *udev;
+  uint8_t status[8] = { 0x80, 0, 0, 0, 0, 0, 2, 0 };
+  struct process_dev pd;
+  char name[32];
+  int endp;
   int fd[16];
-  int conf;
   int res;
+  int ne;
+  int n;
   int i;
 
-  bzero(bus, NET_USB_BUS_MAX + 1);
-  if (net_read_import(s, bus))
-    return;
+  if (process_open(ugen, fd, 0, "probe"))
+    return -1;
+  if (fd[0] == -1)
+  {
+    log_printf(LOG_ERR, "probe: cannot open ugen%s\n", ugen);
+    return -1;
+  }
+  if (ioctl(fd[0], USB_GET_DEVICE_DESC, &ddesc) == -1)
+  {
+    log_printf(LOG_ERR, "probe: error getting device desc\n");
+    return -1;
+  }
 
-  for (udev = bus + 3; *udev; udev++)
-    if (!isdigit(*udev))
+  n = 0;
+  probe_set(&eps[n++], "control", 0, 1, 2, status);
+  ne = process_ep_descs(fd, eds, 32);
+  for (i = 0; i < ne && n < PROBE_EP_MAX; i++)
+  {
+    endp = UE_GET_ADDR(eds[i].bEndpointAddress);
+    if (UE_GET_DIR(eds[i].bEndpointAddress) != UE_DIR_IN ||
+	fdcache_get(fd, endp) == -1)
+      continue;
+    switch (eds[i].bmAttributes & UE_XFERTYPE)
     {
-      printf("%s: bad device requested\n", addr);
-      return;
+    case UE_BULK:
+      snprintf(name, sizeof(name), "bulk in %d", endp);
+      probe_set(&eps[n++], name, endp, 1, PROCESS_BUF_MAX, NULL);
+      break;
+    case UE_INTERRUPT:
+      snprintf(name, sizeof(name), "interrupt in %d", endp);
+      probe_set(&eps[n++], name, endp, 1, UGETW(eds[i].wMaxPacketSize),
+		NULL);
+      break;
+    default:
+      continue;
     }
+    // an endpoint without data must not stall the probe
+    fdcache_ioctl(fd, endp, USB_SET_TIMEOUT, 1000);
+  }
 
+  pd.fd = fd;
+  pd.ddesc = &ddesc;
+  pd.addr = "probe";
+  pd.ugen = ugen;
+  pd.t0 = 0;
+  res = probe_run(eps, n, process_dev_urb, &pd);
   for (i = 0; i < 16; i++)
+    fdcache_close(fd, i);
+  return res;
+}
+
+void process_session(int s, int *fd, int conf,
+		     usb_device_descriptor_t *ddesc,
+		     char *addr, char *ugen, uint64_t t0)
+{
+  struct process_dev pd;
+  uint8_t types[16];
+
+  process_ep_types(fd, types);
+  fdcache_types(fd, types);
+  profile_start(types);
+  shaper_start(addr, ugen, types);
+  budget_start();
+  tune_start(s);
+  discover_use(ugen, 1);
+  if (privsep_enabled())
   {
-    asprintf(&udev, "/dev/ugen%s.%02d", bus + 3, i);
-    if (udev == NULL)
+    pd.fd = fd;
+    pd.ddesc = ddesc;
+    pd.addr = addr;
+    pd.ugen = ugen;
+    pd.t0 = t0;
+    privsep_session(s, addr, process_dev_urb, process_dev_done, &pd,
+		    fd, 16);
+  }
+  else
+  {
+    process_kern_client(s, fd, conf, ddesc, addr, ugen, t0);
+    process_held_drop();
+    tune_report(addr);
+  }
+  shaper_stop();
+  budget_stop();
+  discover_use(ugen, -1);
+  budget_report(addr);
+  fdcache_report(addr);
+  profile_stop(addr);
+}
+
+// import the device for a client, or for the other end of a tunnel which
+// then gets its own session and no lingering
+void process_import(int s, char *bus, char *addr, int tunnel)
+{
+  usb_device_descriptor_t ddesc;
+  struct process_dev pd;
+  struct query_dev qd;
+  char caddr[64];
+  uint64_t t0;
+  char *udev;
+  int fd[16];
+  int conf;
+  int res;
+  int ls;
+
+  t0 = timing_usec();
+  for (udev = bus + 3; *udev; udev++)
+    if (!isdigit(*udev))
     {
-      printf("%s: malloc() error\n", addr);
+      log_printf(LOG_ERR, "%s: bad device requested\n", addr);
       return;
     }
-    fd[i] = open(udev, O_RDWR);
-    free(udev);
+
+  // a previous session may still hold the device, it answers the import
+  if (!tunnel && session_handoff(s, bus + 3, addr) == 0)
+    return;
+
+  if (process_open(bus + 3, fd, 0, addr))
+  {
+    log_printf(LOG_ERR, "%s: too many open devices\n", addr);
+    return;
   }
-  if (fd[0] == -1)
+  if (fd[0] == -1 ||
+      process_dev_query(fd[0], atoi(bus + 3), &ddesc, &qd, addr))
     res = NET_RES_NODEV;
   else
   {
-    net_no_delay(s);
+    profile_load(UGETW(ddesc.idVendor), UGETW(ddesc.idProduct),
+		 UGETW(ddesc.bcdDevice), addr);
+    if (profile_nodelay())
+      net_no_delay(s);
     res = NET_RES_OK;
   }
 
-  if (net_send_op(s, NET_OP_SIMPORT, res))
+  if (net_send_op(s, tunnel ? NET_OP_STUNNEL : NET_OP_SIMPORT, res))
   {
-    printf("%s: error sending import answer\n", addr);
+    log_printf(LOG_ERR, "%s: error sending import answer\n", addr);
     return;
   }
 
   if (res != NET_RES_OK)
     return;
 
-  if (ioctl(fd[0], USB_GET_DEVICE_DESC, &ddesc) == -1)
+  conf = qd.dev.conf;
+  if (net_send(s, &qd.dev, sizeof(qd.dev)))
   {
-    printf("%s: error getting device desc\n", addr);
+    log_printf(LOG_ERR, "%s: error sending dev info\n", addr);
     return;
   }
+  query_save(addr);
 
-  if (ioctl(fd[0], USB_GET_CONFIG, &conf) == -1)
-  {
-    printf("%s: error getting device conf\n", addr);
-    return;
-  }
+  bot_probe(fd);
+  if (record_enabled())
+    record_start(bus, &qd.dev, qd.uif);
 
-  if (ioctl(fd[0], USB_GET_DEVICEINFO, &dinfo) == -1)
+  if (tunnel)
   {
-    printf("%s: error getting device info\n", addr);
+    pd.fd = fd;
+    pd.ddesc = &ddesc;
+    pd.addr = addr;
+    pd.ugen = bus + 3;
+    pd.t0 = 0;
+    tunnel_session(s, addr, process_dev_urb, &pd);
     return;
   }
 
-  cdesc.ucd_config_index = USB_CURRENT_CONFIG_INDEX;
-  if (ioctl(fd[0], USB_GET_CONFIG_DESC, &cdesc) == -1)
+  // we now receive requests from the kernel driver directly
+  process_session(s, fd, conf, &ddesc, addr, bus + 3, t0);
+  ls = session_hold(bus + 3);
+  close(s);
+
+  // keep the device open and configured for the grace period, the next
+  // importer of this bus takes it over without reopening anything
+  while ((s = session_linger(ls, bus + 3, caddr, sizeof(caddr))) != -1)
   {
-    printf("%s: error getting device config desc\n", addr);
-    return;
+    t0 = timing_usec();
+    addr = caddr;
+    if (ioctl(fd[0], USB_GET_CONFIG, &conf) == -1)
+    {
+      log_printf(LOG_ERR, "%s: error getting device conf\n", addr);
+      net_send_op(s, NET_OP_SIMPORT, NET_RES_NODEV);
+      close(s);
+      return;
+    }
+    qd.dev.conf = conf;
+    if (profile_nodelay())
+      net_no_delay(s);
+    if (net_send_op(s, NET_OP_SIMPORT, NET_RES_OK) ||
+	net_send(s, &qd.dev, sizeof(qd.dev)))
+      log_printf(LOG_ERR, "%s: error sending import answer\n", addr);
+    else
+    {
+      if (record_enabled())
+	record_start(bus, &qd.dev, qd.uif);
+      process_session(s, fd, conf, &ddesc, addr, bus + 3, t0);
+    }
+    ls = session_hold(bus + 3);
+    close(s);
   }
+  bot_report(addr);
+}
+
+void process_import_request(int s, char *addr)
+{
+  char bus[NET_USB_BUS_MAX + 1];
 
-  strlcpy(dev.dev, "usb0", NET_USB_DEV_MAX);
-  snprintf(dev.bus, NET_USB_BUS_MAX, "usb0");
-  dev.bus_n = htonl(dinfo.udi_bus);
-  dev.dev_n = htonl(dinfo.udi_addr);
-  dev.dev_speed = htonl(dinfo.udi_speed);
-  dev.vid = htons(dinfo.udi_vendorNo);
-  dev.pid = htons(dinfo.udi_productNo);
-  dev.bcd = htons(dinfo.udi_releaseNo);
-  dev.class = ddesc.bDeviceClass;
-  dev.sub_class = ddesc.bDeviceSubClass;
-  dev.proto = ddesc.bDeviceProtocol;
-  dev.conf = conf;
-  dev.conf_n = ddesc.bNumConfigurations;
-  dev.if_n = cdesc.ucd_desc.bNumInterface;
-  if (net_send(s, &dev, sizeof(dev)))
-  {
-    printf("%s: error sending dev info\n", addr);
+  bzero(bus, NET_USB_BUS_MAX + 1);
+  if (net_read_import(s, bus))
     return;
-  }
+  process_import(s, bus, addr, 0);
+}
 
-  // we now receive requests from the kernel driver directly
-  process_kern_client(s, fd, conf, &ddesc, &dinfo, &cdesc, addr, bus + 3);
+void process_tunnel_request(int s, char *addr)
+{
+  char bus[NET_USB_BUS_MAX + 1];
+
+  bzero(bus, NET_USB_BUS_MAX + 1);
+  if (net_read_import(s, bus))
+    return;
+  process_import(s, bus, addr, 1);
 }
 
 void process_client(int s, char *addr)
 {
   struct net_op op;
+  int first;
   int r;
 
-  r = net_read_op(s, &op);
-  if (r)
+  // devlist requests may follow each other on the same connection, a
+  // relay keeps such a connection open to poll our devices
+  for (first = 1;; first = 0)
   {
-    printf("%s: error reading op\n", addr);
-    return;
-  }
+    r = net_read_op(s, &op);
+    if (r)
+    {
+      if (first)
+	log_printf(LOG_ERR, "%s: error reading op\n", addr);
+      return;
+    }
 
-  switch (op.op)
-  {
-  case NET_OP_RDEVLIST:
-    process_dev_list_request(s, addr);
-    break;
-  case NET_OP_RIMPORT:
-    process_import_request(s, addr);
-    break;
-  default:
-    printf("%s: unknown op (%hx)\n", addr, op.op);
-    break;
+    switch (op.op)
+    {
+    case NET_OP_RDEVLIST:
+      process_dev_list_request(s, addr);
+      break;
+    case NET_OP_RIMPORT:
+      process_import_request(s, addr);
+      return;
+    case NET_OP_RTUNNEL:
+      process_tunnel_request(s, addr);
+      return;
+    default:
+      log_printf(LOG_WARNING, "%s: unknown op (%hx)\n", addr, op.op);
+      return;
+    }
   }
 }
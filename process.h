@@ -33,6 +33,26 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef PROCESS_H
 #define PROCESS_H
 
+#define PROCESS_BUF_MAX 32768
+#define PROCESS_HELD_MAX 64
+
+struct net_submit;
+struct query_dev;
+
 void process_client(int s, char *addr);
+int process_out_len(struct net_submit *submit);
+int process_probe(char *ugen);
+int process_query(int unit, struct query_dev *qd, char *addr);
+int process_urb_size(struct net_submit *submit);
+int process_valid_submit(struct net_submit *submit);
+int process_read_submit(int s, struct net_submit *submit, char *buf,
+			char *addr);
+void process_send_ret(int s, struct net_submit *submit, int res, char *buf,
+		      int len, char *addr);
+void process_send_unlink_ret(int s, uint32_t seq, int res, char *addr);
+int process_hold(int s, struct net_submit *submit, int res, char *buf,
+		 int len, int size, uint64_t due, char *addr);
+int process_held_unlink(int s, uint32_t seq, uint32_t useq, char *addr);
+void process_held_drop(void);
 
 #endif
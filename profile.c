@@ -0,0 +1,425 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dev/usb/usb.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "log.h"
+#include "profile.h"
+#include "timing.h"
+#include "tune.h"
+
+// what the sessions of an import did with the device, shared with the
+// network process of a privilege separated session
+struct profile_stats
+{
+  uint64_t count[16][2];
+  uint64_t bytes[16][2];
+  uint64_t sizes[PROFILE_CLASSES];
+  uint64_t gaps[PROFILE_CLASSES];
+  uint64_t last;
+  uint32_t ra_hits;
+  uint32_t ra_misses;
+  int peak;
+};
+
+static int profile_enabled = 0;
+static char profile_key[16];
+static int profile_model[3];
+static struct profile profile_learned = { -1, -1, -1 };
+static struct profile profile_cur = { -1, -1, -1 };
+static struct profile_stats *profile_stats = NULL;
+static uint8_t profile_types[16];
+static int profile_probe = 0;
+static uint32_t profile_probes = 0;
+
+int profile_enable(void)
+{
+  if (mkdir(PROFILE_DIR, 0700) == -1 && errno != EEXIST)
+  {
+    perror("mkdir()");
+    return -1;
+  }
+  profile_enabled = 1;
+  return 0;
+}
+
+void profile_clear(struct profile *p)
+{
+  p->buffer = -1;
+  p->readahead = -1;
+  p->nodelay = -1;
+}
+
+// the fields known in from replace those of to
+void profile_merge(struct profile *to, struct profile *from)
+{
+  if (from->buffer != -1)
+    to->buffer = from->buffer;
+  if (from->readahead != -1)
+    to->readahead = from->readahead;
+  if (from->nodelay != -1)
+    to->nodelay = from->nodelay;
+}
+
+void profile_set(struct profile *p, char *tok)
+{
+  char *val;
+
+  val = strchr(tok, '=');
+  if (val == NULL)
+    return;
+  *val++ = '\0';
+  if (strcmp(tok, "buffer") == 0 && atoi(val) > 0)
+    p->buffer = atoi(val);
+  else if (strcmp(tok, "readahead") == 0)
+    p->readahead = atoi(val) != 0;
+  else if (strcmp(tok, "nodelay") == 0)
+    p->nodelay = atoi(val) == 2 ? 2 : atoi(val) != 0;
+}
+
+// lines are vendor:product[:release] followed by key=value settings, the
+// entry of the exact release wins over the one of the whole model
+void profile_read(char *path, unsigned int vendor, unsigned int product,
+		  unsigned int release, struct profile *p)
+{
+  struct profile model;
+  struct profile exact;
+  unsigned int v;
+  unsigned int pr;
+  unsigned int r;
+  char line[256];
+  char *last;
+  char *tok;
+  FILE *f;
+  int n;
+
+  f = fopen(path, "r");
+  if (f == NULL)
+    return;
+  profile_clear(&model);
+  profile_clear(&exact);
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    n = sscanf(line, "%x:%x:%x", &v, &pr, &r);
+    if (n < 2 || v != vendor || pr != product || (n == 3 && r != release))
+      continue;
+    strtok_r(line, " \t\n", &last);
+    while ((tok = strtok_r(NULL, " \t\n", &last)) != NULL)
+      profile_set(n == 3 ? &exact : &model, tok);
+  }
+  fclose(f);
+  profile_merge(p, &model);
+  profile_merge(p, &exact);
+}
+
+// what the operator set for the model wins over what was learned from it
+void profile_load(int vendor, int product, int release, char *addr)
+{
+  struct profile over;
+  char path[64];
+
+  profile_clear(&profile_learned);
+  profile_clear(&profile_cur);
+  if (!profile_enabled)
+    return;
+  if (profile_stats == NULL)
+  {
+    profile_stats = mmap(NULL, sizeof(*profile_stats),
+			 PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+    if (profile_stats == MAP_FAILED)
+    {
+      log_printf(LOG_ERR, "%s: mmap() error\n", addr);
+      profile_stats = NULL;
+      return;
+    }
+  }
+  profile_model[0] = vendor;
+  profile_model[1] = product;
+  profile_model[2] = release;
+  snprintf(profile_key, sizeof(profile_key), "%04x:%04x:%04x", vendor,
+	   product, release);
+  snprintf(path, sizeof(path), "%s/%s", PROFILE_DIR, profile_key);
+  profile_read(path, vendor, product, release, &profile_learned);
+  profile_merge(&profile_cur, &profile_learned);
+  profile_clear(&over);
+  profile_read(PROFILE_OVERRIDE, vendor, product, release, &over);
+  profile_merge(&profile_cur, &over);
+  profile_probe = profile_learned.readahead == 0 && over.readahead == -1;
+  log_printf(LOG_DEBUG, "%s: profile %s, buffers %d KB, read-ahead %d, "
+	     "nodelay %d\n", addr, profile_key, profile_buffer(),
+	     profile_readahead(), profile_nodelay());
+}
+
+// socket buffers to start the sessions with in KB, 0 when unknown
+int profile_buffer(void)
+{
+  return profile_cur.buffer > 0 ? profile_cur.buffer : 0;
+}
+
+// a model that learned not to read ahead still does it for one read in
+// PROFILE_PROBE, so that a device which changed can learn it back
+int profile_readahead(void)
+{
+  if (profile_cur.readahead != 0)
+    return 1;
+  return profile_probe && ++profile_probes % PROFILE_PROBE == 0;
+}
+
+int profile_nodelay(void)
+{
+  return profile_cur.nodelay != 0;
+}
+
+// the statistics are kept by the device process
+void profile_confine(void)
+{
+  if (profile_stats != NULL)
+    munmap(profile_stats, sizeof(*profile_stats));
+  profile_stats = NULL;
+}
+
+void profile_start(uint8_t *types)
+{
+  if (profile_stats == NULL)
+    return;
+  bzero(profile_stats, sizeof(*profile_stats));
+  memcpy(profile_types, types, sizeof(profile_types));
+}
+
+// 0 for 0, then one class per power of two
+int profile_class(uint64_t v)
+{
+  int c;
+
+  for (c = 0; v && c < PROFILE_CLASSES - 1; c++)
+    v >>= 1;
+  return c;
+}
+
+// lower bound of the class holding the median
+int profile_median(uint64_t *classes)
+{
+  uint64_t total;
+  uint64_t sum;
+  int c;
+
+  total = 0;
+  for (c = 0; c < PROFILE_CLASSES; c++)
+    total += classes[c];
+  sum = 0;
+  for (c = 0; c < PROFILE_CLASSES - 1; c++)
+  {
+    sum += classes[c];
+    if (sum * 2 >= total)
+      break;
+  }
+  return c ? 1 << (c - 1) : 0;
+}
+
+// the endpoint processes of a tunnelled session count here too
+void profile_urb(int endp, int dir, int len)
+{
+  uint64_t now;
+  uint64_t last;
+
+  if (profile_stats == NULL)
+    return;
+  endp &= 15;
+  dir = dir != 0;
+  __sync_fetch_and_add(&profile_stats->count[endp][dir], 1);
+  __sync_fetch_and_add(&profile_stats->bytes[endp][dir], len);
+  __sync_fetch_and_add(&profile_stats->sizes[profile_class(len)], 1);
+  now = timing_usec();
+  last = __sync_lock_test_and_set(&profile_stats->last, now);
+  if (last && now > last)
+    __sync_fetch_and_add(&profile_stats->gaps[profile_class(now - last)],
+			 1);
+}
+
+void profile_ra(int hit)
+{
+  if (profile_stats == NULL)
+    return;
+  if (hit)
+    profile_stats->ra_hits++;
+  else
+    profile_stats->ra_misses++;
+}
+
+// largest socket buffer the tuning went to, in bytes
+void profile_peak(int bytes)
+{
+  if (profile_stats != NULL)
+    profile_stats->peak = bytes;
+}
+
+// what a session saw goes onto the profile, the buffers averaged over
+// the sessions so that one large transfer does not make a model keep
+// large buffers
+void profile_learn(struct profile *p, struct profile *seen)
+{
+  if (seen->buffer > 0)
+    p->buffer = p->buffer > 0 ?
+      (3 * p->buffer + seen->buffer + 2) / 4 : seen->buffer;
+  if (seen->readahead != -1)
+    p->readahead = seen->readahead;
+  if (seen->nodelay != -1 && p->nodelay != 2)
+    p->nodelay = seen->nodelay;
+}
+
+// learned values go on their own line after what they were learned from,
+// the file is replaced at once so that loading never sees half of it;
+// other sessions of the model may have saved it since it was loaded, it
+// is read again with the directory locked so that none of them is lost
+void profile_save(struct profile *seen, uint64_t urbs, int size, int gap,
+		  char *addr)
+{
+  struct profile_stats *st = profile_stats;
+  char path[64];
+  char tmp[80];
+  FILE *f;
+  int e;
+  int d;
+
+  snprintf(path, sizeof(path), "%s/%s", PROFILE_DIR, profile_key);
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  d = open(PROFILE_DIR, O_RDONLY);
+  if (d == -1 || flock(d, LOCK_EX) == -1)
+  {
+    log_printf(LOG_ERR, "%s: cannot lock %s\n", addr, PROFILE_DIR);
+    if (d != -1)
+      close(d);
+    return;
+  }
+  profile_clear(&profile_learned);
+  profile_read(path, profile_model[0], profile_model[1], profile_model[2],
+	       &profile_learned);
+  profile_learn(&profile_learned, seen);
+
+  f = fopen(tmp, "w");
+  if (f == NULL)
+  {
+    log_printf(LOG_ERR, "%s: error writing %s\n", addr, tmp);
+    close(d);
+    return;
+  }
+  fprintf(f, "# %llu urbs, sizes ~%d, gaps ~%d usec, read-ahead %u/%u\n#",
+	  (unsigned long long)urbs, size, gap, st->ra_hits,
+	  st->ra_hits + st->ra_misses);
+  for (e = 0; e < 16; e++)
+    if (st->count[e][0] || st->count[e][1])
+      fprintf(f, " ep%d %llu out %llu in", e,
+	      (unsigned long long)st->count[e][0],
+	      (unsigned long long)st->count[e][1]);
+  fprintf(f, "\n%s", profile_key);
+  if (profile_learned.buffer != -1)
+    fprintf(f, " buffer=%d", profile_learned.buffer);
+  if (profile_learned.readahead != -1)
+    fprintf(f, " readahead=%d", profile_learned.readahead);
+  if (profile_learned.nodelay != -1)
+    fprintf(f, " nodelay=%d", profile_learned.nodelay);
+  fprintf(f, "\n");
+  if (fclose(f) == EOF || rename(tmp, path) == -1)
+  {
+    log_printf(LOG_ERR, "%s: error writing %s\n", addr, path);
+    unlink(tmp);
+  }
+  close(d);
+}
+
+// learn from the session: the buffers the tuning grew to, whether the
+// read-ahead paid, and whether the answers are a stream of large bulk
+// transfers which the network may coalesce, never done when interrupt or
+// isochronous transfers would wait behind them
+void profile_stop(char *addr)
+{
+  struct profile_stats *st = profile_stats;
+  struct profile seen;
+  uint64_t bytes;
+  uint64_t urbs;
+  uint64_t bulk;
+  uint64_t live;
+  int size;
+  int gap;
+  int e;
+
+  if (st == NULL)
+    return;
+  urbs = 0;
+  bytes = 0;
+  bulk = 0;
+  live = 0;
+  for (e = 0; e < 16; e++)
+  {
+    urbs += st->count[e][0] + st->count[e][1];
+    bytes += st->bytes[e][0] + st->bytes[e][1];
+    if (profile_types[e] == UE_BULK)
+      bulk += st->bytes[e][0] + st->bytes[e][1];
+    if (profile_types[e] == UE_INTERRUPT ||
+	profile_types[e] == UE_ISOCHRONOUS)
+      live += st->count[e][0] + st->count[e][1];
+  }
+  if (urbs == 0)
+    return;
+  size = profile_median(st->sizes);
+  gap = profile_median(st->gaps);
+
+  // the peak comes from memory the network process of a privilege
+  // separated session can write, it is kept within -w
+  profile_clear(&seen);
+  seen.buffer = tune_clamp(st->peak) / 1024;
+  if (st->ra_hits + st->ra_misses >= PROFILE_RA)
+    seen.readahead = st->ra_hits >= st->ra_misses;
+  if (urbs >= PROFILE_URBS)
+    seen.nodelay = live || bulk * 10 < bytes * 9 ||
+      size < PROFILE_STREAM || gap >= PROFILE_GAP;
+
+  // gaps that grew while answers were coalesced are the client waiting
+  // for them, the model never coalesces again
+  if (urbs >= PROFILE_URBS && !profile_nodelay() && gap >= PROFILE_GAP)
+    seen.nodelay = 2;
+  profile_save(&seen, urbs, size, gap, addr);
+  log_printf(LOG_INFO, "%s: profile %s, %llu urbs, sizes ~%d, gaps ~%d "
+	     "usec, buffers %d KB, nodelay %d\n", addr, profile_key,
+	     (unsigned long long)urbs, size, gap, profile_learned.buffer,
+	     profile_learned.nodelay);
+}
@@ -0,0 +1,65 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#define PROFILE_DIR "/var/db/openusbipd"
+#define PROFILE_OVERRIDE "/etc/openusbipd.profiles"
+#define PROFILE_CLASSES 24
+#define PROFILE_URBS 64
+#define PROFILE_RA 16
+#define PROFILE_PROBE 16
+#define PROFILE_STREAM 16384
+#define PROFILE_GAP 1000
+
+// how a model is served, -1 where nothing is known
+struct profile
+{
+  int buffer;
+  int readahead;
+  int nodelay;
+};
+
+int profile_enable(void);
+void profile_load(int vendor, int product, int release, char *addr);
+int profile_buffer(void);
+int profile_readahead(void);
+int profile_nodelay(void);
+void profile_confine(void);
+void profile_start(uint8_t *types);
+void profile_urb(int endp, int dir, int len);
+void profile_ra(int hit);
+void profile_peak(int bytes);
+void profile_stop(char *addr);
+
+#endif
@@ -0,0 +1,530 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "log.h"
+#include "net.h"
+#include "process.h"
+#include "query.h"
+#include "timing.h"
+
+// devices that keep timing out are left alone for a while, and what the
+// scans cost, shared by all the processes, with the devices known on each
+// unit when they are kept across restarts
+struct query_shm
+{
+  volatile uint32_t strikes[QUERY_UNITS];
+  volatile uint64_t until[QUERY_UNITS];
+  volatile uint64_t scans;
+  volatile uint64_t usec;
+  volatile uint64_t usec_last;
+  volatile uint64_t usec_max;
+  volatile uint64_t timeouts;
+  volatile uint32_t ndev;
+  volatile uint32_t gen[QUERY_UNITS];
+  volatile uint32_t lock[QUERY_UNITS];
+  volatile uint32_t known[QUERY_UNITS];
+  volatile uint32_t changes;
+  volatile uint32_t saved;
+  volatile uint64_t hits;
+  volatile uint64_t misses;
+  struct query_dev devs[QUERY_UNITS];
+};
+
+// the file starts with the entry size, which changes with the layout
+struct query_file
+{
+  char magic[4];
+  uint32_t size;
+  uint32_t n;
+};
+
+// what a scan learnt of a unit, only a unit whose open failed for lack
+// of a device is forgotten
+#define QUERY_FOUND 1
+#define QUERY_KEPT 2
+#define QUERY_GONE 3
+
+struct query_worker
+{
+  pid_t pid;
+  int fd;
+  int unit;
+  uint64_t deadline;
+};
+
+static struct query_shm *query_shm = NULL;
+static int query_persisted = 0;
+static int query_loaded = 0;
+
+void query_persist(void)
+{
+  query_persisted = 1;
+}
+
+// the devices known before the restart, each one is served again once
+// its unit shows the same device
+int query_load(void)
+{
+  struct query_file hdr;
+  struct query_dev qd;
+  uint32_t i;
+  FILE *f;
+  int n;
+
+  f = fopen(QUERY_CACHE, "r");
+  if (f == NULL)
+    return 0;
+  n = 0;
+  if (fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+      memcmp(hdr.magic, QUERY_MAGIC, sizeof(hdr.magic)) == 0 &&
+      hdr.size == sizeof(qd))
+    for (i = 0; i < hdr.n; i++)
+    {
+      bzero(&qd, sizeof(qd));
+      if (fread(&qd, offsetof(struct query_dev, uif), 1, f) != 1 ||
+	  qd.unit < 0 || qd.unit >= QUERY_UNITS ||
+	  fread(qd.uif, sizeof(*qd.uif), qd.dev.if_n, f) != qd.dev.if_n)
+	break;
+      memcpy(&query_shm->devs[qd.unit], &qd, sizeof(qd));
+      query_shm->known[qd.unit] = 1;
+      n++;
+    }
+  fclose(f);
+  return n;
+}
+
+int query_init(void)
+{
+  query_shm = mmap(NULL, sizeof(*query_shm), PROT_READ | PROT_WRITE,
+		   MAP_ANON | MAP_SHARED, -1, 0);
+  if (query_shm == MAP_FAILED)
+  {
+    perror("mmap()");
+    query_shm = NULL;
+    return -1;
+  }
+  if (query_persisted)
+    query_loaded = query_load();
+  return 0;
+}
+
+void query_confine(void)
+{
+  if (query_shm != NULL)
+    munmap(query_shm, sizeof(*query_shm));
+  query_shm = NULL;
+}
+
+// copy what is known of a unit, unless a store is under way
+int query_copy(int unit, struct query_dev *qd)
+{
+  uint32_t gen;
+
+  gen = query_shm->gen[unit];
+  __sync_synchronize();
+  if (gen & 1 || !query_shm->known[unit])
+    return -1;
+  memcpy(qd, &query_shm->devs[unit], sizeof(*qd));
+  __sync_synchronize();
+  return query_shm->gen[unit] == gen ? 0 : -1;
+}
+
+// the descriptors of a device seen before, if the unit still has the
+// same device in the same configuration
+int query_cached(struct query_dev *qd, int conf)
+{
+  struct query_dev *known;
+
+  if (!query_persisted || query_shm == NULL || qd->unit < 0 ||
+      qd->unit >= QUERY_UNITS)
+    return -1;
+  known = &query_shm->devs[qd->unit];
+  if (!query_shm->known[qd->unit] ||
+      memcmp(&known->fp, &qd->fp, sizeof(qd->fp)) != 0 ||
+      known->dev.conf != conf || query_copy(qd->unit, qd))
+  {
+    __sync_add_and_fetch(&query_shm->misses, 1);
+    return -1;
+  }
+  __sync_add_and_fetch(&query_shm->hits, 1);
+  return 0;
+}
+
+// a store racing with another one of the same unit is dropped, both
+// hold what the device just told; a device telling what is already known
+// is no change to save
+void query_store(struct query_dev *qd)
+{
+  size_t len;
+  int unit;
+
+  unit = qd->unit;
+  if (!query_persisted || query_shm == NULL || unit < 0 ||
+      unit >= QUERY_UNITS ||
+      !__sync_bool_compare_and_swap(&query_shm->lock[unit], 0, 1))
+    return;
+  len = offsetof(struct query_dev, uif) + qd->dev.if_n * sizeof(*qd->uif);
+  if (query_shm->known[unit] &&
+      memcmp(&query_shm->devs[unit], qd, len) == 0)
+  {
+    __sync_lock_release(&query_shm->lock[unit]);
+    return;
+  }
+  __sync_add_and_fetch(&query_shm->gen[unit], 1);
+  memcpy(&query_shm->devs[unit], qd, sizeof(*qd));
+  query_shm->known[unit] = 1;
+  __sync_add_and_fetch(&query_shm->gen[unit], 1);
+  __sync_lock_release(&query_shm->lock[unit]);
+  __sync_add_and_fetch(&query_shm->changes, 1);
+}
+
+void query_forget(int unit)
+{
+  if (!query_persisted || query_shm == NULL || !query_shm->known[unit])
+    return;
+  query_shm->known[unit] = 0;
+  __sync_add_and_fetch(&query_shm->changes, 1);
+}
+
+// the known devices are written when they changed since the last write,
+// with only the interfaces they have, and the file is replaced at once;
+// one process writes each generation of changes, a failed write leaves it
+// to the next save
+void query_save(char *addr)
+{
+  struct query_file hdr;
+  struct query_dev qd;
+  uint32_t changes;
+  uint32_t saved;
+  char tmp[64];
+  FILE *f;
+  int res;
+  int i;
+
+  if (!query_persisted || query_shm == NULL)
+    return;
+  changes = query_shm->changes;
+  saved = query_shm->saved;
+  if (changes == saved ||
+      !__sync_bool_compare_and_swap(&query_shm->saved, saved, changes))
+    return;
+  snprintf(tmp, sizeof(tmp), "%s.%d", QUERY_CACHE, (int)getpid());
+  f = fopen(tmp, "w");
+  if (f == NULL)
+  {
+    log_printf(LOG_ERR, "%s: error writing %s\n", addr, tmp);
+    __sync_bool_compare_and_swap(&query_shm->saved, changes, saved);
+    return;
+  }
+  memcpy(hdr.magic, QUERY_MAGIC, sizeof(hdr.magic));
+  hdr.size = sizeof(qd);
+  hdr.n = 0;
+  res = fwrite(&hdr, sizeof(hdr), 1, f) == 1 ? 0 : -1;
+  for (i = 0; i < QUERY_UNITS && res == 0; i++)
+  {
+    // a unit being stored is left to the save following its store
+    if (query_copy(i, &qd))
+      continue;
+    if (fwrite(&qd, offsetof(struct query_dev, uif), 1, f) != 1 ||
+	fwrite(qd.uif, sizeof(*qd.uif), qd.dev.if_n, f) != qd.dev.if_n)
+      res = -1;
+    hdr.n++;
+  }
+  if (res == 0 && (fseek(f, 0, SEEK_SET) == -1 ||
+		   fwrite(&hdr, sizeof(hdr), 1, f) != 1))
+    res = -1;
+  if (fclose(f) == EOF || res || rename(tmp, QUERY_CACHE) == -1)
+  {
+    log_printf(LOG_ERR, "%s: error writing %s\n", addr, QUERY_CACHE);
+    unlink(tmp);
+    __sync_bool_compare_and_swap(&query_shm->saved, changes, saved);
+  }
+}
+
+int query_quarantined(int unit, uint64_t now)
+{
+  return query_shm != NULL &&
+    query_shm->strikes[unit] >= QUERY_STRIKES &&
+    now < query_shm->until[unit];
+}
+
+void query_timeout(int unit, char *addr)
+{
+  uint32_t strikes;
+
+  if (query_shm == NULL)
+    return;
+  __sync_add_and_fetch(&query_shm->timeouts, 1);
+  strikes = __sync_add_and_fetch(&query_shm->strikes[unit], 1);
+  if (strikes < QUERY_STRIKES)
+    log_printf(LOG_WARNING, "%s: ugen%d timed out\n", addr, unit);
+  else
+  {
+    query_shm->until[unit] = timing_usec() + QUERY_QUARANTINE * 1000000ULL;
+    log_printf(LOG_WARNING, "%s: ugen%d timed out %u times, ignored for "
+	       "%d seconds\n", addr, unit, strikes, QUERY_QUARANTINE);
+  }
+}
+
+// query a unit in a process of its own, which can be left behind if
+// the device does not answer
+int query_fork(struct query_worker *w, int unit, char *addr)
+{
+  struct query_dev qd;
+  int err;
+  int p[2];
+
+  if (pipe(p) == -1)
+    return -1;
+  w->pid = fork();
+  if (w->pid == -1)
+  {
+    close(p[0]);
+    close(p[1]);
+    return -1;
+  }
+  if (w->pid == 0)
+  {
+    close(p[0]);
+    qd.unit = unit;
+    err = process_query(unit, &qd, addr) ? errno : 0;
+    if (net_send(p[1], &err, sizeof(err)) == 0 && err == 0)
+      net_send(p[1], &qd, sizeof(qd));
+    _exit(EXIT_SUCCESS);
+  }
+  close(p[1]);
+  w->fd = p[0];
+  w->unit = unit;
+  w->deadline = timing_usec() + QUERY_TIMEOUT * 1000ULL;
+  return 0;
+}
+
+// the answer of a worker, into the device of its unit
+int query_read(struct query_worker *w, struct query_dev *found)
+{
+  int err;
+
+  if (net_read(w->fd, &err, sizeof(err)))
+    return QUERY_KEPT;
+  if (err == ENOENT || err == ENXIO)
+    return QUERY_GONE;
+  if (err || net_read(w->fd, &found[w->unit], sizeof(*found)))
+    return QUERY_KEPT;
+  return QUERY_FOUND;
+}
+
+void query_done(struct query_worker *w, int timeout, char *addr)
+{
+  if (timeout)
+  {
+    kill(w->pid, SIGKILL);
+    query_timeout(w->unit, addr);
+  }
+  else if (query_shm != NULL)
+    query_shm->strikes[w->unit] = 0;
+  close(w->fd);
+  waitpid(w->pid, NULL, timeout ? WNOHANG : 0);
+  w->pid = -1;
+}
+
+// query the ugen units with a few workers at once, a slow device only
+// delays its own answer, returns the number of devices found, the first
+// max ones by unit
+int query_scan(struct query_dev *qds, int max, char *addr)
+{
+  struct query_worker ws[QUERY_WORKERS];
+  struct pollfd pfd[QUERY_WORKERS];
+  struct query_dev *found;
+  char state[QUERY_UNITS];
+  uint64_t now;
+  uint64_t t0;
+  int timeout;
+  int unit;
+  int ndev;
+  int n;
+  int i;
+
+  t0 = timing_usec();
+  found = malloc(QUERY_UNITS * sizeof(*found));
+  if (found == NULL)
+  {
+    log_printf(LOG_ERR, "%s: malloc() error\n", addr);
+    return 0;
+  }
+  bzero(state, sizeof(state));
+  for (i = 0; i < QUERY_WORKERS; i++)
+    ws[i].pid = -1;
+  unit = 0;
+  for (;;)
+  {
+    now = timing_usec();
+    for (i = 0; i < QUERY_WORKERS && unit < QUERY_UNITS; i++)
+      if (ws[i].pid == -1)
+      {
+	while (unit < QUERY_UNITS && query_quarantined(unit, now))
+	  state[unit++] = QUERY_KEPT;
+	if (unit < QUERY_UNITS && query_fork(&ws[i], unit++, addr))
+	  log_printf(LOG_ERR, "%s: cannot query ugen%d\n", addr, unit - 1);
+      }
+
+    n = 0;
+    timeout = QUERY_TIMEOUT;
+    for (i = 0; i < QUERY_WORKERS; i++)
+    {
+      pfd[i].fd = ws[i].pid == -1 ? -1 : ws[i].fd;
+      pfd[i].events = POLLIN;
+      if (ws[i].pid == -1)
+	continue;
+      n++;
+      if (ws[i].deadline <= now)
+	timeout = 0;
+      else if ((ws[i].deadline - now) / 1000 < timeout)
+	timeout = (ws[i].deadline - now) / 1000 + 1;
+    }
+    if (n == 0 && unit >= QUERY_UNITS)
+      break;
+    if (poll(pfd, QUERY_WORKERS, timeout) == -1)
+      break;
+
+    now = timing_usec();
+    for (i = 0; i < QUERY_WORKERS; i++)
+    {
+      if (ws[i].pid == -1)
+	continue;
+      if (pfd[i].revents)
+      {
+	state[ws[i].unit] = query_read(&ws[i], found);
+	query_done(&ws[i], 0, addr);
+      }
+      else if (ws[i].deadline <= now)
+      {
+	state[ws[i].unit] = QUERY_KEPT;
+	query_done(&ws[i], 1, addr);
+      }
+    }
+  }
+
+  // the workers of an interrupted scan are not waited for
+  for (i = 0; i < QUERY_WORKERS; i++)
+    if (ws[i].pid != -1)
+    {
+      state[ws[i].unit] = QUERY_KEPT;
+      query_done(&ws[i], 1, addr);
+    }
+  // the workers answer in any order, the lists are by unit
+  ndev = 0;
+  for (i = 0; i < QUERY_UNITS; i++)
+  {
+    if (state[i] == QUERY_GONE)
+      query_forget(i);
+    if (state[i] == QUERY_FOUND && ndev < max)
+      memcpy(&qds[ndev++], &found[i], sizeof(*qds));
+  }
+  free(found);
+  query_save(addr);
+
+  now = timing_usec() - t0;
+  if (query_shm != NULL)
+  {
+    __sync_add_and_fetch(&query_shm->scans, 1);
+    __sync_add_and_fetch(&query_shm->usec, now);
+    query_shm->usec_last = now;
+    if (now > query_shm->usec_max)
+      query_shm->usec_max = now;
+    query_shm->ndev = ndev;
+  }
+  log_printf(LOG_DEBUG, "%s: %d devices found in %llu usec\n", addr, ndev,
+	     (unsigned long long)now);
+  return ndev;
+}
+
+// a first scan, which finds the slow devices before the first client
+void query_start(void)
+{
+  struct query_dev *qds;
+  uint64_t t0;
+  int ndev;
+
+  // the devices kept from before stand in for the first scan, each one
+  // is checked against its unit when it is listed or imported
+  if (query_loaded)
+  {
+    log_printf(LOG_INFO, "query: %d devices known from %s\n", query_loaded,
+	       QUERY_CACHE);
+    return;
+  }
+  qds = malloc(QUERY_UNITS * sizeof(*qds));
+  if (qds == NULL)
+    return;
+  t0 = timing_usec();
+  ndev = query_scan(qds, QUERY_UNITS, "query");
+  log_printf(LOG_INFO, "query: %d devices found in %llu usec\n", ndev,
+	     (unsigned long long)(timing_usec() - t0));
+  free(qds);
+}
+
+void query_dump(void)
+{
+  int n;
+  int i;
+
+  if (query_shm == NULL)
+    return;
+  n = 0;
+  for (i = 0; i < QUERY_UNITS; i++)
+    if (query_quarantined(i, timing_usec()))
+      n++;
+  printf("query: %llu scans, last %llu usec, max %llu usec, avg %llu usec, "
+	 "%u devices, %llu timeouts, %d quarantined, %llu known, "
+	 "%llu queried\n",
+	 (unsigned long long)query_shm->scans,
+	 (unsigned long long)query_shm->usec_last,
+	 (unsigned long long)query_shm->usec_max,
+	 (unsigned long long)(query_shm->scans ?
+			      query_shm->usec / query_shm->scans : 0),
+	 query_shm->ndev, (unsigned long long)query_shm->timeouts, n,
+	 (unsigned long long)query_shm->hits,
+	 (unsigned long long)query_shm->misses);
+  fflush(stdout);
+}
@@ -0,0 +1,78 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#define QUERY_UNITS 64
+#define QUERY_WORKERS 8
+#define QUERY_TIMEOUT 1000
+#define QUERY_STRIKES 3
+#define QUERY_QUARANTINE 60
+#define QUERY_IF_MAX 256
+#define QUERY_SERIAL 128
+#define QUERY_DDESC 18
+#define QUERY_CACHE "/var/db/openusbipd.devices"
+#define QUERY_MAGIC "OUQC"
+
+// what tells a device from another one seen before on the same unit
+struct query_fp
+{
+  uint16_t vendor;
+  uint16_t product;
+  uint16_t release;
+  uint8_t bus;
+  uint8_t addr;
+  char serial[QUERY_SERIAL];
+};
+
+// what a device list tells about a device, and what an import needs
+struct query_dev
+{
+  int unit;
+  struct query_fp fp;
+  uint8_t ddesc[QUERY_DDESC];
+  struct net_usb_dev dev;
+  struct net_usb_if uif[QUERY_IF_MAX];
+};
+
+void query_persist(void);
+int query_init(void);
+void query_confine(void);
+int query_cached(struct query_dev *qd, int conf);
+void query_store(struct query_dev *qd);
+void query_save(char *addr);
+int query_scan(struct query_dev *qds, int max, char *addr);
+void query_start(void);
+void query_dump(void);
+
+#endif
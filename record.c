@@ -0,0 +1,180 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "net.h"
+#include "record.h"
+#include "timing.h"
+
+static char *record_path = NULL;
+static FILE *record_fp = NULL;
+static uint64_t record_t0;
+static int record_n = 0;
+
+void record_open(char *path)
+{
+  record_path = path;
+}
+
+int record_enabled(void)
+{
+  return record_path != NULL;
+}
+
+void record_write(int type, void *hdr, int hlen, void *buf, int len)
+{
+  struct record_ent ent;
+  uint64_t t;
+
+  if (record_fp == NULL)
+    return;
+
+  t = timing_usec() - record_t0;
+  ent.type = htonl(type);
+  ent.len = htonl(hlen + len);
+  ent.sec = htonl(t / 1000000);
+  ent.usec = htonl(t % 1000000);
+  if (fwrite(&ent, sizeof(ent), 1, record_fp) != 1 ||
+      fwrite(hdr, hlen, 1, record_fp) != 1 ||
+      (len && fwrite(buf, len, 1, record_fp) != 1))
+  {
+    log_printf(LOG_ERR, "record: write error, capture stopped\n");
+    fclose(record_fp);
+    record_fp = NULL;
+  }
+}
+
+// a forked process leaves the capture to its parent, without flushing
+// a copy of what the parent buffered
+void record_detach(void)
+{
+  record_fp = NULL;
+}
+
+void record_hdr(struct net_hdr *dst, struct net_hdr *src)
+{
+  dst->cmd = htonl(src->cmd);
+  dst->seq = htonl(src->seq);
+  dst->dev = htonl(src->dev);
+  dst->dir = htonl(src->dir);
+  dst->endp = htonl(src->endp);
+}
+
+void record_start(char *bus, struct net_usb_dev *dev, struct net_usb_if *uif)
+{
+  struct record_file file;
+  char imp[NET_USB_BUS_MAX + sizeof(struct net_usb_dev) +
+	   256 * sizeof(struct net_usb_if)];
+  char *path;
+
+  if (record_path == NULL)
+    return;
+
+  // a lingering session records each of its importers to its own file
+  if (record_fp != NULL)
+    fclose(record_fp);
+  record_fp = NULL;
+  if ((record_n++ == 0 ?
+       asprintf(&path, "%s.%d", record_path, getpid()) :
+       asprintf(&path, "%s.%d.%d", record_path, getpid(), record_n)) < 0)
+  {
+    log_printf(LOG_ERR, "record: malloc() error\n");
+    return;
+  }
+  record_fp = fopen(path, "w");
+  if (record_fp == NULL)
+  {
+    log_printf(LOG_ERR, "record: %s: %s\n", path, strerror(errno));
+    free(path);
+    return;
+  }
+  free(path);
+
+  bzero(&file, sizeof(file));
+  memcpy(file.magic, RECORD_MAGIC, sizeof(RECORD_MAGIC));
+  file.v = htonl(RECORD_VERSION);
+  if (fwrite(&file, sizeof(file), 1, record_fp) != 1)
+  {
+    fclose(record_fp);
+    record_fp = NULL;
+    return;
+  }
+
+  // the import entry is the bus id, the device and its interfaces
+  bzero(imp, sizeof(imp));
+  strlcpy(imp, bus, NET_USB_BUS_MAX);
+  memcpy(imp + NET_USB_BUS_MAX, dev, sizeof(*dev));
+  memcpy(imp + NET_USB_BUS_MAX + sizeof(*dev), uif, dev->if_n * sizeof(*uif));
+  record_t0 = timing_usec();
+  record_write(RECORD_IMPORT, imp, NET_USB_BUS_MAX + sizeof(*dev) +
+	       dev->if_n * sizeof(*uif), NULL, 0);
+}
+
+void record_submit(struct net_submit *submit, void *buf, int len)
+{
+  struct net_submit n;
+
+  if (record_fp == NULL)
+    return;
+
+  record_hdr(&n.hdr, &submit->hdr);
+  n.fl = htonl(submit->fl);
+  n.len = htonl(submit->len);
+  n.sfrm = htonl(submit->sfrm);
+  n.pkt_n = htonl(submit->pkt_n);
+  n.intv = htonl(submit->intv);
+  memcpy(n.setup, submit->setup, 8);
+  record_write(RECORD_SUBMIT, &n, sizeof(n), buf, len);
+}
+
+void record_ret(struct net_submit_ret *ret, void *buf, int len)
+{
+  record_write(RECORD_RET, ret, sizeof(*ret), buf, len);
+}
+
+void record_unlink(struct net_unlink *unlink)
+{
+  struct net_unlink n;
+
+  if (record_fp == NULL)
+    return;
+
+  record_hdr(&n.hdr, &unlink->hdr);
+  n.seq = unlink->seq;
+  record_write(RECORD_UNLINK, &n, sizeof(n), NULL, 0);
+}
@@ -0,0 +1,75 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#define RECORD_MAGIC "OUSBREC"
+#define RECORD_VERSION 1
+
+#define RECORD_IMPORT 1
+#define RECORD_SUBMIT 2
+#define RECORD_RET 3
+#define RECORD_UNLINK 4
+
+// all fields are stored in network byte order, entry data is the
+// protocol structure as seen on the wire followed by its payload
+struct record_file
+{
+  char magic[8];
+  uint32_t v;
+  uint32_t pad;
+} __attribute__((packed));
+
+struct record_ent
+{
+  uint32_t type;
+  uint32_t len;
+  uint32_t sec;
+  uint32_t usec;
+} __attribute__((packed));
+
+struct net_usb_dev;
+struct net_usb_if;
+struct net_submit;
+struct net_submit_ret;
+struct net_unlink;
+
+void record_open(char *path);
+int record_enabled(void);
+void record_detach(void);
+void record_start(char *bus, struct net_usb_dev *dev, struct net_usb_if *uif);
+void record_submit(struct net_submit *submit, void *buf, int len);
+void record_ret(struct net_submit_ret *ret, void *buf, int len);
+void record_unlink(struct net_unlink *unlink);
+
+#endif
@@ -0,0 +1,80 @@
+# Sequential READ(10) of 64 KB through the bulk-only transport of the
+# fake mass storage device, one command at a time like a real host, with
+# and without -b. The data and the status must be the same, with a
+# control request now and then between a command and its data. The rates
+# are printed: on loopback the gain of -b is small, the round trips of
+# each command dominate.
+
+import re
+
+from usbip import *
+
+FAKEMSC = os.environ.get('FAKEMSC', './fakemsc.so')
+SECS = 2
+
+
+class Storage(Client):
+
+    def urb(self, ep, dirin, length, setup=bytes(8), data=b''):
+        seq = self.submit(ep, length, dirin, setup, data)
+        cmd, rseq, status, data = self.ret()
+        check(rseq == seq, 'answer %d to urb %d' % (rseq, seq))
+        return status, data
+
+    def command(self, length, cb):
+        self.tag = getattr(self, 'tag', 0) + 1
+        cbw = struct.pack('<IIIBBB', 0x43425355, self.tag, length, 0x80, 0,
+                          len(cb)) + cb.ljust(16, b'\0')
+        check(self.urb(2, 0, 31, data=cbw)[0] == 0, 'command refused')
+
+    def status(self):
+        status, data = self.urb(1, 1, 13)
+        check(status == 0 and len(data) == 13 and
+              struct.unpack('<II', data[:8]) == (0x53425355, self.tag) and
+              data[12] == 0, 'bad status %d %r' % (status, data))
+
+
+def run(d, ctl):
+    c = Storage(d.port)
+    check(c.import_('usb0'), 'import refused:\n' + d.output())
+    c.command(8, bytes([0x25]))
+    status, data = c.urb(1, 1, 8)
+    check(struct.unpack('>II', data) == ((1 << 20) - 1, 512),
+          'bad capacity %r' % data)
+    c.status()
+    lba = 0
+    n = 0
+    t0 = time.time()
+    while time.time() - t0 < SECS:
+        c.command(65536, struct.pack('>BBIBH', 0x28, 0, lba, 0, 128))
+        if ctl and n % ctl == 0:
+            c.urb(0, 1, 2, setup=bytes([0x80, 0, 0, 0, 0, 0, 2, 0]))
+        data = b''
+        while len(data) < 65536:
+            status, d32 = c.urb(1, 1, 32768)
+            check(status == 0, 'read failed')
+            data += d32
+        check(struct.unpack('<I', data[:4])[0] == lba and
+              struct.unpack('<I', data[-4:])[0] == lba + 127,
+              'bad data at block %d' % lba)
+        c.status()
+        lba += 128
+        n += 1
+    c.close()
+    return n * 65536 / (time.time() - t0) / 1e6
+
+
+rates = {}
+for args in ((), ('-b',)):
+    for ctl in (0, 4):
+        with Daemon(*args, fake=FAKEMSC) as d:
+            rates[args, ctl] = run(d, ctl)
+            time.sleep(0.3)
+            if args:
+                check(re.search(r'read-ahead [1-9]\d* hits', d.output()),
+                      'no read-ahead hit:\n' + d.output())
+        print('%-6s %s %5.1f MB/s' % (' '.join(args) or 'plain',
+                                      'with control requests' if ctl else
+                                      '                     ',
+                                      rates[args, ctl]))
+print('bot ok')
@@ -0,0 +1,77 @@
+# -M bounds the bytes in flight of all the sessions together, a session
+# killed in the middle of a URB gives its share back, and a request the
+# daemon cannot do is still answered.
+
+import re
+import threading
+
+from usbip import *
+
+
+def in_flight(d):
+    # the last SIGUSR1 dump, in KB
+    os.kill(d.proc.pid, signal.SIGUSR1)
+    time.sleep(0.3)
+    found = re.findall(r'budget: (\d+) KB in flight, peak (\d+) KB',
+                       d.output())
+    check(found, 'no budget dump:\n' + d.output())
+    return tuple(int(x) for x in found[-1])
+
+
+def reader(port, bus, n):
+    c = Client(port)
+    check(c.import_(bus), 'import of %s refused' % bus)
+    for i in range(n):
+        c.submit(1, 16384)
+    for i in range(n):
+        check(c.ret()[2] == 0, 'bulk read failed')
+    c.close()
+
+
+with Daemon('-P', '-M', 64, units=2,
+            env={'FAKEUGEN_BULK_US': '2000'}) as d:
+    threads = [threading.Thread(target=reader, args=(d.port, b, 200))
+               for b in ('usb0', 'usb1')]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    time.sleep(1)
+    used, peak = in_flight(d)
+    print('-P -M 64: %d KB in flight after the sessions, peak %d KB' %
+          (used, peak))
+    # each session can pass its check just under the limit, and with -P
+    # the device process charges what the network process took later
+    check(used == 0 and 0 < peak <= 64 + 2 * 2 * 16,
+          'in flight %d KB, peak %d KB' % (used, peak))
+
+with Daemon('-M', 16, units=2, env={'FAKEUGEN_BULK_US': '500000'}) as d:
+    before = set(d.children())
+    c = Client(d.port)
+    check(c.import_('usb0'), 'import of usb0 refused')
+    c.submit(1, 16384)
+    time.sleep(0.2)
+    for pid in set(d.children()) - before:
+        os.kill(pid, signal.SIGKILL)
+    c.close()
+
+    t0 = time.time()
+    reader(d.port, 'usb1', 1)
+    print('-M 16: a read after a session died holding the budget '
+          'took %.0f ms' % ((time.time() - t0) * 1000))
+    check(time.time() - t0 < 2, 'the share of the dead session was kept')
+    check(in_flight(d)[0] == 0, 'budget left in flight')
+
+with Daemon() as d:
+    c = Client(d.port)
+    check(c.import_('usb0'), 'import refused')
+    # a configuration descriptor bigger than the daemon reads
+    c.submit(0, 2048, setup=bytes([0x80, 6, 0, 2, 0, 0, 0, 8]))
+    cmd, seq, status, data = c.ret()
+    check(cmd == RET_SUBMIT and status < 0,
+          'failed request answered with %d %d' % (cmd, status))
+    c.submit(1, 512)
+    check(c.ret()[2] == 0, 'bulk read after a failed request')
+    c.close()
+
+print('budget ok')
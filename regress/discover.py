@@ -0,0 +1,62 @@
+# Discovery answers with the devices of the last rescan. An imported
+# device cannot be opened by the rescans, it stays in the answer and is
+# reported in use; an unplugged one leaves it. Past the 16 devices an
+# answer holds, the daemon logs what it left out.
+
+from usbip import *
+
+HDR = 20
+DEV = 44
+DEV_MAX = 16
+
+
+def query(port):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.settimeout(2)
+    q = b'OUSD' + struct.pack('>BBBBIIHH', 1, 1, 0, 0, 0, 7, 0, 0)
+    s.sendto(q.ljust(HDR + DEV_MAX * DEV, b'\0'), ('127.0.0.1', port))
+    d = s.recv(4096)
+    s.close()
+    gen, = struct.unpack('>I', d[8:12])
+    devs = {}
+    for i in range(d[7]):
+        dev = d[HDR + i * DEV:HDR + (i + 1) * DEV]
+        devs[dev[:32].rstrip(b'\0').decode()] = dev[41]
+    return gen, devs
+
+
+dport = free_port()
+with Daemon('-d', '127.0.0.1:%d' % dport, units=2) as d:
+    time.sleep(1.5)
+    gen, devs = query(dport)
+    check(devs == {'usb0': 0, 'usb1': 0}, 'wrong devices: %s' % devs)
+
+    c = Client(d.port)
+    check(c.import_('usb0'), 'import refused')
+    time.sleep(2.5)
+    gen2, devs = query(dport)
+    check(devs == {'usb0': 1, 'usb1': 0},
+          'imported device not in use: %s' % devs)
+    check(gen2 != gen, 'generation unchanged by the import')
+
+    c.close()
+    time.sleep(2.5)
+    gen3, devs = query(dport)
+    check(devs == {'usb0': 0, 'usb1': 0},
+          'detached device still in use: %s' % devs)
+    check(gen3 != gen2, 'generation unchanged by the detach')
+
+    # the rescans run without queries
+    d.units(1)
+    time.sleep(2.5)
+    gen4, devs = query(dport)
+    check(devs == {'usb0': 0}, 'unplugged device still there: %s' % devs)
+
+    d.units(20)
+    time.sleep(3)
+    gen5, devs = query(dport)
+    check(len(devs) == DEV_MAX, '%d devices announced' % len(devs))
+    check('20 devices, only 16 announced' in d.output(),
+          'truncation not logged:\n' + d.output())
+
+print('discover ok')
@@ -0,0 +1,317 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// A fake mass storage device on ugen0, preloaded under the daemon: the
+// bulk-only transport on a bulk IN endpoint 1 and a bulk OUT endpoint 2,
+// 512 byte blocks each holding their block number, READ CAPACITY and
+// READ(10) answered, every other command succeeds with zeroed data.
+//
+//   FAKEMSC_CMD_US   usec per command written, 300
+//   FAKEMSC_KB_US    usec per KB of data read, 40
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <dev/usb/usb.h>
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define FAKEMSC_FDS 4096
+#define FAKEMSC_BLOCKS (1 << 20)
+
+#define FAKEMSC_IDLE 0
+#define FAKEMSC_DATA 1
+#define FAKEMSC_CSW 2
+
+static int fakemsc_fds[FAKEMSC_FDS];
+static unsigned char fakemsc_cbw[31];
+static int fakemsc_phase = FAKEMSC_IDLE;
+static uint32_t fakemsc_len;
+static uint32_t fakemsc_off;
+
+static int fakemsc_env(const char *name, int def)
+{
+  char *v;
+
+  v = getenv(name);
+  return v != NULL ? (int)strtol(v, NULL, 0) : def;
+}
+
+// the endpoint of an fd plus one, 0 for the fds of others
+static int fakemsc_endp(int fd)
+{
+  if (fd < 0 || fd >= FAKEMSC_FDS)
+    return 0;
+  return fakemsc_fds[fd];
+}
+
+static uint32_t fakemsc_be32(unsigned char *p)
+{
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void fakemsc_set32(unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = (v >> 16) & 0xff;
+  p[2] = (v >> 8) & 0xff;
+  p[3] = v & 0xff;
+}
+
+int open(const char *path, int flags, ...)
+{
+  static int (*real_open)(const char *, int, ...);
+  va_list ap;
+  int mode;
+  int unit;
+  int endp;
+  int fd;
+
+  if (real_open == NULL)
+    real_open = dlsym(RTLD_NEXT, "open");
+  va_start(ap, flags);
+  mode = va_arg(ap, int);
+  va_end(ap);
+  if (sscanf(path, "/dev/ugen%d.%d", &unit, &endp) != 2)
+    return real_open(path, flags, mode);
+
+  if (unit != 0 || endp < 0 || endp > 2)
+  {
+    errno = ENXIO;
+    return -1;
+  }
+  fd = real_open("/dev/null", O_RDWR);
+  if (fd >= FAKEMSC_FDS)
+  {
+    close(fd);
+    errno = EMFILE;
+    return -1;
+  }
+  if (fd != -1)
+    fakemsc_fds[fd] = endp + 1;
+  return fd;
+}
+
+int ioctl(int fd, unsigned long req, ...)
+{
+  static int (*real_ioctl)(int, unsigned long, ...);
+  va_list ap;
+  void *arg;
+
+  va_start(ap, req);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+  if (!fakemsc_endp(fd))
+  {
+    if (real_ioctl == NULL)
+      real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+    return real_ioctl(fd, req, arg);
+  }
+
+  switch (req)
+  {
+  case USB_GET_DEVICEINFO:
+    {
+      struct usb_device_info *di = arg;
+
+      bzero(di, sizeof(*di));
+      di->udi_vendorNo = 0x1234;
+      di->udi_productNo = 0x5800;
+      return 0;
+    }
+  case USB_GET_DEVICE_DESC:
+    {
+      usb_device_descriptor_t *dd = arg;
+
+      bzero(dd, sizeof(*dd));
+      dd->bLength = USB_DEVICE_DESCRIPTOR_SIZE;
+      dd->bDescriptorType = UDESC_DEVICE;
+      USETW(dd->idVendor, 0x1234);
+      USETW(dd->idProduct, 0x5800);
+      USETW(dd->bcdDevice, 0x0100);
+      dd->bNumConfigurations = 1;
+      return 0;
+    }
+  case USB_GET_CONFIG:
+    *(int *)arg = 1;
+    return 0;
+  case USB_GET_CONFIG_DESC:
+    {
+      struct usb_config_desc *cd = arg;
+
+      bzero(&cd->ucd_desc, sizeof(cd->ucd_desc));
+      cd->ucd_desc.bNumInterface = 1;
+      return 0;
+    }
+  case USB_GET_INTERFACE_DESC:
+    {
+      struct usb_interface_desc *id = arg;
+
+      // mass storage, SCSI, bulk-only
+      bzero(&id->uid_desc, sizeof(id->uid_desc));
+      id->uid_desc.bNumEndpoints = 2;
+      id->uid_desc.bInterfaceClass = 0x08;
+      id->uid_desc.bInterfaceSubClass = 0x06;
+      id->uid_desc.bInterfaceProtocol = 0x50;
+      return 0;
+    }
+  case USB_GET_ENDPOINT_DESC:
+    {
+      struct usb_endpoint_desc *ed = arg;
+
+      bzero(&ed->ued_desc, sizeof(ed->ued_desc));
+      ed->ued_desc.bEndpointAddress = ed->ued_endpoint_index ? 2 :
+	UE_DIR_IN | 1;
+      ed->ued_desc.bmAttributes = UE_BULK;
+      USETW(ed->ued_desc.wMaxPacketSize, 512);
+      return 0;
+    }
+  case USB_SET_SHORT_XFER:
+  case USB_SET_TIMEOUT:
+  case USB_SET_CONFIG:
+    return 0;
+  case USB_DO_REQUEST:
+    {
+      struct usb_ctl_request *cr = arg;
+
+      cr->ucr_actlen = 0;
+      return 0;
+    }
+  }
+  errno = EINVAL;
+  return -1;
+}
+
+// a command block wrapper starts a command, its data phase follows if it
+// has one
+ssize_t write(int fd, const void *buf, size_t len)
+{
+  static ssize_t (*real_write)(int, const void *, size_t);
+
+  if (fakemsc_endp(fd) == 3)
+  {
+    if (len != sizeof(fakemsc_cbw) || fakemsc_phase != FAKEMSC_IDLE)
+    {
+      errno = EIO;
+      return -1;
+    }
+    memcpy(fakemsc_cbw, buf, len);
+    fakemsc_len = fakemsc_cbw[8] | fakemsc_cbw[9] << 8 |
+      fakemsc_cbw[10] << 16 | (uint32_t)fakemsc_cbw[11] << 24;
+    fakemsc_off = 0;
+    usleep(fakemsc_env("FAKEMSC_CMD_US", 300));
+    fakemsc_phase = fakemsc_len ? FAKEMSC_DATA : FAKEMSC_CSW;
+    return len;
+  }
+  if (real_write == NULL)
+    real_write = dlsym(RTLD_NEXT, "write");
+  return real_write(fd, buf, len);
+}
+
+static void fakemsc_data(unsigned char *p, uint32_t len)
+{
+  uint32_t lba;
+  uint32_t i;
+
+  bzero(p, len);
+  switch (fakemsc_cbw[15])
+  {
+  case 0x25: // READ CAPACITY
+    if (len >= 8)
+    {
+      fakemsc_set32(p, FAKEMSC_BLOCKS - 1);
+      fakemsc_set32(p + 4, 512);
+    }
+    break;
+  case 0x28: // READ(10)
+    lba = fakemsc_be32(fakemsc_cbw + 17);
+    for (i = 0; i + 4 <= len; i += 4)
+      *(uint32_t *)(p + i) = lba + (fakemsc_off + i) / 512;
+    break;
+  }
+}
+
+ssize_t read(int fd, void *buf, size_t len)
+{
+  static ssize_t (*real_read)(int, void *, size_t);
+  unsigned char *p = buf;
+  uint32_t n;
+
+  if (fakemsc_endp(fd) != 2)
+  {
+    if (real_read == NULL)
+      real_read = dlsym(RTLD_NEXT, "read");
+    return real_read(fd, buf, len);
+  }
+
+  switch (fakemsc_phase)
+  {
+  case FAKEMSC_DATA:
+    n = fakemsc_len - fakemsc_off;
+    if (n > len)
+      n = len;
+    usleep(fakemsc_env("FAKEMSC_KB_US", 40) * n / 1024);
+    fakemsc_data(p, n);
+    fakemsc_off += n;
+    if (fakemsc_off == fakemsc_len)
+      fakemsc_phase = FAKEMSC_CSW;
+    return n;
+  case FAKEMSC_CSW:
+    // the command status wrapper, always a success
+    if (len < 13)
+      break;
+    bzero(p, 13);
+    memcpy(p, "USBS", 4);
+    memcpy(p + 4, fakemsc_cbw + 4, 4);
+    fakemsc_phase = FAKEMSC_IDLE;
+    return 13;
+  }
+  errno = EIO;
+  return -1;
+}
+
+int close(int fd)
+{
+  static int (*real_close)(int);
+
+  if (real_close == NULL)
+    real_close = dlsym(RTLD_NEXT, "close");
+  if (fd >= 0 && fd < FAKEMSC_FDS)
+    fakemsc_fds[fd] = 0;
+  return real_close(fd);
+}
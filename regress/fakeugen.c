@@ -0,0 +1,383 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// A fake ugen(4), preloaded under the daemon so that its sessions run
+// without hardware. Each unit has a bulk IN endpoint 1, an interrupt IN
+// endpoint 2 and bulk IN endpoints up to FAKEUGEN_EPS, every other
+// endpoint opens but has no descriptor.
+// Opens are exclusive across processes like those of ugen, through a
+// lock file per endpoint in FAKEUGEN_DIR. The files the daemon keeps in
+// /var/db are moved to FAKEUGEN_DIR as well.
+//
+//   FAKEUGEN_DIR       lock files, and a "units" file read at each open
+//                      that unplugs units when it is lowered
+//   FAKEUGEN_UNITS     units when there is no "units" file, 1
+//   FAKEUGEN_EPS       endpoints with a descriptor, 2, at most 15
+//   FAKEUGEN_BULK_US   usec per bulk read, 500
+//   FAKEUGEN_INTR_US   usec per interrupt read, 1000
+//   FAKEUGEN_FAIL      reads fail with EIO after their delay when set
+//   FAKEUGEN_CTL_MS    msec per control request, 0
+//   FAKEUGEN_QUERY_MS  msec per device descriptor query, 0
+//   FAKEUGEN_HANG      unit whose device descriptor query hangs for 30 s
+//   FAKEUGEN_PRODUCT   product id of unit 0, the others follow, 0x5600
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <dev/usb/usb.h>
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define FAKEUGEN_FDS 4096
+
+struct fakeugen_fd
+{
+  int endp;
+  int unit;
+  int short_xfer;
+  int timeout;
+};
+
+static struct fakeugen_fd fakeugen_fds[FAKEUGEN_FDS];
+
+static int fakeugen_env(const char *name, int def)
+{
+  char *v;
+
+  v = getenv(name);
+  return v != NULL ? (int)strtol(v, NULL, 0) : def;
+}
+
+static const char *fakeugen_dir(void)
+{
+  char *v;
+
+  v = getenv("FAKEUGEN_DIR");
+  return v != NULL ? v : "/tmp/fakeugen";
+}
+
+static int fakeugen_units(void)
+{
+  char path[256];
+  FILE *f;
+  int n;
+
+  snprintf(path, sizeof(path), "%s/units", fakeugen_dir());
+  f = fopen(path, "r");
+  if (f == NULL)
+    return fakeugen_env("FAKEUGEN_UNITS", 1);
+  if (fscanf(f, "%d", &n) != 1)
+    n = 0;
+  fclose(f);
+  return n;
+}
+
+// a path under /var/db, moved to the fake's directory
+static const char *fakeugen_db(const char *path, char *buf, size_t len)
+{
+  if (strncmp(path, "/var/db/", 8))
+    return path;
+  snprintf(buf, len, "%s/%s", fakeugen_dir(), path + 8);
+  return buf;
+}
+
+static int fakeugen_eps(void)
+{
+  int n;
+
+  n = fakeugen_env("FAKEUGEN_EPS", 2);
+  return n < 2 ? 2 : n > 15 ? 15 : n;
+}
+
+// endpoint 2 is the interrupt one, the others with a descriptor are bulk
+static int fakeugen_bulk(struct fakeugen_fd *f)
+{
+  return f->endp - 1 != 2 && f->endp > 1 && f->endp - 1 <= fakeugen_eps();
+}
+
+static struct fakeugen_fd *fakeugen_get(int fd)
+{
+  if (fd < 0 || fd >= FAKEUGEN_FDS || fakeugen_fds[fd].endp == 0)
+    return NULL;
+  return &fakeugen_fds[fd];
+}
+
+// the settings the daemon gave an endpoint, for the tests that check
+// they survive a reopen
+void fakeugen_opts(int fd, int *short_xfer, int *timeout)
+{
+  struct fakeugen_fd *f;
+
+  f = fakeugen_get(fd);
+  *short_xfer = f != NULL ? f->short_xfer : -1;
+  *timeout = f != NULL ? f->timeout : -1;
+}
+
+int open(const char *path, int flags, ...)
+{
+  static int (*real_open)(const char *, int, ...);
+  char lock[256];
+  char db[256];
+  va_list ap;
+  int mode;
+  int unit;
+  int endp;
+  int fd;
+
+  if (real_open == NULL)
+    real_open = dlsym(RTLD_NEXT, "open");
+  va_start(ap, flags);
+  mode = va_arg(ap, int);
+  va_end(ap);
+  if (sscanf(path, "/dev/ugen%d.%d", &unit, &endp) != 2)
+    return real_open(fakeugen_db(path, db, sizeof(db)), flags, mode);
+
+  if (unit < 0 || unit >= fakeugen_units() || endp < 0 || endp > 15)
+  {
+    errno = ENXIO;
+    return -1;
+  }
+  mkdir(fakeugen_dir(), 0777);
+  snprintf(lock, sizeof(lock), "%s/%d.%02d", fakeugen_dir(), unit, endp);
+  fd = real_open(lock, O_RDWR | O_CREAT, 0666);
+  if (fd == -1)
+    return -1;
+  if (fd >= FAKEUGEN_FDS || flock(fd, LOCK_EX | LOCK_NB) == -1)
+  {
+    close(fd);
+    errno = EBUSY;
+    return -1;
+  }
+  bzero(&fakeugen_fds[fd], sizeof(fakeugen_fds[fd]));
+  fakeugen_fds[fd].endp = endp + 1;
+  fakeugen_fds[fd].unit = unit;
+  return fd;
+}
+
+FILE *fopen(const char *path, const char *mode)
+{
+  static FILE *(*real_fopen)(const char *, const char *);
+  char buf[256];
+
+  if (real_fopen == NULL)
+    real_fopen = dlsym(RTLD_NEXT, "fopen");
+  return real_fopen(fakeugen_db(path, buf, sizeof(buf)), mode);
+}
+
+int rename(const char *from, const char *to)
+{
+  static int (*real_rename)(const char *, const char *);
+  char fbuf[256];
+  char tbuf[256];
+
+  if (real_rename == NULL)
+    real_rename = dlsym(RTLD_NEXT, "rename");
+  return real_rename(fakeugen_db(from, fbuf, sizeof(fbuf)),
+		     fakeugen_db(to, tbuf, sizeof(tbuf)));
+}
+
+int unlink(const char *path)
+{
+  static int (*real_unlink)(const char *);
+  char buf[256];
+
+  if (real_unlink == NULL)
+    real_unlink = dlsym(RTLD_NEXT, "unlink");
+  return real_unlink(fakeugen_db(path, buf, sizeof(buf)));
+}
+
+int mkdir(const char *path, mode_t mode)
+{
+  static int (*real_mkdir)(const char *, mode_t);
+  char buf[256];
+
+  if (real_mkdir == NULL)
+    real_mkdir = dlsym(RTLD_NEXT, "mkdir");
+  return real_mkdir(fakeugen_db(path, buf, sizeof(buf)), mode);
+}
+
+int ioctl(int fd, unsigned long req, ...)
+{
+  static int (*real_ioctl)(int, unsigned long, ...);
+  struct fakeugen_fd *f;
+  va_list ap;
+  void *arg;
+  int product;
+
+  va_start(ap, req);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+  f = fakeugen_get(fd);
+  if (f == NULL)
+  {
+    if (real_ioctl == NULL)
+      real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+    return real_ioctl(fd, req, arg);
+  }
+
+  product = fakeugen_env("FAKEUGEN_PRODUCT", 0x5600) + f->unit;
+  switch (req)
+  {
+  case USB_GET_DEVICEINFO:
+    {
+      struct usb_device_info *di = arg;
+
+      bzero(di, sizeof(*di));
+      di->udi_vendorNo = 0x1234;
+      di->udi_productNo = product;
+      di->udi_class = 0xff;
+      return 0;
+    }
+  case USB_GET_DEVICE_DESC:
+    {
+      usb_device_descriptor_t *dd = arg;
+
+      if (fakeugen_env("FAKEUGEN_QUERY_MS", 0))
+	usleep(fakeugen_env("FAKEUGEN_QUERY_MS", 0) * 1000);
+      if (fakeugen_env("FAKEUGEN_HANG", -1) == f->unit)
+	sleep(30);
+      bzero(dd, sizeof(*dd));
+      dd->bLength = USB_DEVICE_DESCRIPTOR_SIZE;
+      dd->bDescriptorType = UDESC_DEVICE;
+      USETW(dd->idVendor, 0x1234);
+      USETW(dd->idProduct, product);
+      USETW(dd->bcdDevice, 0x0100);
+      dd->bDeviceClass = 0xff;
+      dd->bNumConfigurations = 1;
+      return 0;
+    }
+  case USB_GET_CONFIG:
+    *(int *)arg = 1;
+    return 0;
+  case USB_GET_CONFIG_DESC:
+    {
+      struct usb_config_desc *cd = arg;
+
+      bzero(&cd->ucd_desc, sizeof(cd->ucd_desc));
+      cd->ucd_desc.bNumInterface = 1;
+      return 0;
+    }
+  case USB_GET_INTERFACE_DESC:
+    {
+      struct usb_interface_desc *id = arg;
+
+      bzero(&id->uid_desc, sizeof(id->uid_desc));
+      id->uid_desc.bNumEndpoints = fakeugen_eps();
+      id->uid_desc.bInterfaceClass = 0xff;
+      return 0;
+    }
+  case USB_GET_ENDPOINT_DESC:
+    {
+      struct usb_endpoint_desc *ed = arg;
+
+      bzero(&ed->ued_desc, sizeof(ed->ued_desc));
+      ed->ued_desc.bEndpointAddress = UE_DIR_IN | (ed->ued_endpoint_index + 1);
+      ed->ued_desc.bmAttributes = ed->ued_endpoint_index == 1 ?
+	UE_INTERRUPT : UE_BULK;
+      USETW(ed->ued_desc.wMaxPacketSize,
+	    ed->ued_endpoint_index == 1 ? 8 : 512);
+      return 0;
+    }
+  case USB_SET_SHORT_XFER:
+    f->short_xfer = *(int *)arg;
+    return 0;
+  case USB_SET_TIMEOUT:
+    f->timeout = *(int *)arg;
+    return 0;
+  case USB_SET_CONFIG:
+    return 0;
+  case USB_DO_REQUEST:
+    {
+      struct usb_ctl_request *cr = arg;
+
+      if (fakeugen_env("FAKEUGEN_CTL_MS", 0))
+	usleep(fakeugen_env("FAKEUGEN_CTL_MS", 0) * 1000);
+      cr->ucr_actlen = 0;
+      return 0;
+    }
+  }
+  errno = EINVAL;
+  return -1;
+}
+
+ssize_t read(int fd, void *buf, size_t len)
+{
+  static ssize_t (*real_read)(int, void *, size_t);
+  struct fakeugen_fd *f;
+
+  f = fakeugen_get(fd);
+  if (f != NULL && fakeugen_bulk(f))
+  {
+    usleep(fakeugen_env("FAKEUGEN_BULK_US", 500));
+    if (fakeugen_env("FAKEUGEN_FAIL", 0))
+      goto fail;
+    memset(buf, 0x55, len);
+    return len;
+  }
+  if (f != NULL && f->endp == 3)
+  {
+    usleep(fakeugen_env("FAKEUGEN_INTR_US", 1000));
+    if (fakeugen_env("FAKEUGEN_FAIL", 0))
+      goto fail;
+    if (len > 8)
+      len = 8;
+    memset(buf, 0xaa, len);
+    return len;
+  }
+  if (f != NULL)
+  {
+fail:
+    errno = EIO;
+    return -1;
+  }
+  if (real_read == NULL)
+    real_read = dlsym(RTLD_NEXT, "read");
+  return real_read(fd, buf, len);
+}
+
+int close(int fd)
+{
+  static int (*real_close)(int);
+
+  if (real_close == NULL)
+    real_close = dlsym(RTLD_NEXT, "close");
+  if (fd >= 0 && fd < FAKEUGEN_FDS)
+    bzero(&fakeugen_fds[fd], sizeof(fakeugen_fds[fd]));
+  return real_close(fd);
+}
@@ -0,0 +1,71 @@
+# -F bounds the endpoints open in all the sessions. 64 sessions import a
+# fake device of 16 endpoints each, 1024 in all: a session over the
+# limit with nothing to close asks the sessions holding the most to
+# close some at their next URB. Reads on random endpoints of random
+# sessions then reopen what was closed, the total goes over the limit by
+# the requests not honored yet, and is back under it once every session
+# ran an URB.
+
+import random
+import re
+
+from usbip import *
+
+UNITS = 64
+LIMIT = 512
+
+
+def open_endpoints(d):
+    # the last SIGUSR1 dump
+    os.kill(d.proc.pid, signal.SIGUSR1)
+    time.sleep(0.3)
+    found = re.findall(r'fdcache: (\d+) endpoints open, limit (\d+)',
+                       d.output())
+    check(found, 'no fdcache dump:\n' + d.output())
+    return int(found[-1][0])
+
+
+with Daemon('-F', LIMIT, units=UNITS,
+            env={'FAKEUGEN_EPS': '15', 'FAKEUGEN_BULK_US': '100'}) as d:
+    cs = []
+    for u in range(UNITS):
+        c = Client(d.port)
+        check(c.import_('usb%d' % u), 'import of usb%d refused' % u)
+        cs.append(c)
+    time.sleep(0.3)
+    before = open_endpoints(d)
+    check(before > LIMIT, 'only %d endpoints open after the imports' %
+          before)
+
+    # the sessions asked to close endpoints do it at their next urb
+    for c in cs:
+        c.submit(1, 512)
+    for c in cs:
+        check(c.ret()[2] == 0, 'bulk read failed')
+    after = open_endpoints(d)
+    check(after <= LIMIT, '%d endpoints open, limit %d' % (after, LIMIT))
+
+    rnd = random.Random(1)
+    for i in range(2000):
+        c = rnd.choice(cs)
+        ep = rnd.choice([1] + list(range(3, 16)))
+        c.submit(ep, 512)
+        check(c.ret()[2] == 0, 'read of a reopened endpoint failed')
+    busy = open_endpoints(d)
+    for c in cs:
+        c.submit(1, 512)
+    for c in cs:
+        check(c.ret()[2] == 0, 'bulk read failed')
+    n = open_endpoints(d)
+    check(n <= LIMIT, '%d endpoints open, limit %d' % (n, LIMIT))
+    print('fdcache: %d endpoints open after the imports, %d after a urb '
+          'each, %d after 2000 random reads, %d after a urb each' %
+          (before, after, busy, n))
+
+    for c in cs:
+        c.close()
+    time.sleep(1)
+    n = open_endpoints(d)
+    check(n == 0, '%d endpoints still counted with no session' % n)
+
+print('fdcache ok')
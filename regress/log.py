@@ -0,0 +1,81 @@
+# A device that fails every read logs at full rate. Each message site is
+# limited to a burst a second and the rest is summed up, -L drops the
+# lower severities, and a session goes on at full speed while the
+# daemon's output is blocked.
+
+import re
+
+from usbip import *
+
+URBS = 2000
+
+
+def run(port):
+    c = Client(port)
+    check(c.import_('usb0'), 'import refused')
+    t = time.time()
+    for i in range(URBS):
+        c.submit(1, 512)
+    status = [c.ret()[2] for i in range(URBS)]
+    t = time.time() - t
+    c.close()
+    return t, status
+
+
+FAIL = {'FAKEUGEN_FAIL': '1'}
+SITE = 'cannot read from endpoint 1'
+
+with Daemon(env=FAIL) as d:
+    t, status = run(d.port)
+    check(all(s != 0 for s in status), 'failed reads answered as good')
+    time.sleep(1.5)
+    out = d.output()
+    lines = out.count(SITE)
+    more = sum(int(n) for n in re.findall(
+        r'log: (\d+) more messages like "%s: cannot read from endpoint',
+        out))
+    check(lines <= 10 * (t + 2), '%d lines in %.1f s:\n%s' %
+          (lines, t, out))
+    check(lines + more == URBS, '%d lines and %d suppressed for %d errors' %
+          (lines, more, URBS))
+
+with Daemon('-L', 'err', env=FAIL) as d:
+    run(d.port)
+    time.sleep(1.5)
+    out = d.output()
+    check(SITE in out, 'errors not logged with -L err:\n' + out)
+    check('first urb done' not in out, 'info logged with -L err:\n' + out)
+
+# the same session against a healthy device, and against a failing one
+# with the daemon's output pipe full and never read
+with Daemon() as d:
+    good, status = run(d.port)
+    check(all(s == 0 for s in status), 'good reads failed')
+
+port = free_port()
+e = dict(os.environ)
+e['LD_PRELOAD'] = os.path.abspath(FAKEUGEN)
+e['FAKEUGEN_DIR'] = tempfile.mkdtemp(prefix='openusbipd.')
+e.update(FAIL)
+p = subprocess.Popen([OPENUSBIPD, '-l', '127.0.0.1', '-p', str(port)],
+                     env=e, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                     start_new_session=True)
+try:
+    check(wait_port(port), 'daemon did not start')
+    w = os.open('/proc/%d/fd/1' % p.pid, os.O_WRONLY | os.O_NONBLOCK)
+    try:
+        while True:
+            os.write(w, bytes(4096))
+    except BlockingIOError:
+        pass
+    os.close(w)
+    bad, status = run(port)
+finally:
+    os.killpg(p.pid, signal.SIGKILL)
+    p.wait()
+    shutil.rmtree(e['FAKEUGEN_DIR'], ignore_errors=True)
+
+print('log: %d urbs in %.2f s healthy, %.2f s failing with output '
+      'blocked' % (URBS, good, bad))
+check(bad < good * 1.25, 'logging slowed the session down')
+print('log ok')
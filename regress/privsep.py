@@ -0,0 +1,84 @@
+# Sessions under -P: the network process keeps no writable shared memory
+# but its ring and its log ring, the budget it used is given back, and
+# a benchmark of the same pipelined session with and without -P.
+
+import pwd
+
+from usbip import *
+
+SECS = 3
+
+try:
+    user = pwd.getpwnam('_openusbipd')
+except KeyError:
+    user = None
+if os.getuid() != 0 or user is None:
+    print('privsep skipped: needs root and the _openusbipd user')
+    sys.exit(0)
+
+
+def network_process(d):
+    # the unprivileged process of the session, found through /proc
+    for pid in os.listdir('/proc'):
+        if not pid.isdigit() or int(pid) == d.proc.pid:
+            continue
+        try:
+            with open('/proc/%s/stat' % pid) as f:
+                sid = int(f.read().rsplit(')', 1)[1].split()[3])
+            if sid == d.proc.pid and os.stat('/proc/' + pid).st_uid == \
+               user.pw_uid:
+                return int(pid)
+        except (OSError, IndexError, ValueError):
+            pass
+    return None
+
+
+def bench(d, secs):
+    # 8 bulk reads of 16 KB in flight, and one interrupt read polled
+    c = Client(d.port)
+    check(c.import_('usb0'), 'import refused:\n' + d.output())
+    sent = {}
+    for i in range(8):
+        sent[c.submit(1, 16384)] = time.time()
+    sent[c.submit(2, 8)] = time.time()
+    lat = []
+    bulk = 0
+    t0 = time.time()
+    while time.time() - t0 < secs:
+        cmd, seq, status, data = c.ret()
+        check(status == 0, 'urb failed')
+        if len(data) == 8:
+            lat.append((time.time() - sent.pop(seq)) * 1000)
+            sent[c.submit(2, 8)] = time.time()
+        else:
+            bulk += len(data)
+            sent.pop(seq)
+            sent[c.submit(1, 16384)] = time.time()
+    return c, bulk / secs / 1e6, percentile(lat, .5), percentile(lat, .99)
+
+
+env = {'FAKEUGEN_BULK_US': '0', 'FAKEUGEN_INTR_US': '0'}
+with Daemon('-P', '-A', '-s', 'global=1000000', env=env) as d:
+    c, mbs, p50, p99 = bench(d, 1)
+    pid = network_process(d)
+    check(pid is not None, 'no network process:\n' + d.output())
+    if os.path.exists('/proc/%d/maps' % pid):
+        with open('/proc/%d/maps' % pid) as f:
+            shared = [l for l in f if l.split()[1] == 'rw-s']
+        check(len(shared) == 2, 'network process keeps %d writable shared '
+              'mappings:\n%s' % (len(shared), ''.join(shared)))
+    c.close()
+    time.sleep(0.5)
+    os.kill(d.proc.pid, signal.SIGUSR1)
+    time.sleep(0.5)
+    check('budget: 0 KB in flight' in d.output(),
+          'budget not given back:\n' + d.output())
+
+for args in ((), ('-P',)):
+    with Daemon(*args, env=env) as d:
+        c, mbs, p50, p99 = bench(d, SECS)
+        c.close()
+        print('%-8s bulk %6.1f MB/s, interrupt p50 %.2f ms p99 %.2f ms' %
+              (' '.join(args) or 'direct', mbs, p50, p99))
+
+print('privsep ok')
@@ -0,0 +1,77 @@
+# -t probes the fake device without network: a control loop and its
+# bulk and interrupt IN endpoints, paced by the device. With -R it probes
+# the simulated device of a capture instead, paced as recorded or not at
+# all with -f.
+
+import glob
+import os
+import re
+import subprocess
+import tempfile
+
+from usbip import *
+
+GET_DEVICE = bytes([0x80, 6, 0, 1, 0, 0, 18, 0])
+
+
+def probe(*args, env=None):
+    out = subprocess.run([OPENUSBIPD] + [str(a) for a in args],
+                         stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                         universal_newlines=True, env=env,
+                         timeout=30).stdout
+    res = {}
+    for name, urbs, rate, errors in re.findall(
+            r'probe: (.*): (\d+) urbs, [\d.]+ MB/s, (\d+) urb/s, '
+            r'(\d+) errors', out):
+        check(errors == '0', 'probe errors:\n' + out)
+        res[name] = int(rate)
+    for name in res:
+        check('probe: %s: latency usec' % name in out,
+              'no latency for %s:\n%s' % (name, out))
+    return res, out
+
+
+tmp = tempfile.mkdtemp(prefix='probe.')
+env = dict(os.environ)
+env['LD_PRELOAD'] = os.path.abspath(FAKEUGEN)
+env['FAKEUGEN_DIR'] = tmp
+env['FAKEUGEN_UNITS'] = '1'
+
+res, out = probe('-t', 0, env=env)
+check(set(res) == {'control', 'bulk in 1', 'interrupt in 2'},
+      'wrong endpoints probed:\n' + out)
+# the fake bulk endpoint answers in 500 usec, the interrupt one in 1 ms
+check(1000 <= res['bulk in 1'] <= 2000, 'bulk not paced:\n' + out)
+check(500 <= res['interrupt in 2'] <= 1000, 'interrupt not paced:\n' + out)
+
+# a slower device shows in the probe
+env['FAKEUGEN_BULK_US'] = '2000'
+slow, out = probe('-t', 0, env=env)
+check(slow['bulk in 1'] <= 500, 'slow bulk endpoint not seen:\n' + out)
+
+# the simulated device of a capture
+cap = os.path.join(tmp, 'capture')
+with Daemon('-r', cap) as d:
+    c = Client(d.port)
+    check(c.import_('usb0'), 'import refused')
+    c.submit(0, 18, setup=GET_DEVICE)
+    for i in range(20):
+        c.submit(1, 512)
+        c.submit(2, 8)
+    for i in range(41):
+        check(c.ret()[2] == 0, 'urb failed')
+    c.close()
+    time.sleep(0.2)
+files = glob.glob(cap + '.*')
+check(len(files) == 1, 'expected one capture, got %s' % files)
+
+res, out = probe('-R', files[0], '-t', 0)
+check(set(res) == {'control 8006', 'endpoint 1 in', 'endpoint 2 in'},
+      'wrong capture endpoints probed:\n' + out)
+check(res['endpoint 1 in'] <= 2000, 'capture not paced:\n' + out)
+fast, out = probe('-R', files[0], '-f', '-t', 0)
+check(fast['endpoint 1 in'] > 10 * res['endpoint 1 in'],
+      '-f did not speed up the capture:\n' + out)
+
+shutil.rmtree(tmp, ignore_errors=True)
+print('probe ok')
@@ -0,0 +1,105 @@
+# With -A the simulated device of a capture learns a profile like the
+# real one, /var/db is moved to the fake's directory. A bulk stream
+# learns nodelay=0, but its replay waits for each answer: the next
+# session sees the gaps grow and learns 2, for good. The buffers, bounded
+# by -w 256, converge on 256 KB from a larger learned value by a quarter
+# of the gap a session. Sessions ending together all count: each one
+# averages its buffers with what the others saved before it.
+
+import glob
+
+from usbip import *
+
+URBS = 200
+SEED = 1280
+WIN = 256
+
+
+def replay(port, cap, fast=True):
+    args = [OPENUSBIPD, '-R', cap, '-C', '127.0.0.1', '-p', str(port)]
+    if fast:
+        args.append('-f')
+    return subprocess.Popen(args, stdout=subprocess.PIPE,
+                            stderr=subprocess.STDOUT,
+                            universal_newlines=True)
+
+
+def replayed(p):
+    out = p.communicate(timeout=30)[0]
+    check(p.returncode == 0 and '0 status mismatches' in out,
+          'replay failed:\n' + out)
+
+
+def learned(path):
+    # the settings line of the profile
+    with open(path) as f:
+        lines = [l.split() for l in f if not l.startswith('#')]
+    check(len(lines) == 1, 'bad profile %s' % lines)
+    return dict(kv.split('=') for kv in lines[0][1:])
+
+
+def seed(path, nodelay):
+    with open(path, 'w') as f:
+        f.write('%s buffer=%d nodelay=%s\n' % (os.path.basename(path), SEED,
+                                               nodelay))
+
+
+def step(b):
+    return (3 * b + WIN + 2) // 4
+
+
+tmp = tempfile.mkdtemp(prefix='profile.')
+with Daemon('-r', os.path.join(tmp, 'capture')) as d:
+    c = Client(d.port)
+    check(c.import_('usb0'), 'import refused')
+    for i in range(URBS):
+        c.submit(1, 16384)
+    for i in range(URBS):
+        check(c.ret()[2] == 0, 'urb failed')
+    c.close()
+    time.sleep(0.2)
+caps = glob.glob(os.path.join(tmp, 'capture.*'))
+check(len(caps) == 1, 'expected one capture, got %s' % caps)
+cap = caps[0]
+
+with Daemon('-R', cap, '-A', '-w', WIN, '-f') as d:
+    replayed(replay(d.port, cap))
+    time.sleep(0.2)
+    files = glob.glob(os.path.join(d.dir, 'openusbipd', '*'))
+    check(len(files) == 1, 'expected one profile, got %s' % files)
+    path = files[0]
+    check(learned(path).get('nodelay') == '0',
+          'bulk stream did not learn nodelay=0: %s' % learned(path))
+    replayed(replay(d.port, cap))
+    time.sleep(0.2)
+    check(learned(path).get('nodelay') == '2',
+          'coalescing kept for a waiting client: %s' % learned(path))
+
+    # one session after the other converges on -w
+    seed(path, 2)
+    want, seen = SEED, []
+    for i in range(8):
+        replayed(replay(d.port, cap))
+        time.sleep(0.1)
+        p = learned(path)
+        want = step(want)
+        seen.append(int(p['buffer']))
+        check(seen[-1] == want, 'buffers %s, expected %d' % (seen, want))
+        check(p.get('nodelay') == '2', 'coalescing learned again: %s' % p)
+    print('profile: buffers %d KB, then %s' % (SEED, seen))
+
+    # sessions at once, paced so that they overlap
+    seed(path, 2)
+    ps = [replay(d.port, cap, fast=False) for i in range(4)]
+    for p in ps:
+        replayed(p)
+    time.sleep(0.2)
+    want = SEED
+    for i in range(4):
+        want = step(want)
+    b = int(learned(path)['buffer'])
+    check(b == want, '4 sessions at once learned %d KB, expected %d' %
+          (b, want))
+
+shutil.rmtree(tmp, ignore_errors=True)
+print('profile ok')
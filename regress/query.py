@@ -0,0 +1,58 @@
+# With -W the devices found are kept in a registry, /var/db is moved to
+# the fake's directory. A device held by a session cannot be opened by
+# the scans and stays in the registry, the lists are by unit whatever
+# order the workers answer in, and only a unit whose open finds no
+# device is forgotten. The registry is only written when what it holds
+# changed: scans finding the same devices leave the file alone.
+
+from usbip import *
+
+# the entries are struct query_dev up to its interfaces, the number of
+# interfaces is the last byte
+ENTRY = 470
+SIZE = 1496
+
+
+def registry(d):
+    # the units kept in the registry
+    with open(os.path.join(d.dir, 'openusbipd.devices'), 'rb') as f:
+        data = f.read()
+    check(data[:4] == b'OUQC', 'bad registry')
+    size, n = struct.unpack('<II', data[4:12])
+    check(size == SIZE, 'registry entries of %d bytes' % size)
+    units, off = [], 12
+    for i in range(n):
+        units.append(struct.unpack('<i', data[off:off + 4])[0])
+        off += ENTRY + data[off + ENTRY - 1] * 4
+    return sorted(units)
+
+
+with Daemon('-W', units=20) as d:
+    time.sleep(0.5)
+    check(registry(d) == list(range(20)), 'first scan not kept: %s' %
+          registry(d))
+    buses = [dev[0] for dev in devlist(d.port)]
+    check(buses == ['usb%d' % i for i in range(20)],
+          'list not by unit: %s' % buses)
+    path = os.path.join(d.dir, 'openusbipd.devices')
+    ino = os.stat(path).st_ino
+    for i in range(3):
+        devlist(d.port)
+    check(os.stat(path).st_ino == ino, 'registry written with no change')
+
+    c = Client(d.port)
+    check(c.import_('usb1'), 'import refused')
+    for i in range(3):
+        check(len(devlist(d.port)) == 19, 'busy device listed')
+    check(registry(d) == list(range(20)),
+          'busy device forgotten: %s' % registry(d))
+
+    # unplugged units are forgotten, the busy one is still kept
+    d.units(3)
+    check(len(devlist(d.port)) == 2, 'unplugged devices listed')
+    check(registry(d) == [0, 1, 2],
+          'unplugged devices kept: %s' % registry(d))
+    check(os.stat(path).st_ino != ino, 'registry not written')
+    c.close()
+
+print('query ok')
@@ -0,0 +1,41 @@
+# With -g, a client that comes back within the grace period is handed
+# the lingering session, which still holds the exclusive endpoints. Once
+# the grace period is over the device is free again.
+
+import re
+
+from usbip import *
+
+
+def session(port):
+    c = Client(port)
+    if not c.import_('usb0'):
+        return False
+    c.submit(1, 512)
+    check(c.ret()[2] == 0, 'bulk read failed')
+    c.close()
+    return True
+
+
+with Daemon() as d:
+    c = Client(d.port)
+    check(c.import_('usb0'), 'import refused')
+    check(not Client(d.port).import_('usb0'), 'imported twice')
+    c.close()
+
+with Daemon('-g', 2) as d:
+    check(session(d.port), 'first import refused')
+    for i in range(3):
+        time.sleep(0.2)
+        check(session(d.port), 'reattach %d refused:\n%s' % (i, d.output()))
+    time.sleep(0.5)
+    firsts = [int(x) for x in re.findall(r'first urb done (\d+) usec',
+                                         d.output())]
+    check(len(firsts) == 4, 'first urb not logged:\n' + d.output())
+
+    # the lingering session gives the device back after the grace period
+    time.sleep(3)
+    check(session(d.port), 'import after the grace period refused:\n' +
+          d.output())
+
+print('reattach ok')
@@ -0,0 +1,72 @@
+# A relay over two daemons, an upstream that never answers and one whose
+# device list has a busid too long to be renamed: the list is refreshed
+# in parallel within the timeout, and only the bad device is dropped.
+
+import threading
+
+from usbip import *
+
+
+def serve_devlist(ls):
+    # answer device list requests with a device whose busid fills the
+    # field and a well formed one
+    while True:
+        s, _ = ls.accept()
+        while True:
+            try:
+                if len(s.recv(8)) != 8:
+                    break
+            except OSError:
+                break
+            answer = struct.pack('>HHII', USBIP_VERSION, 5, 0, 2)
+            for bus in (b'x' * 31, b'usb1'):
+                answer += (b'/fake'.ljust(256, b'\0') + bus.ljust(32, b'\0') +
+                           struct.pack('>IIIHHHBBBBBB', 1, 2, 3, 0x1234,
+                                       0x9999, 0x100, 0, 0, 0, 1, 1, 1) +
+                           bytes(4))
+            s.sendall(answer)
+        s.close()
+
+
+hung = socket.socket()
+hung.bind(('127.0.0.1', 0))
+hung.listen(8)
+bad = socket.socket()
+bad.bind(('127.0.0.1', 0))
+bad.listen(8)
+threading.Thread(target=serve_devlist, args=(bad,), daemon=True).start()
+
+with Daemon(units=2) as up0, Daemon(units=1) as up1:
+    ups = ['127.0.0.1:%d' % up0.port, '127.0.0.1:%d' % hung.getsockname()[1],
+           '127.0.0.1:%d' % up1.port, '127.0.0.1:%d' % bad.getsockname()[1]]
+    args = ['-i', '1']
+    for u in ups:
+        args += ['-u', u]
+    with Daemon(*args) as relay:
+        # the first round waits for the hung upstream
+        time.sleep(6)
+        t = time.time()
+        buses = sorted(d[0] for d in devlist(relay.port))
+        check(time.time() - t < 1, 'device list request blocked')
+        check(buses == ['0-usb0', '0-usb1', '2-usb0', '3-usb1'],
+              'relayed devices: %s\n%s' % (buses, relay.output()))
+        check('busid %s of' % ('x' * 31) in relay.output(),
+              'long busid not logged:\n' + relay.output())
+        check('no answer in time from 127.0.0.1:%d' % hung.getsockname()[1]
+              in relay.output(), 'hung upstream not logged')
+
+        c = Client(relay.port)
+        check(c.import_('2-usb0'), 'import through the relay refused')
+        c.submit(1, 512)
+        check(c.ret()[2] == 0, 'bulk read through the relay failed')
+        c.close()
+
+        # a stopped upstream drops its devices only
+        up1.stop()
+        # a round lasts the timeout of the hung upstream, up to two of them
+        time.sleep(13)
+        buses = sorted(d[0] for d in devlist(relay.port))
+        check(buses == ['0-usb0', '0-usb1', '3-usb1'],
+              "relayed devices after a stop: %s\n%s" % (buses, relay.output()))
+
+print('relay ok')
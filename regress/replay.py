@@ -0,0 +1,53 @@
+# Record a session over the fake device, serve the capture with -R and
+# replay its client side with -C against it. A capture that cannot be
+# created is logged and the session goes on without it.
+
+import glob
+import os
+import subprocess
+import tempfile
+
+from usbip import *
+
+GET_DEVICE = bytes([0x80, 6, 0, 1, 0, 0, 18, 0])
+
+tmp = tempfile.mkdtemp(prefix='replay.')
+cap = os.path.join(tmp, 'capture')
+
+with Daemon('-r', cap) as d:
+    c = Client(d.port)
+    check(c.import_('usb0'), 'import refused')
+    c.submit(0, 18, setup=GET_DEVICE)
+    check(c.ret()[2] == 0, 'control request failed')
+    for i in range(20):
+        c.submit(1, 512)
+        c.submit(2, 8)
+    for i in range(40):
+        check(c.ret()[2] == 0, 'urb failed')
+    c.close()
+    time.sleep(0.2)
+
+files = glob.glob(cap + '.*')
+check(len(files) == 1, 'expected one capture, got %s' % files)
+
+with Daemon('-R', files[0], '-f') as d:
+    out = subprocess.run([OPENUSBIPD, '-R', files[0], '-C', '127.0.0.1',
+                          '-p', str(d.port)], stdout=subprocess.PIPE,
+                         stderr=subprocess.STDOUT, universal_newlines=True,
+                         timeout=30).stdout
+    check('replay: 41 urbs' in out, 'replay did not run:\n' + out)
+    check('replay: 0 status mismatches' in out,
+          'replay mismatches:\n' + out)
+
+with Daemon('-r', os.path.join(tmp, 'nonexistent', 'capture')) as d:
+    c = Client(d.port)
+    check(c.import_('usb0'), 'import refused without a capture')
+    c.submit(1, 512)
+    check(c.ret()[2] == 0, 'bulk read failed without a capture')
+    c.close()
+    time.sleep(0.2)
+    check('record: %s/nonexistent/capture.' % tmp in d.output(),
+          'capture error not logged:\n' + d.output())
+
+shutil.rmtree(tmp)
+print('replay ok')
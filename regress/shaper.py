@@ -0,0 +1,67 @@
+# Bulk reads under -s global: one session gets the whole rate, two
+# sessions share it, and a session killed without saying goodbye does not
+# keep its share.
+
+import threading
+
+from usbip import *
+
+RATE = 4096
+SECS = 3
+
+
+def reader(port, bus, secs, out):
+    c = Client(port)
+    check(c.import_(bus), 'import of %s refused' % bus)
+    for i in range(8):
+        c.submit(1, 16384)
+    total = 0
+    t0 = time.time()
+    while time.time() - t0 < secs:
+        cmd, seq, status, data = c.ret()
+        total += len(data)
+        c.submit(1, 16384)
+    out.append(total / 1024 / (time.time() - t0))
+    c.close()
+
+
+def readers(port, buses, secs):
+    out = []
+    threads = [threading.Thread(target=reader, args=(port, b, secs, out))
+               for b in buses]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return out
+
+
+def near(v, want):
+    return want * 0.75 < v < want * 1.35
+
+
+env = {'FAKEUGEN_BULK_US': '0'}
+with Daemon('-s', 'global=%d' % RATE, units=2, env=env) as d:
+    rate, = readers(d.port, ['usb0'], SECS)
+    print('one session  %5d KB/s' % rate)
+    check(near(rate, RATE), 'one session at %d KB/s' % rate)
+
+    rates = readers(d.port, ['usb0', 'usb1'], SECS)
+    print('two sessions %5d + %d KB/s' % tuple(rates))
+    check(near(sum(rates), RATE) and near(rates[0], RATE / 2) and
+          near(rates[1], RATE / 2), 'two sessions at %s KB/s' % rates)
+
+    if os.path.exists('/proc/self/stat'):
+        before = set(d.children())
+        c = Client(d.port)
+        check(c.import_('usb1'), 'import of usb1 refused')
+        c.submit(1, 16384)
+        c.ret()
+        for pid in set(d.children()) - before:
+            os.kill(pid, signal.SIGKILL)
+        c.close()
+        rate, = readers(d.port, ['usb0'], SECS)
+        print('after a kill %5d KB/s' % rate)
+        check(near(rate, RATE), 'one session at %d KB/s after a kill' % rate)
+
+print('shaper ok')
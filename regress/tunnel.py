@@ -0,0 +1,89 @@
+# A tunnel serves each endpoint by a worker of its own: interrupt URBs
+# are not held back by a slow bulk endpoint, each endpoint answers in
+# order, and an unlinked URB gets a grace period to complete. A new
+# configuration stops the workers and fails their pending URBs. Loss
+# recovery is left to TCP and not tested here.
+
+from usbip import *
+
+SET_CONFIG = bytes([0, 9, 1, 0, 0, 0, 0, 0])
+ECONNRESET = 104
+ESHUTDOWN = 108
+
+
+def descendants(pid):
+    # the processes under pid, through /proc
+    kids = {}
+    for p in os.listdir('/proc'):
+        if not p.isdigit():
+            continue
+        try:
+            with open('/proc/%s/stat' % p) as f:
+                ppid = int(f.read().rsplit(')', 1)[1].split()[1])
+        except (OSError, IndexError, ValueError):
+            continue
+        kids.setdefault(ppid, []).append(int(p))
+    todo, found = [pid], []
+    while todo:
+        for k in kids.get(todo.pop(), []):
+            found.append(k)
+            todo.append(k)
+    return found
+
+
+with Daemon(env={'FAKEUGEN_BULK_US': '50000'}) as d:
+    c = Client(d.port)
+    check(c.import_('usb0', OP_REQ_TUNNEL), 'tunnel refused')
+    bulk = [c.submit(1, 512) for i in range(3)]
+    intr = [c.submit(2, 8) for i in range(5)]
+    time.sleep(0.01)
+    # the first bulk URB completes within the grace period, the last one
+    # is still queued behind the others when it expires
+    first = c.unlink(bulk[0])
+    last = c.unlink(bulk[2])
+    unknown = c.unlink(77)
+
+    rets = [c.ret() for i in range(10)]
+    order = [r[1] for r in rets]
+    status = dict((r[1], r[2]) for r in rets)
+    submits = [r[1] for r in rets if r[0] == RET_SUBMIT]
+    check([s for s in submits if s in intr] == intr,
+          'interrupt answers out of order: %s' % order)
+    check([s for s in submits if s in bulk] == bulk[:2],
+          'bulk answers out of order: %s' % order)
+    check(order.index(intr[-1]) < order.index(bulk[0]),
+          'interrupt held back by bulk: %s' % order)
+    check(status[unknown] == 0 and
+          order.index(unknown) < order.index(bulk[0]),
+          'unlink of an unknown urb not answered at once: %s' % order)
+    check(order.index(bulk[0]) < order.index(first) and
+          status[first] == 0, 'completed unlinked urb: %s' % order)
+    check(status[last] == -ECONNRESET,
+          'expired unlink answered %d' % status[last])
+    c.s.settimeout(0.3)
+    try:
+        r = c.ret()
+        fail('answer after an expired unlink: %s' % (r[:3],))
+    except socket.timeout:
+        c.s.settimeout(5)
+
+    # a new configuration stops the workers and fails their urbs
+    workers = len(descendants(d.proc.pid))
+    pending = c.submit(1, 512)
+    time.sleep(0.01)
+    t = time.time()
+    conf = c.submit(0, 0, dirin=0, setup=SET_CONFIG)
+    r = c.ret()
+    check(r[1] == pending and r[2] == -ESHUTDOWN,
+          'pending urb answered %s' % (r[:3],))
+    r = c.ret()
+    check(r[1] == conf and r[2] == 0, 'set configuration failed')
+    check(time.time() - t < 1, 'workers stopped in %.2f s' %
+          (time.time() - t))
+    check(len(descendants(d.proc.pid)) == workers - 2,
+          'workers left after a new configuration')
+    c.submit(2, 8)
+    check(c.ret()[2] == 0, 'no worker after a new configuration')
+    c.close()
+
+print('tunnel ok')
@@ -0,0 +1,204 @@
+# Helpers for the regression tests: run the daemon over the fake ugen(4)
+# and talk USB/IP to it.
+
+import os
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+OPENUSBIPD = os.environ.get('OPENUSBIPD', '../openusbipd')
+FAKEUGEN = os.environ.get('FAKEUGEN', './fakeugen.so')
+
+USBIP_VERSION = 0x0111
+OP_REQ_DEVLIST = 0x8005
+OP_REQ_IMPORT = 0x8003
+OP_REQ_TUNNEL = 0x80f3
+CMD_SUBMIT = 1
+CMD_UNLINK = 2
+RET_SUBMIT = 3
+RET_UNLINK = 4
+
+
+def fail(msg):
+    print('FAIL: ' + msg)
+    sys.exit(1)
+
+
+def check(cond, msg):
+    if not cond:
+        fail(msg)
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def wait_port(port, secs=5):
+    end = time.time() + secs
+    while time.time() < end:
+        try:
+            socket.create_connection(('127.0.0.1', port), 0.2).close()
+            return True
+        except OSError:
+            time.sleep(0.05)
+    return False
+
+
+class Daemon:
+    """openusbipd on a free port of 127.0.0.1 with the fake ugen(4)
+    preloaded, its output in self.log and its fake units in self.dir"""
+
+    def __init__(self, *args, env=None, units=1, fake=None, wait=True):
+        self.dir = tempfile.mkdtemp(prefix='openusbipd.')
+        self.port = free_port()
+        self.log = os.path.join(self.dir, 'log')
+        e = dict(os.environ)
+        e['LD_PRELOAD'] = os.path.abspath(fake or FAKEUGEN)
+        e['FAKEUGEN_DIR'] = self.dir
+        e['FAKEUGEN_UNITS'] = str(units)
+        e.update(env or {})
+        cmd = [OPENUSBIPD, '-l', '127.0.0.1', '-p', str(self.port)]
+        cmd += [str(a) for a in args]
+        self.out = open(self.log, 'w')
+        self.proc = subprocess.Popen(cmd, env=e, stdout=self.out,
+                                     stderr=subprocess.STDOUT,
+                                     start_new_session=True)
+        if wait and not wait_port(self.port):
+            self.stop()
+            fail('%s did not start:\n%s' % (' '.join(cmd), self.output()))
+
+    def units(self, n):
+        # unplug or plug fake units while the daemon runs
+        with open(os.path.join(self.dir, 'units'), 'w') as f:
+            f.write('%d\n' % n)
+
+    def children(self):
+        # the processes forked by the daemon, through /proc
+        pids = []
+        for pid in os.listdir('/proc'):
+            try:
+                with open('/proc/%s/stat' % pid) as f:
+                    ppid = int(f.read().rsplit(')', 1)[1].split()[1])
+            except (OSError, IndexError, ValueError):
+                continue
+            if ppid == self.proc.pid:
+                pids.append(int(pid))
+        return pids
+
+    def output(self):
+        self.out.flush()
+        with open(self.log) as f:
+            return f.read()
+
+    def stop(self):
+        if self.proc.poll() is None:
+            try:
+                os.killpg(self.proc.pid, signal.SIGTERM)
+            except ProcessLookupError:
+                pass
+            try:
+                self.proc.wait(5)
+            except subprocess.TimeoutExpired:
+                os.killpg(self.proc.pid, signal.SIGKILL)
+                self.proc.wait()
+        self.out.close()
+
+    def clean(self):
+        self.stop()
+        shutil.rmtree(self.dir, ignore_errors=True)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.clean()
+
+
+def devlist(port, host='127.0.0.1'):
+    """the bus ids a daemon exports, with each device's vendor, product
+    and bcdDevice"""
+    c = Client(port, host)
+    c.send(struct.pack('>HHI', USBIP_VERSION, OP_REQ_DEVLIST, 0))
+    c.recv(8)
+    n, = struct.unpack('>I', c.recv(4))
+    devs = []
+    for i in range(n):
+        d = c.recv(312)
+        bus = d[256:288].rstrip(b'\0').decode()
+        devs.append((bus,) + struct.unpack('>HHH', d[300:306]))
+        c.recv(d[311] * 4)
+    c.close()
+    return devs
+
+
+class Client:
+    """a USB/IP client connection, submit() returns the seqnum and ret()
+    the next answer as (cmd, seqnum, status, data)"""
+
+    def __init__(self, port, host='127.0.0.1'):
+        self.s = socket.create_connection((host, port), 5)
+        self.s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.buf = b''
+        self.seq = 0
+        self.dirs = {}
+
+    def send(self, data):
+        self.s.sendall(data)
+
+    def recv(self, n):
+        while len(self.buf) < n:
+            d = self.s.recv(262144)
+            if not d:
+                raise EOFError('connection closed')
+            self.buf += d
+        r, self.buf = self.buf[:n], self.buf[n:]
+        return r
+
+    def import_(self, bus, op=OP_REQ_IMPORT):
+        self.send(struct.pack('>HHI', USBIP_VERSION, op, 0) +
+                  bus.encode().ljust(32, b'\0'))
+        status, = struct.unpack('>I', self.recv(8)[4:8])
+        if status:
+            return False
+        self.recv(312)
+        return True
+
+    def submit(self, ep, length, dirin=1, setup=bytes(8), data=b''):
+        self.seq += 1
+        self.send(struct.pack('>IIIIIIiiii', CMD_SUBMIT, self.seq, 0x10002,
+                              dirin, ep, 0, length, 0, 0, 0) +
+                  setup + data)
+        self.dirs[self.seq] = dirin
+        return self.seq
+
+    def unlink(self, seq):
+        self.seq += 1
+        self.send(struct.pack('>IIIIII', CMD_UNLINK, self.seq, 0x10002, 0,
+                              0, seq) + bytes(24))
+        return self.seq
+
+    def ret(self):
+        h = self.recv(48)
+        cmd, seq = struct.unpack('>II', h[:8])
+        status, length = struct.unpack('>ii', h[20:28])
+        data = b''
+        if cmd == RET_SUBMIT and self.dirs.pop(seq, 1) and length > 0:
+            data = self.recv(length)
+        return cmd, seq, status, data
+
+    def close(self):
+        self.s.close()
+
+
+def percentile(values, f):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(f * len(values)))]
@@ -0,0 +1,129 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// The timer wheel with 100k timers: the cost of adding, rearming and
+// cancelling them, then of firing them over 3 seconds, none early.
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <poll.h>
+
+#include "timing.h"
+#include "wheel.h"
+
+#define BENCH_N 100000
+#define BENCH_LATE_MAX 20000
+
+static struct wheel_timer bench_timers[BENCH_N];
+static uint64_t bench_due[BENCH_N];
+static uint64_t bench_late[BENCH_N];
+static int bench_fired = 0;
+static int bench_early = 0;
+
+void bench_nop(void *arg)
+{
+}
+
+void bench_fire(void *arg)
+{
+  struct wheel_timer *t = arg;
+  uint64_t now;
+  int i;
+
+  now = timing_usec();
+  i = t - bench_timers;
+  if (now < bench_due[i])
+    bench_early++;
+  else
+    bench_late[bench_fired] = now - bench_due[i];
+  bench_fired++;
+}
+
+// nsec per timer of arming all of them again within a minute
+double bench_add(void)
+{
+  uint64_t t0;
+  int i;
+
+  t0 = timing_usec();
+  for (i = 0; i < BENCH_N; i++)
+    wheel_add(&bench_timers[i], 1000 + (random() % 60000) * 1000ULL,
+	      bench_nop, NULL);
+  return (timing_usec() - t0) * 1000.0 / BENCH_N;
+}
+
+int main(void)
+{
+  uint64_t busy;
+  uint64_t t0;
+  uint64_t d;
+  double add;
+  double rearm;
+  int i;
+
+  srandom(1);
+  add = bench_add();
+  rearm = bench_add();
+  t0 = timing_usec();
+  for (i = 0; i < BENCH_N; i++)
+    wheel_del(&bench_timers[i]);
+  printf("wheel: %d timers, add %.0f ns, rearm %.0f ns, cancel %.0f ns\n",
+	 BENCH_N, add, rearm, (timing_usec() - t0) * 1000.0 / BENCH_N);
+
+  for (i = 0; i < BENCH_N; i++)
+  {
+    d = 1000 + (random() % 3000) * 1000ULL;
+    bench_due[i] = timing_usec() + d;
+    wheel_add(&bench_timers[i], d, bench_fire, &bench_timers[i]);
+  }
+  busy = 0;
+  while (bench_fired < BENCH_N)
+  {
+    poll(NULL, 0, wheel_timeout());
+    t0 = timing_usec();
+    wheel_run();
+    busy += timing_usec() - t0;
+  }
+  qsort(bench_late, BENCH_N - bench_early, sizeof(*bench_late), timing_cmp);
+  d = bench_late[(BENCH_N - bench_early) * 99 / 100];
+  printf("wheel: fired over 3 s, %d early, late p50 %llu usec, p99 %llu "
+	 "usec, run %.0f ns per timer\n", bench_early,
+	 (unsigned long long)bench_late[(BENCH_N - bench_early) / 2],
+	 (unsigned long long)d, busy * 1000.0 / BENCH_N);
+  if (bench_early || d > BENCH_LATE_MAX)
+  {
+    printf("FAIL: timers fired early or late\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
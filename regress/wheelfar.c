@@ -0,0 +1,92 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// The timer wheel against a simulated clock run one tick at a time:
+// timers from a millisecond to 30 hours away, past the reach of its top
+// level, fire within two ticks of their expiry.
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "wheel.h"
+
+#define FAR_N 6
+
+static uint64_t far_clock = 123456789;
+static struct wheel_timer far_timers[FAR_N];
+static uint64_t far_due[FAR_N];
+static uint64_t far_at[FAR_N];
+
+// the wheel's clock
+uint64_t timing_usec(void)
+{
+  return far_clock;
+}
+
+void far_fire(void *arg)
+{
+  far_at[(struct wheel_timer *)arg - far_timers] = far_clock;
+}
+
+int main(void)
+{
+  static const double hours[FAR_N] = { 0.001, 1, 4.6, 5, 10, 30 };
+  int64_t off;
+  int res;
+  int i;
+
+  for (i = 0; i < FAR_N; i++)
+  {
+    far_due[i] = far_clock + hours[i] * 3600e6;
+    wheel_add(&far_timers[i], far_due[i] - far_clock, far_fire,
+	      &far_timers[i]);
+  }
+  while (far_clock < far_due[FAR_N - 1] + 10 * WHEEL_TICK)
+  {
+    far_clock += WHEEL_TICK;
+    wheel_run();
+  }
+
+  res = EXIT_SUCCESS;
+  for (i = 0; i < FAR_N; i++)
+  {
+    off = (int64_t)(far_at[i] - far_due[i]);
+    printf("wheel: %6.3f h timer %s %+lld usec\n", hours[i],
+	   far_at[i] ? "fired" : "never fired", (long long)off);
+    if (!far_at[i] || off < 0 || off > 2 * WHEEL_TICK)
+      res = EXIT_FAILURE;
+  }
+  if (res != EXIT_SUCCESS)
+    printf("FAIL: timers not fired within two ticks\n");
+  return res;
+}
@@ -0,0 +1,590 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+
+#include "log.h"
+#include "net.h"
+#include "relay.h"
+#include "timing.h"
+#include "tunnel.h"
+
+// each upstream is polled by a small state machine, so that the device
+// lists of all of them are read in parallel and within RELAY_TIMEOUT
+#define RELAY_IDLE 0
+#define RELAY_CONNECT 1
+#define RELAY_HDR 2
+#define RELAY_DEV 3
+
+struct relay_up
+{
+  char *addr;
+  unsigned short port;
+  int s;
+  int state;
+  int got;
+  int need;
+  uint32_t left;
+  uint32_t skip;
+  char item[sizeof(struct net_usb_dev) + 255 * sizeof(struct net_usb_if)];
+  char *list;
+  uint32_t len;
+  uint32_t ndev;
+};
+
+// merged devlist, published by the refresher process and read by the
+// serving processes, gen is odd while an update is in progress
+struct relay_cache
+{
+  volatile uint32_t gen;
+  uint32_t len;
+  char data[RELAY_CACHE_MAX];
+};
+
+static struct relay_up relay_ups[RELAY_UP_MAX];
+static int relay_n = 0;
+static struct relay_cache *relay_cache = NULL;
+
+int relay_add(char *arg)
+{
+  char *port;
+
+  if (relay_n == RELAY_UP_MAX)
+    return -1;
+  relay_ups[relay_n].addr = arg;
+  relay_ups[relay_n].port = 3240;
+  relay_ups[relay_n].s = -1;
+  relay_ups[relay_n].state = RELAY_IDLE;
+  port = strchr(arg, ':');
+  if (port != NULL)
+  {
+    *port++ = '\0';
+    relay_ups[relay_n].port = atoi(port);
+    if (relay_ups[relay_n].port == 0)
+      return -1;
+  }
+  relay_n++;
+  return 0;
+}
+
+int relay_enabled(void)
+{
+  return relay_n > 0;
+}
+
+// busids are namespaced as "<upstream>-<busid>", paths are prefixed with
+// the upstream address, the same in device lists and import answers
+int relay_rename(int i, struct net_usb_dev *dev)
+{
+  struct relay_up *up;
+  char tmp[NET_USB_DEV_MAX];
+
+  up = &relay_ups[i];
+  strlcpy(tmp, dev->bus, NET_USB_BUS_MAX);
+  if (snprintf(dev->bus, NET_USB_BUS_MAX, "%d-%s", i, tmp) >=
+      NET_USB_BUS_MAX)
+  {
+    log_printf(LOG_ERR, "relay: busid %s of %s too long\n", tmp, up->addr);
+    return -1;
+  }
+  strlcpy(tmp, dev->dev, NET_USB_DEV_MAX);
+  if (snprintf(dev->dev, NET_USB_DEV_MAX, "%s:%hu/%s", up->addr, up->port,
+	       tmp) >= NET_USB_DEV_MAX)
+    dev->dev[NET_USB_DEV_MAX - 1] = '\0';
+  return 0;
+}
+
+// a lost upstream has no devices until it answers again
+void relay_lost(int i, char *why)
+{
+  struct relay_up *up;
+
+  up = &relay_ups[i];
+  if (why != NULL)
+    log_printf(LOG_ERR, "relay: %s %s:%hu\n", why, up->addr,
+	       up->port);
+  close(up->s);
+  up->s = -1;
+  up->state = RELAY_IDLE;
+  up->len = 0;
+  up->ndev = 0;
+}
+
+int relay_connect(int i)
+{
+  struct sockaddr_in saddr;
+  struct relay_up *up;
+
+  up = &relay_ups[i];
+  up->s = socket(AF_INET, SOCK_STREAM, 0);
+  if (up->s == -1)
+  {
+    log_printf(LOG_ERR, "relay: socket(): %s\n", strerror(errno));
+    return -1;
+  }
+  fcntl(up->s, F_SETFL, fcntl(up->s, F_GETFL) | O_NONBLOCK);
+
+  saddr.sin_family = AF_INET;
+  saddr.sin_port = htons(up->port);
+  saddr.sin_addr.s_addr = inet_addr(up->addr);
+  if (connect(up->s, (struct sockaddr *)&saddr, sizeof(saddr)) == -1 &&
+      errno != EINPROGRESS)
+  {
+    log_printf(LOG_WARNING, "relay: cannot connect to %s:%hu: %s\n",
+	       up->addr, up->port, strerror(errno));
+    close(up->s);
+    up->s = -1;
+    up->len = 0;
+    up->ndev = 0;
+    return -1;
+  }
+  up->state = RELAY_CONNECT;
+  return 0;
+}
+
+// the request fits in the empty send buffer of the socket, the answer
+// starts with the op header and the number of devices
+int relay_request(int i)
+{
+  struct relay_up *up;
+  struct net_op op;
+
+  up = &relay_ups[i];
+  op.v = htons(NET_VERSION);
+  op.op = htons(NET_OP_RDEVLIST);
+  op.res = 0;
+  if (write(up->s, &op, sizeof(op)) != sizeof(op))
+    return -1;
+  up->state = RELAY_HDR;
+  up->got = 0;
+  up->need = sizeof(op) + sizeof(uint32_t);
+  up->len = 0;
+  up->ndev = 0;
+  up->skip = 0;
+  return 0;
+}
+
+// keep a complete device record, a device whose busid is too long or
+// that does not fit in the cache is skipped alone
+void relay_keep(int i)
+{
+  struct relay_up *up;
+  char *list;
+
+  up = &relay_ups[i];
+  if (relay_rename(i, (struct net_usb_dev *)up->item))
+    return;
+  if (up->len + up->need > RELAY_CACHE_MAX - sizeof(uint32_t))
+  {
+    up->skip++;
+    return;
+  }
+  list = realloc(up->list, up->len + up->need);
+  if (list == NULL)
+  {
+    up->skip++;
+    return;
+  }
+  up->list = list;
+  memcpy(up->list + up->len, up->item, up->need);
+  up->len += up->need;
+  up->ndev++;
+}
+
+// read what the upstream sent, one item at a time
+int relay_input(int i)
+{
+  struct net_usb_dev *dev;
+  struct relay_up *up;
+  struct net_op *op;
+  int len;
+
+  up = &relay_ups[i];
+  len = read(up->s, up->item + up->got, up->need - up->got);
+  if (len == -1 && errno == EAGAIN)
+    return 0;
+  if (len <= 0)
+    return -1;
+  up->got += len;
+  if (up->got < up->need)
+    return 0;
+
+  if (up->state == RELAY_HDR)
+  {
+    op = (struct net_op *)up->item;
+    if (ntohs(op->v) != NET_VERSION || ntohs(op->op) != NET_OP_SDEVLIST ||
+	ntohl(op->res) != NET_RES_OK)
+      return -1;
+    memcpy(&up->left, op + 1, sizeof(up->left));
+    up->left = ntohl(up->left);
+  }
+  else
+  {
+    // the interfaces follow the device in the same item
+    dev = (struct net_usb_dev *)up->item;
+    if (up->need == sizeof(*dev) && dev->if_n)
+    {
+      up->need += dev->if_n * sizeof(struct net_usb_if);
+      return 0;
+    }
+    relay_keep(i);
+    up->left--;
+  }
+
+  up->state = RELAY_DEV;
+  up->got = 0;
+  up->need = sizeof(struct net_usb_dev);
+  if (up->left == 0)
+  {
+    if (up->skip)
+      log_printf(LOG_ERR, "relay: devlist cache full, %u devices of %s "
+		 "skipped\n", up->skip, up->addr);
+    up->state = RELAY_IDLE;
+  }
+  return 0;
+}
+
+// ask every upstream for its devices and read the answers in parallel,
+// those that do not answer in time are dropped
+void relay_poll(void)
+{
+  struct pollfd pfd[RELAY_UP_MAX];
+  int idx[RELAY_UP_MAX];
+  uint64_t deadline;
+  uint64_t now;
+  socklen_t slen;
+  int err;
+  int n;
+  int i;
+
+  for (i = 0; i < relay_n; i++)
+    if (relay_ups[i].s == -1)
+      relay_connect(i);
+    else if (relay_request(i))
+      relay_lost(i, "lost upstream");
+
+  deadline = timing_usec() + RELAY_TIMEOUT * 1000000ULL;
+  for (;;)
+  {
+    n = 0;
+    for (i = 0; i < relay_n; i++)
+    {
+      if (relay_ups[i].state == RELAY_IDLE)
+	continue;
+      pfd[n].fd = relay_ups[i].s;
+      pfd[n].events = relay_ups[i].state == RELAY_CONNECT ? POLLOUT : POLLIN;
+      idx[n++] = i;
+    }
+    now = timing_usec();
+    if (n == 0 || now >= deadline)
+      break;
+    if (poll(pfd, n, (deadline - now + 999) / 1000) == -1)
+      continue;
+
+    for (n--; n >= 0; n--)
+    {
+      i = idx[n];
+      if (!pfd[n].revents)
+	continue;
+      if (relay_ups[i].state == RELAY_CONNECT)
+      {
+	slen = sizeof(err);
+	if (getsockopt(pfd[n].fd, SOL_SOCKET, SO_ERROR, &err, &slen) == -1)
+	  err = errno;
+	if (err)
+	  log_printf(LOG_WARNING, "relay: cannot connect to %s:%hu: %s\n",
+		     relay_ups[i].addr, relay_ups[i].port, strerror(err));
+	if (err)
+	  relay_lost(i, NULL);
+	else if (relay_request(i))
+	  relay_lost(i, "lost upstream");
+      }
+      else if (relay_input(i))
+	relay_lost(i, "lost upstream");
+    }
+  }
+
+  for (i = 0; i < relay_n; i++)
+    if (relay_ups[i].state != RELAY_IDLE)
+      relay_lost(i, "no answer in time from");
+}
+
+void relay_refresh(int intv)
+{
+  uint32_t ndev;
+  uint32_t len;
+  char *buf;
+  int i;
+
+  buf = malloc(RELAY_CACHE_MAX);
+  if (buf == NULL)
+  {
+    log_printf(LOG_ERR, "relay: malloc() error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // exit with the daemon
+  while (getppid() != 1)
+  {
+    relay_poll();
+
+    // each upstream list fits, all of them may not
+    ndev = 0;
+    len = sizeof(ndev);
+    for (i = 0; i < relay_n; i++)
+    {
+      if (len + relay_ups[i].len > RELAY_CACHE_MAX)
+      {
+	log_printf(LOG_ERR, "relay: devlist cache full, devices of %s "
+		   "skipped\n", relay_ups[i].addr);
+	continue;
+      }
+      memcpy(buf + len, relay_ups[i].list, relay_ups[i].len);
+      len += relay_ups[i].len;
+      ndev += relay_ups[i].ndev;
+    }
+    ndev = htonl(ndev);
+    memcpy(buf, &ndev, sizeof(ndev));
+
+    relay_cache->gen++;
+    __sync_synchronize();
+    memcpy(relay_cache->data, buf, len);
+    relay_cache->len = len;
+    __sync_synchronize();
+    relay_cache->gen++;
+
+    sleep(intv);
+  }
+  exit(EXIT_SUCCESS);
+}
+
+int relay_start(int intv)
+{
+  uint32_t ndev;
+
+  relay_cache = mmap(NULL, sizeof(*relay_cache), PROT_READ | PROT_WRITE,
+		     MAP_ANON | MAP_SHARED, -1, 0);
+  if (relay_cache == MAP_FAILED)
+  {
+    perror("mmap()");
+    return -1;
+  }
+  ndev = 0;
+  memcpy(relay_cache->data, &ndev, sizeof(ndev));
+  relay_cache->len = sizeof(ndev);
+
+  switch (fork())
+  {
+  case -1:
+    perror("fork()");
+    return -1;
+  case 0:
+    relay_refresh(intv);
+    break;
+  }
+  return 0;
+}
+
+void relay_dev_list_request(int s, char *addr)
+{
+  uint32_t gen;
+  uint32_t len;
+  char *buf;
+
+  buf = malloc(RELAY_CACHE_MAX);
+  if (buf == NULL)
+  {
+    log_printf(LOG_ERR, "%s: malloc() error\n", addr);
+    return;
+  }
+
+  do
+  {
+    gen = relay_cache->gen;
+    __sync_synchronize();
+    len = relay_cache->len;
+    memcpy(buf, relay_cache->data, len);
+    __sync_synchronize();
+  } while ((gen & 1) || gen != relay_cache->gen);
+
+  if (net_send_op(s, NET_OP_SDEVLIST, NET_RES_OK) || net_send(s, buf, len))
+    log_printf(LOG_ERR, "%s: error sending devlist\n", addr);
+  free(buf);
+}
+
+// forward both directions untouched until one side closes, so that
+// pipelined submits and their answers keep flowing
+void relay_splice(int a, int b)
+{
+  struct pollfd pfd[2];
+  char *buf;
+  int len;
+  int i;
+
+#ifdef SO_SPLICE
+  // let the kernel move the data between the sockets, splicing is
+  // dissolved on EOF and the socket then polls readable
+  if (setsockopt(a, SOL_SOCKET, SO_SPLICE, &b, sizeof(b)) == 0 &&
+      setsockopt(b, SOL_SOCKET, SO_SPLICE, &a, sizeof(a)) == 0)
+  {
+    pfd[0].fd = a;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = b;
+    pfd[1].events = POLLIN;
+    poll(pfd, 2, -1);
+    return;
+  }
+#endif
+
+  buf = malloc(65536);
+  if (buf == NULL)
+    return;
+  pfd[0].fd = a;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = b;
+  pfd[1].events = POLLIN;
+  for (;;)
+  {
+    if (poll(pfd, 2, -1) == -1)
+      break;
+    for (i = 0; i < 2; i++)
+    {
+      if (!pfd[i].revents)
+	continue;
+      len = read(pfd[i].fd, buf, 65536);
+      if (len <= 0 || net_send(pfd[!i].fd, buf, len))
+      {
+	free(buf);
+	return;
+      }
+    }
+  }
+  free(buf);
+}
+
+void relay_import_request(int s, char *addr)
+{
+  char bus[NET_USB_BUS_MAX + 1];
+  char ubus[NET_USB_BUS_MAX];
+  struct net_usb_dev dev;
+  struct net_op op;
+  char *end;
+  long i;
+  int us;
+
+  bzero(bus, NET_USB_BUS_MAX + 1);
+  if (net_read_import(s, bus))
+    return;
+
+  i = strtol(bus, &end, 10);
+  if (end == bus || *end != '-' || i < 0 || i >= relay_n)
+  {
+    log_printf(LOG_ERR, "%s: bad device requested\n", addr);
+    net_send_op(s, NET_OP_SIMPORT, NET_RES_NODEV);
+    return;
+  }
+
+  bzero(ubus, NET_USB_BUS_MAX);
+  strlcpy(ubus, end + 1, NET_USB_BUS_MAX);
+  // a tunnel is imported the same way, the upstream daemon then serves
+  // each endpoint by a process of its own
+  us = net_connect(relay_ups[i].addr, relay_ups[i].port);
+  if (us != -1 && (net_send_op(us, tunnel_enabled() ? NET_OP_RTUNNEL :
+			       NET_OP_RIMPORT, 0) ||
+		   net_send(us, ubus, NET_USB_BUS_MAX) ||
+		   net_read_op(us, &op)))
+  {
+    close(us);
+    us = -1;
+  }
+  if (us == -1)
+  {
+    log_printf(LOG_ERR, "%s: upstream %s:%hu unreachable\n", addr,
+	       relay_ups[i].addr, relay_ups[i].port);
+    net_send_op(s, NET_OP_SIMPORT, NET_RES_NODEV);
+    return;
+  }
+
+  if (net_send_op(s, NET_OP_SIMPORT, op.res) || op.res != NET_RES_OK)
+    return;
+  if (net_read(us, &dev, sizeof(dev)))
+    return;
+  if (relay_rename(i, &dev) || net_send(s, &dev, sizeof(dev)))
+  {
+    log_printf(LOG_ERR, "%s: error sending dev info\n", addr);
+    return;
+  }
+
+  net_no_delay(s);
+  net_no_delay(us);
+  relay_splice(s, us);
+  close(us);
+}
+
+void relay_serve(int s, char *addr)
+{
+  struct net_op op;
+  int first;
+
+  for (first = 1;; first = 0)
+  {
+    if (net_read_op(s, &op))
+    {
+      if (first)
+	log_printf(LOG_ERR, "%s: error reading op\n", addr);
+      return;
+    }
+
+    switch (op.op)
+    {
+    case NET_OP_RDEVLIST:
+      relay_dev_list_request(s, addr);
+      break;
+    case NET_OP_RIMPORT:
+      relay_import_request(s, addr);
+      return;
+    default:
+      log_printf(LOG_WARNING, "%s: unknown op (%hx)\n", addr, op.op);
+      return;
+    }
+  }
+}
@@ -0,0 +1,562 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <dev/usb/usb.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "log.h"
+#include "net.h"
+#include "probe.h"
+#include "process.h"
+#include "profile.h"
+#include "record.h"
+#include "replay.h"
+#include "timing.h"
+#include "tune.h"
+#include "wheel.h"
+
+struct replay_ent
+{
+  int type;
+  int len;
+  uint64_t t;
+  char *data;
+};
+
+static struct replay_ent *replay_ents = NULL;
+static int replay_n = 0;
+static int replay_fast = 0;
+static int replay_cur = 0;
+static char *replay_bus = NULL;
+static struct net_usb_dev *replay_dev = NULL;
+static struct net_usb_if *replay_uif = NULL;
+
+int replay_add(struct record_ent *ent, char *data)
+{
+  struct replay_ent *ents;
+  int len;
+
+  if ((replay_n & 1023) == 0)
+  {
+    ents = realloc(replay_ents, (replay_n + 1024) * sizeof(*ents));
+    if (ents == NULL)
+      return -1;
+    replay_ents = ents;
+  }
+
+  len = ntohl(ent->len);
+  replay_ents[replay_n].type = ntohl(ent->type);
+  replay_ents[replay_n].len = len;
+  replay_ents[replay_n].t = (uint64_t)ntohl(ent->sec) * 1000000 +
+    ntohl(ent->usec);
+  replay_ents[replay_n].data = data;
+
+  switch (replay_ents[replay_n].type)
+  {
+  case RECORD_IMPORT:
+    if (len < NET_USB_BUS_MAX + sizeof(struct net_usb_dev))
+      return -1;
+    replay_bus = data;
+    replay_bus[NET_USB_BUS_MAX - 1] = '\0';
+    replay_dev = (struct net_usb_dev *)(data + NET_USB_BUS_MAX);
+    replay_uif = (struct net_usb_if *)(replay_dev + 1);
+    if (len < NET_USB_BUS_MAX + sizeof(struct net_usb_dev) +
+	replay_dev->if_n * sizeof(struct net_usb_if))
+      return -1;
+    break;
+  case RECORD_SUBMIT:
+    if (len < sizeof(struct net_submit))
+      return -1;
+    break;
+  case RECORD_RET:
+    if (len < sizeof(struct net_submit_ret))
+      return -1;
+    break;
+  }
+
+  replay_n++;
+  return 0;
+}
+
+// the entries point into the capture, both go on a load error
+int replay_unload(char *data)
+{
+  free(replay_ents);
+  replay_ents = NULL;
+  replay_n = 0;
+  replay_bus = NULL;
+  free(data);
+  return -1;
+}
+
+int replay_load(char *path, int fast)
+{
+  struct record_file *file;
+  struct record_ent *ent;
+  size_t size;
+  size_t off;
+  char *data;
+  FILE *fp;
+
+  replay_fast = fast;
+  fp = fopen(path, "r");
+  if (fp == NULL)
+  {
+    perror(path);
+    return -1;
+  }
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  rewind(fp);
+  data = malloc(size);
+  if (data == NULL || fread(data, size, 1, fp) != 1)
+  {
+    printf("%s: cannot load capture\n", path);
+    free(data);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+
+  file = (struct record_file *)data;
+  if (size < sizeof(*file) || memcmp(file->magic, RECORD_MAGIC,
+				     sizeof(RECORD_MAGIC)) ||
+      ntohl(file->v) != RECORD_VERSION)
+  {
+    printf("%s: not a capture file\n", path);
+    free(data);
+    return -1;
+  }
+
+  for (off = sizeof(*file); off + sizeof(*ent) <= size;
+       off += sizeof(*ent) + ntohl(ent->len))
+  {
+    ent = (struct record_ent *)(data + off);
+    if (off + sizeof(*ent) + ntohl(ent->len) > size)
+    {
+      printf("%s: truncated capture\n", path);
+      break;
+    }
+    if (replay_add(ent, (char *)(ent + 1)))
+    {
+      printf("%s: bad capture entry at %zu\n", path, off);
+      return replay_unload(data);
+    }
+  }
+
+  if (replay_bus == NULL)
+  {
+    printf("%s: no device in capture\n", path);
+    return replay_unload(data);
+  }
+  return 0;
+}
+
+int replay_match(struct net_submit *submit, int cur)
+{
+  struct net_submit *rsubmit;
+  int i;
+  int n;
+
+  for (n = 0; n < replay_n; n++)
+  {
+    i = (cur + n) % replay_n;
+    if (replay_ents[i].type != RECORD_SUBMIT)
+      continue;
+    rsubmit = (struct net_submit *)replay_ents[i].data;
+    if (ntohl(rsubmit->hdr.endp) != submit->hdr.endp ||
+	ntohl(rsubmit->hdr.dir) != submit->hdr.dir)
+      continue;
+    if (submit->hdr.endp == 0 && memcmp(rsubmit->setup, submit->setup, 8))
+      continue;
+    return i;
+  }
+  return -1;
+}
+
+int replay_find_ret(int i)
+{
+  struct net_submit_ret *ret;
+  uint32_t seq;
+
+  seq = ((struct net_submit *)replay_ents[i].data)->hdr.seq;
+  for (i++; i < replay_n; i++)
+  {
+    if (replay_ents[i].type != RECORD_RET)
+      continue;
+    ret = (struct net_submit_ret *)replay_ents[i].data;
+    if (ret->hdr.seq == seq)
+      return i;
+  }
+  return -1;
+}
+
+// answer a submit as the recorded device did, the simulated device of
+// replayed sessions and probes
+int replay_urb(void *arg, struct net_submit *submit, char *buf, int *res)
+{
+  struct net_submit_ret *ret;
+  int len;
+  int i;
+  int r;
+
+  i = replay_match(submit, replay_cur);
+  r = i == -1 ? -1 : replay_find_ret(i);
+  if (r == -1)
+  {
+    log_printf(LOG_WARNING, "replay: no recorded answer for endpoint %d\n",
+	       submit->hdr.endp);
+    *res = -EPIPE;
+    return 0;
+  }
+  replay_cur = r + 1;
+
+  if (!replay_fast)
+    timing_sleep_until(timing_usec() +
+		       replay_ents[r].t - replay_ents[i].t);
+  ret = (struct net_submit_ret *)replay_ents[r].data;
+  *res = ntohl(ret->ret);
+  len = replay_ents[r].len - sizeof(*ret);
+  if (len > PROCESS_BUF_MAX)
+    len = PROCESS_BUF_MAX;
+  memcpy(buf, ret + 1, len);
+  return len;
+}
+
+// probe each endpoint and direction of the capture, and each request on
+// endpoint 0
+int replay_probe(void)
+{
+  struct probe_ep eps[PROBE_EP_MAX];
+  struct net_submit *rsubmit;
+  struct net_submit submit;
+  char name[32];
+  int n;
+  int i;
+  int j;
+
+  n = 0;
+  for (i = 0; i < replay_n && n < PROBE_EP_MAX; i++)
+  {
+    if (replay_ents[i].type != RECORD_SUBMIT)
+      continue;
+    rsubmit = (struct net_submit *)replay_ents[i].data;
+    submit.hdr.endp = ntohl(rsubmit->hdr.endp);
+    submit.hdr.dir = ntohl(rsubmit->hdr.dir);
+    for (j = 0; j < n; j++)
+      if (eps[j].submit.hdr.endp == submit.hdr.endp &&
+	  eps[j].submit.hdr.dir == submit.hdr.dir &&
+	  (submit.hdr.endp != 0 ||
+	   !memcmp(eps[j].submit.setup, rsubmit->setup, 8)))
+	break;
+    if (j < n)
+      continue;
+
+    if (submit.hdr.endp == 0)
+      snprintf(name, sizeof(name), "control %02x%02x", rsubmit->setup[0],
+	       rsubmit->setup[1]);
+    else
+      snprintf(name, sizeof(name), "endpoint %d %s", submit.hdr.endp,
+	       submit.hdr.dir ? "in" : "out");
+    probe_set(&eps[n++], name, submit.hdr.endp, submit.hdr.dir,
+	      ntohl(rsubmit->len), rsubmit->setup);
+  }
+  return probe_run(eps, n, replay_urb, NULL);
+}
+
+// the capture has no descriptors, the submits tell the endpoint types:
+// isochronous ones carry packets and interrupt ones an interval
+void replay_types(uint8_t *types)
+{
+  struct net_submit *rsubmit;
+  int endp;
+  int i;
+
+  bzero(types, 16);
+  for (i = 0; i < replay_n; i++)
+  {
+    if (replay_ents[i].type != RECORD_SUBMIT)
+      continue;
+    rsubmit = (struct net_submit *)replay_ents[i].data;
+    endp = ntohl(rsubmit->hdr.endp) & 15;
+    if (endp == 0)
+      types[endp] = UE_CONTROL;
+    else if ((int32_t)ntohl(rsubmit->pkt_n) > 0)
+      types[endp] = UE_ISOCHRONOUS;
+    else if ((int32_t)ntohl(rsubmit->intv) > 0)
+      types[endp] = UE_INTERRUPT;
+    else
+      types[endp] = UE_BULK;
+  }
+}
+
+void replay_session(int s, char *addr)
+{
+  struct net_submit *submit;
+  struct net_generic hdr;
+  char buf[PROCESS_BUF_MAX];
+  int len;
+  int res;
+
+  replay_cur = 0;
+  for (;;)
+  {
+    wheel_wait(s);
+    if (net_read_hdr(s, &hdr))
+      return;
+    switch(hdr.hdr.cmd)
+    {
+    case 1:
+      submit = (struct net_submit *)&hdr;
+      switch (process_read_submit(s, submit, buf, addr))
+      {
+      case 0:
+	profile_urb(submit->hdr.endp, submit->hdr.dir,
+		    process_urb_size(submit));
+	len = replay_urb(NULL, submit, buf, &res);
+	break;
+      case 1:
+	len = 0;
+	res = -ENOMEM;
+	break;
+      default:
+	return;
+      }
+      process_send_ret(s, submit, res, buf, len, addr);
+      break;
+    case 2:
+      break;
+    default:
+      log_printf(LOG_WARNING, "%s: unknown request (%u)\n", addr, hdr.hdr.cmd);
+      return;
+    }
+  }
+}
+
+void replay_serve(int s, char *addr)
+{
+  char bus[NET_USB_BUS_MAX + 1];
+  uint8_t types[16];
+  struct net_op op;
+  uint32_t ndev;
+  int first;
+
+  for (first = 1;; first = 0)
+  {
+    if (net_read_op(s, &op))
+    {
+      if (first)
+	log_printf(LOG_ERR, "%s: error reading op\n", addr);
+      return;
+    }
+
+    switch (op.op)
+    {
+    case NET_OP_RDEVLIST:
+      ndev = htonl(1);
+      if (net_send_op(s, NET_OP_SDEVLIST, NET_RES_OK) ||
+	  net_send(s, &ndev, sizeof(ndev)) ||
+	  net_send(s, replay_dev, sizeof(*replay_dev)) ||
+	  net_send(s, replay_uif, replay_dev->if_n * sizeof(*replay_uif)))
+	log_printf(LOG_ERR, "%s: error sending devlist\n", addr);
+      break;
+    case NET_OP_RIMPORT:
+      bzero(bus, NET_USB_BUS_MAX + 1);
+      if (net_read_import(s, bus))
+	return;
+      if (strcmp(bus, replay_bus))
+      {
+	net_send_op(s, NET_OP_SIMPORT, NET_RES_NODEV);
+	return;
+      }
+      // the simulated device learns a profile like the real one
+      profile_load(ntohs(replay_dev->vid), ntohs(replay_dev->pid),
+		   ntohs(replay_dev->bcd), addr);
+      if (profile_nodelay())
+	net_no_delay(s);
+      if (net_send_op(s, NET_OP_SIMPORT, NET_RES_OK) ||
+	  net_send(s, replay_dev, sizeof(*replay_dev)))
+      {
+	log_printf(LOG_ERR, "%s: error sending import answer\n", addr);
+	return;
+      }
+      replay_types(types);
+      profile_start(types);
+      tune_start(s);
+      replay_session(s, addr);
+      tune_report(addr);
+      profile_stop(addr);
+      return;
+    default:
+      log_printf(LOG_WARNING, "%s: unknown op (%hx)\n", addr, op.op);
+      return;
+    }
+  }
+}
+
+int replay_client(char *addr, unsigned short port)
+{
+  struct net_submit_ret ret;
+  struct net_submit *submit;
+  struct net_usb_dev dev;
+  struct pollfd pfd;
+  struct net_op op;
+  char buf[PROCESS_BUF_MAX];
+  unsigned long long bytes;
+  unsigned long long total;
+  unsigned long long sum;
+  uint64_t *lat;
+  uint64_t start;
+  uint64_t t0;
+  int mismatch;
+  int skipped;
+  int first;
+  int len;
+  int n;
+  int i;
+  int r;
+  int s;
+
+  s = net_connect(addr, port);
+  if (s == -1)
+    return -1;
+
+  if (net_send_op(s, NET_OP_RIMPORT, 0) ||
+      net_send(s, replay_bus, NET_USB_BUS_MAX) ||
+      net_read_op(s, &op) || op.op != NET_OP_SIMPORT ||
+      op.res != NET_RES_OK || net_read(s, &dev, sizeof(dev)))
+  {
+    printf("%s: import of %s refused\n", addr, replay_bus);
+    return -1;
+  }
+  net_no_delay(s);
+
+  lat = calloc(replay_n, sizeof(*lat));
+  if (lat == NULL)
+    return -1;
+
+  bytes = 0;
+  mismatch = 0;
+  skipped = 0;
+  first = -1;
+  n = 0;
+  t0 = timing_usec();
+  for (i = 0; i < replay_n; i++)
+  {
+    if (replay_ents[i].type != RECORD_SUBMIT)
+      continue;
+    submit = (struct net_submit *)replay_ents[i].data;
+    // the device never answered it, nor will the one replayed against
+    if (replay_find_ret(i) == -1)
+    {
+      skipped++;
+      continue;
+    }
+    if (first == -1)
+      first = i;
+    if (!replay_fast)
+      timing_sleep_until(t0 + replay_ents[i].t - replay_ents[first].t);
+
+    start = timing_usec();
+    if (net_send(s, replay_ents[i].data, replay_ents[i].len))
+    {
+      printf("%s: session lost after %d urbs\n", addr, n);
+      break;
+    }
+    pfd.fd = s;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, REPLAY_TIMEOUT) != 1)
+    {
+      printf("%s: no answer after %d urbs\n", addr, n);
+      break;
+    }
+    if (net_read(s, &ret, sizeof(ret)))
+    {
+      printf("%s: session lost after %d urbs\n", addr, n);
+      break;
+    }
+    len = ntohl(ret.len);
+    if (!ntohl(submit->hdr.dir))
+      len = 0;
+    bytes += replay_ents[i].len - sizeof(*submit) + len;
+    while (len > 0)
+    {
+      r = len > PROCESS_BUF_MAX ? PROCESS_BUF_MAX : len;
+      if (net_read(s, buf, r))
+	break;
+      len -= r;
+    }
+    if (len > 0)
+    {
+      printf("%s: session lost after %d urbs\n", addr, n);
+      break;
+    }
+    lat[n++] = timing_usec() - start;
+
+    r = replay_find_ret(i);
+    if (r != -1 &&
+	((struct net_submit_ret *)replay_ents[r].data)->ret != ret.ret)
+      mismatch++;
+  }
+  total = timing_usec() - t0;
+  close(s);
+
+  if (n == 0)
+  {
+    free(lat);
+    return -1;
+  }
+
+  qsort(lat, n, sizeof(*lat), timing_cmp);
+  for (sum = 0, i = 0; i < n; i++)
+    sum += lat[i];
+  printf("replay: %d urbs, %llu bytes in %llu.%06llu s\n", n, bytes,
+	 total / 1000000, total % 1000000);
+  printf("replay: %.2f MB/s, %.0f urb/s\n",
+	 total ? bytes / (double)total : 0.0,
+	 total ? n * 1000000.0 / total : 0.0);
+  printf("replay: latency usec min %llu avg %llu p50 %llu p99 %llu max %llu\n",
+	 (unsigned long long)lat[0], sum / n,
+	 (unsigned long long)lat[n / 2],
+	 (unsigned long long)lat[n * 99 / 100],
+	 (unsigned long long)lat[n - 1]);
+  printf("replay: %d status mismatches, %d unanswered urbs skipped\n",
+	 mismatch, skipped);
+  free(lat);
+  return 0;
+}
@@ -0,0 +1,222 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+
+#include "session.h"
+
+static int session_grace = 0;
+
+void session_set_grace(int grace)
+{
+  session_grace = grace;
+}
+
+int session_sun(char *path, struct sockaddr_un *sun)
+{
+  bzero(sun, sizeof(*sun));
+  sun->sun_family = AF_UNIX;
+  if (strlcpy(sun->sun_path, path, sizeof(sun->sun_path)) >=
+      sizeof(sun->sun_path))
+    return -1;
+  return 0;
+}
+
+// give a socket and some data about it to the process listening on path
+int session_pass(char *path, int s, void *data, int len)
+{
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } cmsgbuf;
+  struct sockaddr_un sun;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  char ack;
+  int us;
+
+  if (session_sun(path, &sun))
+    return -1;
+
+  us = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (us == -1)
+    return -1;
+  if (connect(us, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+  {
+    close(us);
+    return -1;
+  }
+
+  bzero(&msg, sizeof(msg));
+  bzero(&cmsgbuf, sizeof(cmsgbuf));
+  iov.iov_base = data;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = &cmsgbuf.buf;
+  msg.msg_controllen = sizeof(cmsgbuf.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  memcpy(CMSG_DATA(cmsg), &s, sizeof(int));
+
+  // the receiver only takes the socket over once it acknowledged it
+  if (sendmsg(us, &msg, 0) == -1 || read(us, &ack, 1) != 1)
+  {
+    close(us);
+    return -1;
+  }
+  close(us);
+  return 0;
+}
+
+int session_listen(char *path)
+{
+  struct sockaddr_un sun;
+  int ls;
+
+  if (session_sun(path, &sun))
+    return -1;
+  ls = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (ls == -1)
+    return -1;
+  unlink(sun.sun_path);
+  if (bind(ls, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+      chmod(sun.sun_path, S_IRUSR | S_IWUSR) == -1 ||
+      listen(ls, 1) == -1)
+  {
+    perror(sun.sun_path);
+    close(ls);
+    unlink(sun.sun_path);
+    return -1;
+  }
+  return ls;
+}
+
+// take the socket passed on a connection accepted from session_listen()
+int session_take(int ls, void *data, int len)
+{
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } cmsgbuf;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  int cs;
+  int s;
+
+  cs = accept(ls, NULL, NULL);
+  if (cs == -1)
+    return -1;
+
+  bzero(&msg, sizeof(msg));
+  iov.iov_base = data;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = &cmsgbuf.buf;
+  msg.msg_controllen = sizeof(cmsgbuf.buf);
+  s = -1;
+  if (recvmsg(cs, &msg, 0) > 0)
+  {
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+	cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&s, CMSG_DATA(cmsg), sizeof(int));
+  }
+  if (s != -1 && write(cs, "", 1) != 1)
+  {
+    close(s);
+    s = -1;
+  }
+  close(cs);
+  return s;
+}
+
+// give the client socket to the process keeping ugen open, if any
+int session_handoff(int s, char *ugen, char *addr)
+{
+  char path[104];
+
+  if (session_grace == 0 ||
+      snprintf(path, sizeof(path), SESSION_PATH, ugen) >= sizeof(path))
+    return -1;
+  return session_pass(path, s, addr, strlen(addr) + 1);
+}
+
+// listen for the next importer of ugen, called before the current client
+// socket is closed so that a reconnect always finds the lingering session
+int session_hold(char *ugen)
+{
+  char path[104];
+
+  if (session_grace == 0 ||
+      snprintf(path, sizeof(path), SESSION_PATH, ugen) >= sizeof(path))
+    return -1;
+  return session_listen(path);
+}
+
+// wait up to the grace period for the next importer on the socket from
+// session_hold(), returns its socket and address
+int session_linger(int ls, char *ugen, char *addr, int len)
+{
+  struct pollfd pfd;
+  char path[104];
+  int s;
+
+  if (ls == -1)
+    return -1;
+  snprintf(path, sizeof(path), SESSION_PATH, ugen);
+  pfd.fd = ls;
+  pfd.events = POLLIN;
+  s = -1;
+  if (poll(&pfd, 1, session_grace * 1000) == 1)
+    s = session_take(ls, addr, len - 1);
+  close(ls);
+  unlink(path);
+  addr[len - 1] = '\0';
+  return s;
+}
@@ -0,0 +1,457 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "log.h"
+#include "shaper.h"
+#include "timing.h"
+
+struct shaper_conf
+{
+  int level;
+  int any;
+  uint32_t key;
+  uint64_t rate;
+  uint64_t burst;
+};
+
+struct shaper_bucket
+{
+  volatile pid_t lock;
+  int used;
+  int level;
+  uint32_t key;
+  uint64_t rate;
+  uint64_t burst;
+  int64_t tokens;
+  uint64_t last;
+  uint64_t bytes;
+  uint64_t delay;
+  uint64_t dump_bytes;
+  uint64_t dump_t;
+};
+
+// shared by all the sessions, a session slot is owned by a session
+// process and stamped each time it moves shaped data
+struct shaper_shm
+{
+  volatile pid_t lock;
+  struct shaper_bucket bucket[SHAPER_BUCKETS];
+  volatile pid_t session[SHAPER_SESSIONS];
+  volatile uint64_t session_last[SHAPER_SESSIONS];
+};
+
+static struct shaper_conf shaper_conf[SHAPER_CONF_MAX];
+static int shaper_conf_n = 0;
+static struct shaper_shm *shaper_shm = NULL;
+
+// state of the session owned by this process
+static struct shaper_bucket *shaper_lvl[3];
+static struct shaper_bucket shaper_share;
+static uint8_t shaper_type[16];
+static uint64_t shaper_due_t[16];
+static int shaper_slot = -1;
+static int shaper_active = 1;
+static uint64_t shaper_active_t = 0;
+
+// level[@key]=rate[/burst], rates in KB/s and bursts in KB
+int shaper_add(char *spec)
+{
+  struct shaper_conf *c;
+  char *key;
+  char *val;
+  char *end;
+
+  if (shaper_conf_n == SHAPER_CONF_MAX)
+    return -1;
+  c = &shaper_conf[shaper_conf_n];
+
+  val = strchr(spec, '=');
+  if (val == NULL)
+    return -1;
+  *val++ = '\0';
+  key = strchr(spec, '@');
+  if (key != NULL)
+    *key++ = '\0';
+
+  if (!strcmp(spec, "global") && key == NULL)
+    c->level = SHAPER_GLOBAL;
+  else if (!strcmp(spec, "client"))
+    c->level = SHAPER_CLIENT;
+  else if (!strcmp(spec, "device"))
+    c->level = SHAPER_DEVICE;
+  else
+    return -1;
+
+  c->any = key == NULL;
+  if (c->level == SHAPER_CLIENT && key != NULL)
+  {
+    c->key = inet_addr(key);
+    if (c->key == INADDR_NONE)
+      return -1;
+  }
+  else if (key != NULL)
+    c->key = strtoul(key, NULL, 10);
+
+  c->rate = strtoull(val, &end, 10) * 1024;
+  if (c->rate == 0)
+    return -1;
+  c->burst = c->rate / 10;
+  if (*end == '/')
+    c->burst = strtoull(end + 1, &end, 10) * 1024;
+  if (*end != '\0')
+    return -1;
+  if (c->burst < 65536)
+    c->burst = 65536;
+
+  shaper_conf_n++;
+  return 0;
+}
+
+// the lock holds the pid of its owner, a session killed while holding it
+// does not leave the others spinning forever
+void shaper_lock(volatile pid_t *lock)
+{
+  pid_t owner;
+  pid_t pid;
+  int n;
+
+  pid = getpid();
+  for (n = 1; !__sync_bool_compare_and_swap(lock, 0, pid); n++)
+  {
+    if (n % SHAPER_SPIN)
+      continue;
+    owner = *lock;
+    if (owner != 0 && kill(owner, 0) == -1 && errno == ESRCH)
+      __sync_bool_compare_and_swap(lock, owner, 0);
+  }
+}
+
+void shaper_unlock(volatile pid_t *lock)
+{
+  __sync_lock_release(lock);
+}
+
+struct shaper_conf *shaper_find_conf(int level, uint32_t key)
+{
+  struct shaper_conf *any;
+  int i;
+
+  any = NULL;
+  for (i = 0; i < shaper_conf_n; i++)
+  {
+    if (shaper_conf[i].level != level)
+      continue;
+    if (shaper_conf[i].any)
+      any = &shaper_conf[i];
+    else if (shaper_conf[i].key == key)
+      return &shaper_conf[i];
+  }
+  return any;
+}
+
+struct shaper_bucket *shaper_bucket(int level, uint32_t key)
+{
+  struct shaper_bucket *b;
+  struct shaper_conf *c;
+  int i;
+
+  c = shaper_find_conf(level, key);
+  if (c == NULL)
+    return NULL;
+
+  shaper_lock(&shaper_shm->lock);
+  for (i = 0; i < SHAPER_BUCKETS; i++)
+  {
+    b = &shaper_shm->bucket[i];
+    if (b->used && b->level == level && b->key == key)
+      break;
+  }
+  if (i == SHAPER_BUCKETS)
+    for (i = 0; i < SHAPER_BUCKETS; i++)
+    {
+      b = &shaper_shm->bucket[i];
+      if (b->used)
+	continue;
+      b->used = 1;
+      b->level = level;
+      b->key = key;
+      b->rate = c->rate;
+      b->burst = c->burst;
+      b->tokens = c->burst;
+      b->last = timing_usec();
+      b->dump_t = b->last;
+      break;
+    }
+  shaper_unlock(&shaper_shm->lock);
+
+  if (i == SHAPER_BUCKETS)
+  {
+    log_printf(LOG_WARNING, "shaper: no bucket left\n");
+    return NULL;
+  }
+  return b;
+}
+
+int shaper_init(void)
+{
+  if (shaper_conf_n == 0)
+    return 0;
+
+  shaper_shm = mmap(NULL, sizeof(*shaper_shm), PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_SHARED, -1, 0);
+  if (shaper_shm == MAP_FAILED)
+  {
+    perror("mmap()");
+    shaper_shm = NULL;
+    return -1;
+  }
+  shaper_bucket(SHAPER_GLOBAL, 0);
+  return 0;
+}
+
+// the buckets and their locks are of no use to an unprivileged process
+void shaper_confine(void)
+{
+  if (shaper_shm != NULL)
+    munmap(shaper_shm, sizeof(*shaper_shm));
+  shaper_shm = NULL;
+}
+
+void shaper_start(char *addr, char *ugen, uint8_t *types)
+{
+  char caddr[64];
+  char *port;
+  pid_t owner;
+  pid_t pid;
+  int i;
+
+  if (shaper_shm == NULL)
+    return;
+
+  strlcpy(caddr, addr, sizeof(caddr));
+  port = strchr(caddr, ':');
+  if (port != NULL)
+    *port = '\0';
+  shaper_lvl[SHAPER_GLOBAL] = shaper_bucket(SHAPER_GLOBAL, 0);
+  shaper_lvl[SHAPER_CLIENT] = shaper_bucket(SHAPER_CLIENT, inet_addr(caddr));
+  shaper_lvl[SHAPER_DEVICE] = shaper_bucket(SHAPER_DEVICE,
+					    strtoul(ugen, NULL, 10));
+  shaper_types(types);
+
+  bzero(shaper_due_t, sizeof(shaper_due_t));
+  bzero(&shaper_share, sizeof(shaper_share));
+  shaper_share.lock = -1;
+  if (shaper_lvl[SHAPER_GLOBAL] != NULL)
+    shaper_share.tokens = shaper_lvl[SHAPER_GLOBAL]->burst;
+  shaper_share.last = timing_usec();
+
+  // take a free slot, or one left by a session which died, an owner
+  // running as another user is still alive
+  pid = getpid();
+  for (i = 0; i < SHAPER_SESSIONS && shaper_slot == -1; i++)
+    if (__sync_bool_compare_and_swap(&shaper_shm->session[i], 0, pid))
+      shaper_slot = i;
+  for (i = 0; i < SHAPER_SESSIONS && shaper_slot == -1; i++)
+  {
+    owner = shaper_shm->session[i];
+    if (owner != 0 && kill(owner, 0) == -1 && errno == ESRCH &&
+	__sync_bool_compare_and_swap(&shaper_shm->session[i], owner, pid))
+      shaper_slot = i;
+  }
+}
+
+void shaper_types(uint8_t *types)
+{
+  memcpy(shaper_type, types, sizeof(shaper_type));
+}
+
+void shaper_stop(void)
+{
+  if (shaper_shm == NULL || shaper_slot == -1)
+    return;
+  shaper_shm->session_last[shaper_slot] = 0;
+  shaper_shm->session[shaper_slot] = 0;
+  shaper_slot = -1;
+}
+
+// sessions which moved shaped data recently share the global rate
+int shaper_count_active(uint64_t now)
+{
+  int n;
+  int i;
+
+  if (now - shaper_active_t < SHAPER_ACTIVE_USEC / 10)
+    return shaper_active;
+
+  n = 0;
+  for (i = 0; i < SHAPER_SESSIONS; i++)
+    if (shaper_shm->session[i] &&
+	now - shaper_shm->session_last[i] < SHAPER_ACTIVE_USEC)
+      n++;
+  shaper_active = n ? n : 1;
+  shaper_active_t = now;
+  return shaper_active;
+}
+
+// take len tokens, possibly going into debt, and return how long the
+// debt takes to be paid back
+uint64_t shaper_take(struct shaper_bucket *b, uint64_t rate, int len,
+		     uint64_t now)
+{
+  uint64_t wait;
+
+  if (b->lock != -1)
+    shaper_lock(&b->lock);
+  if (now > b->last)
+  {
+    b->tokens += (now - b->last) * rate / 1000000;
+    if (b->tokens > (int64_t)b->burst)
+      b->tokens = b->burst;
+    b->last = now;
+  }
+  b->tokens -= len;
+  b->bytes += len;
+  wait = b->tokens < 0 ? -b->tokens * 1000000 / rate : 0;
+  b->delay += wait;
+  if (b->lock != -1)
+    shaper_unlock(&b->lock);
+  return wait;
+}
+
+// account a transfer on a bulk or isochronous endpoint, the answer is
+// then held until the endpoint paid its debt back, see shaper_due()
+void shaper_charge(int endp, int len)
+{
+  struct shaper_bucket *g;
+  uint64_t wait;
+  uint64_t now;
+  uint64_t w;
+  int i;
+
+  if (shaper_shm == NULL || len <= 0 || endp < 1 || endp > 15 ||
+      shaper_type[endp] == 0 || shaper_type[endp] == 3)
+    return;
+
+  now = timing_usec();
+  wait = 0;
+  for (i = SHAPER_GLOBAL; i <= SHAPER_DEVICE; i++)
+    if (shaper_lvl[i] != NULL)
+    {
+      w = shaper_take(shaper_lvl[i], shaper_lvl[i]->rate, len, now);
+      if (w > wait)
+	wait = w;
+    }
+
+  // fair share of the global rate, what idle sessions leave unused goes
+  // to the active ones
+  g = shaper_lvl[SHAPER_GLOBAL];
+  if (g != NULL)
+  {
+    if (shaper_slot != -1)
+      shaper_shm->session_last[shaper_slot] = now;
+    shaper_share.burst = g->burst;
+    w = shaper_take(&shaper_share, g->rate / shaper_count_active(now), len,
+		    now);
+    if (w > wait)
+      wait = w;
+  }
+
+  if (wait && now + wait > shaper_due_t[endp])
+    shaper_due_t[endp] = now + wait;
+}
+
+// when the last transfer on endp is paid for, 0 if it already is
+uint64_t shaper_due(int endp)
+{
+  if (endp < 1 || endp > 15 || shaper_due_t[endp] <= timing_usec())
+    return 0;
+  return shaper_due_t[endp];
+}
+
+// for sessions with a stream per endpoint, waiting only delays it
+void shaper_pace(int endp)
+{
+  timing_sleep_until(shaper_due(endp));
+}
+
+void shaper_dump(void)
+{
+  static const char *level[] = { "global", "client", "device" };
+  struct shaper_bucket *b;
+  struct in_addr in;
+  char key[32];
+  uint64_t used;
+  uint64_t now;
+  int i;
+
+  if (shaper_shm == NULL)
+    return;
+
+  now = timing_usec();
+  for (i = 0; i < SHAPER_BUCKETS; i++)
+  {
+    b = &shaper_shm->bucket[i];
+    if (!b->used)
+      continue;
+    key[0] = '\0';
+    if (b->level == SHAPER_CLIENT)
+    {
+      in.s_addr = b->key;
+      snprintf(key, sizeof(key), "@%s", inet_ntoa(in));
+    }
+    else if (b->level == SHAPER_DEVICE)
+      snprintf(key, sizeof(key), "@%u", b->key);
+
+    used = now > b->dump_t ?
+      (b->bytes - b->dump_bytes) * 1000000 / (now - b->dump_t) : 0;
+    printf("shaper: %s%s %llu KB/s, using %llu KB/s (%llu%%), "
+	   "%llu KB total, %llu ms delayed\n", level[b->level], key,
+	   (unsigned long long)b->rate / 1024,
+	   (unsigned long long)used / 1024,
+	   (unsigned long long)(used * 100 / b->rate),
+	   (unsigned long long)b->bytes / 1024,
+	   (unsigned long long)b->delay / 1000);
+    b->dump_bytes = b->bytes;
+    b->dump_t = now;
+  }
+  fflush(stdout);
+}
@@ -0,0 +1,267 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "log.h"
+#include "profile.h"
+#include "timing.h"
+#include "tune.h"
+#include "wheel.h"
+
+#define TUNE_INTERVAL 200000
+#define TUNE_IDLE 2000000
+
+static int tune_min = 0;
+static int tune_max = 0;
+
+static int tune_s = -1;
+static int tune_snd;
+static int tune_rcv;
+static int tune_peak;
+static int tune_resizes;
+static int tune_pending;
+static uint64_t tune_armed;
+static uint64_t tune_rtt;
+static uint64_t tune_t;
+static uint64_t tune_out;
+static uint64_t tune_in;
+static struct wheel_timer tune_timer;
+
+// bounds are given in KB as min[:max]
+int tune_set(char *arg)
+{
+  char *end;
+
+  tune_min = strtol(arg, &end, 10) * 1024;
+  tune_max = tune_min;
+  if (*end == ':')
+    tune_max = strtol(end + 1, &end, 10) * 1024;
+  if (*end != '\0' || tune_min <= 0 || tune_max < tune_min)
+    return -1;
+  return 0;
+}
+
+void tune_resize(int snd, int rcv)
+{
+  if (snd != tune_snd &&
+      setsockopt(tune_s, SOL_SOCKET, SO_SNDBUF, &snd, sizeof(snd)) == 0)
+  {
+    tune_snd = snd;
+    tune_resizes++;
+  }
+  if (rcv != tune_rcv &&
+      setsockopt(tune_s, SOL_SOCKET, SO_RCVBUF, &rcv, sizeof(rcv)) == 0)
+  {
+    tune_rcv = rcv;
+    tune_resizes++;
+  }
+  if (tune_snd > tune_peak)
+    tune_peak = tune_snd;
+  if (tune_rcv > tune_peak)
+    tune_peak = tune_rcv;
+}
+
+// a buffer size brought within the -w bounds, 0 without them
+int tune_clamp(int bytes)
+{
+  if (!tune_min || bytes <= 0)
+    return 0;
+  if (bytes < tune_min)
+    return tune_min;
+  if (bytes > tune_max)
+    return tune_max;
+  return bytes;
+}
+
+// sessions start with the buffers their device model needed before
+void tune_start(int s)
+{
+  int start;
+
+  start = profile_buffer() * 1024;
+  if (!tune_min)
+  {
+    if (start)
+    {
+      setsockopt(s, SOL_SOCKET, SO_SNDBUF, &start, sizeof(start));
+      setsockopt(s, SOL_SOCKET, SO_RCVBUF, &start, sizeof(start));
+    }
+    return;
+  }
+  tune_s = s;
+  tune_snd = 0;
+  tune_rcv = 0;
+  tune_peak = 0;
+  tune_resizes = 0;
+  tune_pending = 0;
+  tune_armed = 0;
+  tune_rtt = 0;
+  tune_out = 0;
+  tune_in = 0;
+  tune_t = timing_usec();
+  if (start < tune_min)
+    start = tune_min;
+  if (start > tune_max)
+    start = tune_max;
+  tune_resize(start, start);
+}
+
+// size one direction from what went through it during the interval: the
+// bandwidth-delay product with some headroom, or twice the buffer when
+// the buffer was what limited the transfer
+int tune_target(int cur, uint64_t bytes, uint64_t usec)
+{
+  uint64_t bdp;
+  uint64_t lim;
+  uint64_t v;
+
+  bdp = bytes * tune_rtt / usec;
+  lim = (uint64_t)cur * usec / tune_rtt;
+  v = 2 * bdp;
+  if (bytes * 4 >= lim * 3 && v < 2 * (uint64_t)cur)
+    v = 2 * (uint64_t)cur;
+  if (v < tune_min)
+    v = tune_min;
+  if (v > tune_max)
+    v = tune_max;
+  // grow at once, shrink only on large differences
+  if (v < cur && v * 2 > cur)
+    v = cur;
+  return v;
+}
+
+void tune_update(uint64_t now)
+{
+#ifdef TCP_INFO
+  struct tcp_info ti;
+  socklen_t len;
+#endif
+  uint64_t usec;
+
+  usec = now - tune_t;
+  if (usec < TUNE_INTERVAL)
+    return;
+#ifdef TCP_INFO
+  // the stack knows the round trip better when it exposes it
+  len = sizeof(ti);
+  if (getsockopt(tune_s, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 &&
+      ti.tcpi_rtt)
+    tune_rtt = ti.tcpi_rtt;
+#endif
+  if (tune_rtt)
+    tune_resize(tune_target(tune_snd, tune_out, usec),
+		tune_target(tune_rcv, tune_in, usec));
+  tune_out = 0;
+  tune_in = 0;
+  tune_t = now;
+}
+
+// an idle session gives its buffers back
+void tune_idle(void *arg)
+{
+  tune_resize(tune_min, tune_min);
+}
+
+// pushed back by every submit and answer, the timer fires after a quiet
+// TUNE_IDLE
+void tune_busy(void)
+{
+  if (tune_snd != tune_min || tune_rcv != tune_min)
+    wheel_add(&tune_timer, TUNE_IDLE, tune_idle, NULL);
+}
+
+// a submit arriving after an answer sent on a quiet connection measures
+// the round trip through the network and the client
+void tune_submit(int len)
+{
+  uint64_t now;
+  uint64_t rtt;
+
+  if (tune_s == -1)
+    return;
+  now = timing_usec();
+  if (tune_armed)
+  {
+    rtt = now - tune_armed;
+    tune_rtt = tune_rtt ? (7 * tune_rtt + rtt) / 8 : rtt;
+    if (!tune_rtt)
+      tune_rtt = 1;
+    tune_armed = 0;
+  }
+  tune_pending++;
+  tune_in += len;
+  tune_update(now);
+  tune_busy();
+}
+
+void tune_ret(int len)
+{
+  uint64_t now;
+  int n;
+
+  if (tune_s == -1)
+    return;
+  now = timing_usec();
+  tune_pending--;
+  tune_out += len;
+  if (!tune_pending && !tune_armed &&
+      ioctl(tune_s, FIONREAD, &n) == 0 && n == 0)
+    tune_armed = now;
+  tune_update(now);
+  tune_busy();
+}
+
+// largest socket buffer of the session in bytes, for the process that
+// learns from it
+int tune_peaked(void)
+{
+  return tune_peak;
+}
+
+void tune_report(char *addr)
+{
+  if (tune_s == -1)
+    return;
+  log_printf(LOG_INFO, "%s: socket buffers up to %d KB, %d resizes, "
+	     "rtt %llu usec\n", addr, tune_peak / 1024, tune_resizes,
+	     (unsigned long long)tune_rtt);
+  profile_peak(tune_peak);
+  wheel_del(&tune_timer);
+  tune_s = -1;
+}
@@ -0,0 +1,489 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "bot.h"
+#include "log.h"
+#include "net.h"
+#include "process.h"
+#include "record.h"
+#include "shaper.h"
+#include "tune.h"
+#include "tunnel.h"
+#include "wheel.h"
+
+// an URB given to a worker, with the timer of its unlink grace; an
+// unlinked URB whose timer expired has its answer dropped
+struct tunnel_urb
+{
+  struct wheel_timer timer;
+  uint32_t seq;
+  uint32_t unlink;
+  int used;
+};
+
+// the worker of an endpoint, its URBs and the answer being read from it
+struct tunnel_stream
+{
+  int s;
+  pid_t pid;
+  int len;
+  char *buf;
+  struct tunnel_urb urb[TUNNEL_PENDING];
+  int n;
+};
+
+static int tunnel_on = 0;
+static struct tunnel_stream tunnel_sts[16];
+static int tunnel_s;
+static char *tunnel_addr;
+
+void tunnel_enable(void)
+{
+  tunnel_on = 1;
+}
+
+int tunnel_enabled(void)
+{
+  return tunnel_on;
+}
+
+// the unlink grace of an URB expired, the client gets it back as unlinked
+void tunnel_expire(void *arg)
+{
+  struct tunnel_urb *urb = arg;
+
+  process_send_unlink_ret(tunnel_s, urb->unlink, -ECONNRESET, tunnel_addr);
+  tune_ret(0);
+}
+
+// an URB still at its worker gets a grace period to complete, unlinks of
+// answered URBs are answered at once
+void tunnel_unlink(struct net_unlink *unlink)
+{
+  struct tunnel_urb *urb;
+  uint32_t seq;
+  int i;
+  int j;
+
+  record_unlink(unlink);
+  seq = ntohl(unlink->seq);
+  for (i = 1; i < 16; i++)
+    for (j = 0; j < TUNNEL_PENDING && tunnel_sts[i].n; j++)
+    {
+      urb = &tunnel_sts[i].urb[j];
+      if (!urb->used || urb->seq != seq || urb->unlink)
+	continue;
+      urb->unlink = unlink->hdr.seq;
+      wheel_add(&urb->timer, TUNNEL_GRACE * 1000, tunnel_expire, urb);
+      return;
+    }
+  process_send_unlink_ret(tunnel_s, unlink->hdr.seq, 0, tunnel_addr);
+}
+
+// forget an URB, telling whether the client still waits for its answer
+int tunnel_done(struct tunnel_stream *st, struct tunnel_urb *urb)
+{
+  int waiting;
+
+  waiting = !urb->unlink || wheel_armed(&urb->timer);
+  wheel_del(&urb->timer);
+  urb->used = 0;
+  st->n--;
+  return waiting;
+}
+
+// close the socket of a lost or stopped worker, and answer its URBs
+// unless the client is gone
+void tunnel_fail(struct tunnel_stream *st, int answer)
+{
+  struct net_submit submit;
+  struct tunnel_urb *urb;
+  int i;
+
+  bzero(&submit, sizeof(submit));
+  for (i = 0; i < TUNNEL_PENDING && st->n; i++)
+  {
+    urb = &st->urb[i];
+    if (!urb->used)
+      continue;
+    submit.hdr.seq = urb->seq;
+    if (tunnel_done(st, urb) && answer)
+    {
+      if (urb->unlink)
+	process_send_unlink_ret(tunnel_s, urb->unlink, -ECONNRESET,
+				tunnel_addr);
+      else
+	process_send_ret(tunnel_s, &submit, -ESHUTDOWN, NULL, 0,
+			 tunnel_addr);
+    }
+  }
+  st->len = 0;
+  if (st->s != -1)
+    close(st->s);
+  st->s = -1;
+  st->pid = -1;
+}
+
+// move what a worker wrote to the answer being assembled, and the answer
+// to the client once complete
+int tunnel_answer(struct tunnel_stream *st)
+{
+  struct net_submit_ret *ret;
+  struct tunnel_urb *urb;
+  uint32_t seq;
+  int need;
+  int len;
+  int i;
+
+  ret = (struct net_submit_ret *)st->buf;
+  need = sizeof(*ret);
+  if (st->len >= sizeof(*ret))
+    need += ntohl(ret->len);
+  if (need > sizeof(*ret) + PROCESS_BUF_MAX)
+    return -1;
+  len = read(st->s, st->buf + st->len, need - st->len);
+  if (len == -1 && errno == EAGAIN)
+    return 0;
+  if (len <= 0)
+    return -1;
+  st->len += len;
+  if (st->len == sizeof(*ret) && ret->len != 0)
+    return 0;
+  if (st->len < need)
+    return 0;
+
+  len = st->len;
+  st->len = 0;
+  seq = ntohl(ret->hdr.seq);
+  for (i = 0; i < TUNNEL_PENDING; i++)
+  {
+    urb = &st->urb[i];
+    if (!urb->used || urb->seq != seq)
+      continue;
+    if (!tunnel_done(st, urb))
+      return 0;
+    record_ret(ret, st->buf + sizeof(*ret), len - sizeof(*ret));
+    if (net_send(tunnel_s, st->buf, len))
+      return -1;
+    if (urb->unlink)
+      process_send_unlink_ret(tunnel_s, urb->unlink, 0, tunnel_addr);
+    return 0;
+  }
+  return 0;
+}
+
+// serve the URBs of a single endpoint, checked and put in host order by
+// the session
+void tunnel_worker(int s, char *addr, tunnel_urb_fct urb_fct, void *arg)
+{
+  struct net_submit submit;
+  char buf[PROCESS_BUF_MAX];
+  int len;
+  int res;
+
+  for (;;)
+  {
+    if (net_read(s, &submit, sizeof(submit)) ||
+	net_read(s, buf, process_out_len(&submit)))
+      return;
+    len = urb_fct(arg, &submit, buf, &res);
+    // the worker serves this endpoint alone, it can wait for its rate
+    shaper_pace(submit.hdr.endp);
+    if (len >= 0)
+      process_send_ret(s, &submit, res, buf, len, addr);
+  }
+}
+
+// start the worker of an endpoint, connected to the session by a socket
+// pair
+int tunnel_start(int endp, tunnel_urb_fct urb_fct, void *arg)
+{
+  struct tunnel_stream *st;
+  int sp[2];
+  int i;
+  int j;
+
+  st = &tunnel_sts[endp];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1)
+  {
+    log_printf(LOG_ERR, "%s: socketpair() error\n", tunnel_addr);
+    return -1;
+  }
+  // the session must not block on a request while the worker waits for
+  // it to read an answer
+  fcntl(sp[0], F_SETFL, fcntl(sp[0], F_GETFL) | O_NONBLOCK);
+  fflush(NULL);
+  st->pid = fork();
+  if (st->pid == -1)
+  {
+    log_printf(LOG_ERR, "%s: fork() error\n", tunnel_addr);
+    close(sp[0]);
+    close(sp[1]);
+    return -1;
+  }
+  if (st->pid == 0)
+  {
+    // the unlinks and the capture stay with the session
+    close(tunnel_s);
+    close(sp[0]);
+    for (i = 1; i < 16; i++)
+    {
+      if (tunnel_sts[i].s != -1)
+	close(tunnel_sts[i].s);
+      for (j = 0; j < TUNNEL_PENDING; j++)
+	wheel_del(&tunnel_sts[i].urb[j].timer);
+    }
+    record_detach();
+    tunnel_worker(sp[1], tunnel_addr, urb_fct, arg);
+    _exit(EXIT_SUCCESS);
+  }
+  close(sp[1]);
+  st->s = sp[0];
+  return 0;
+}
+
+// hand a request to its worker, reading its answers while the socket
+// pair is full
+int tunnel_send(struct tunnel_stream *st, char *buf, int len)
+{
+  struct pollfd pfd;
+  int r;
+
+  while (len > 0)
+  {
+    r = write(st->s, buf, len);
+    if (r > 0)
+    {
+      buf += r;
+      len -= r;
+      continue;
+    }
+    if (r == -1 && errno != EAGAIN && errno != EINTR)
+      return -1;
+    pfd.fd = st->s;
+    pfd.events = POLLIN | POLLOUT;
+    if (wheel_poll(&pfd, 1, -1) == -1 && errno != EINTR)
+      return -1;
+    if ((pfd.revents & ~POLLOUT) && tunnel_answer(st))
+      return -1;
+  }
+  return 0;
+}
+
+// give an URB to the worker of its endpoint, started at its first URB
+void tunnel_submit(struct net_submit *submit, char *buf,
+		   tunnel_urb_fct urb_fct, void *arg)
+{
+  struct tunnel_stream *st;
+  int i;
+
+  st = &tunnel_sts[submit->hdr.endp & 0x0f];
+  if (st->n == TUNNEL_PENDING ||
+      (st->s == -1 && tunnel_start(submit->hdr.endp & 0x0f, urb_fct, arg)))
+  {
+    log_printf(LOG_ERR, "%s: cannot pass request to endpoint %d\n",
+	       tunnel_addr, submit->hdr.endp & 0x0f);
+    process_send_ret(tunnel_s, submit, -ENOMEM, NULL, 0, tunnel_addr);
+    return;
+  }
+  for (i = 0; st->urb[i].used; i++)
+    ;
+  st->urb[i].used = 1;
+  st->urb[i].seq = submit->hdr.seq;
+  st->urb[i].unlink = 0;
+  st->n++;
+  if (tunnel_send(st, (char *)submit, sizeof(*submit)) ||
+      tunnel_send(st, buf, process_out_len(submit)))
+  {
+    log_printf(LOG_WARNING, "%s: lost the worker of endpoint %d\n",
+	       tunnel_addr, submit->hdr.endp & 0x0f);
+    tunnel_fail(st, 1);
+  }
+}
+
+// wait for a worker to exit, killed if it does not within TUNNEL_STOP
+// msec; SIGCHLD is ignored, so it is reaped by the system and waitpid()
+// fails with ECHILD once it is gone
+void tunnel_reap(pid_t pid)
+{
+  int delay;
+  int t;
+  int r;
+
+  kill(pid, SIGTERM);
+  for (t = 0, delay = 1;; t += delay)
+  {
+    r = waitpid(pid, NULL, WNOHANG);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r != 0)
+      return;
+    if (t >= TUNNEL_STOP)
+      break;
+    usleep(delay * 1000);
+    if (delay < 16)
+      delay *= 2;
+  }
+  log_printf(LOG_WARNING, "%s: killing the worker %d\n", tunnel_addr,
+	     (int)pid);
+  kill(pid, SIGKILL);
+  while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+    ;
+}
+
+// stop the workers, their copies of the endpoints must be closed before
+// a new configuration opens them again
+void tunnel_stop(int answer)
+{
+  struct tunnel_stream *st;
+  int i;
+
+  for (i = 1; i < 16; i++)
+  {
+    st = &tunnel_sts[i];
+    if (st->pid != -1)
+      tunnel_reap(st->pid);
+    tunnel_fail(st, answer);
+  }
+}
+
+// the importing end of a tunnel: endpoint 0 is served here, every other
+// endpoint by a worker of its own, so that a stalled bulk transfer does
+// not hold back the URBs of the other endpoints; all of them share the
+// connection, whose loss recovery then works as for a plain import
+void tunnel_session(int s, char *addr, tunnel_urb_fct urb_fct, void *arg)
+{
+  struct tunnel_stream *st;
+  struct net_submit *submit;
+  struct net_generic hdr;
+  struct pollfd pfd[16];
+  char buf[PROCESS_BUF_MAX];
+  int len;
+  int res;
+  int i;
+
+  tunnel_s = s;
+  tunnel_addr = addr;
+  for (i = 1; i < 16; i++)
+  {
+    st = &tunnel_sts[i];
+    bzero(st, sizeof(*st));
+    st->s = -1;
+    st->pid = -1;
+    st->buf = malloc(sizeof(struct net_submit_ret) + PROCESS_BUF_MAX);
+    if (st->buf == NULL)
+    {
+      log_printf(LOG_ERR, "%s: malloc() error\n", addr);
+      return;
+    }
+  }
+
+  bot_disable();
+  pfd[0].fd = s;
+  pfd[0].events = POLLIN;
+  for (;;)
+  {
+    for (i = 1; i < 16; i++)
+    {
+      pfd[i].fd = tunnel_sts[i].s;
+      pfd[i].events = POLLIN;
+    }
+    if (wheel_poll(pfd, 16, -1) == -1)
+    {
+      if (errno == EINTR)
+	continue;
+      break;
+    }
+
+    for (i = 1; i < 16; i++)
+      if (pfd[i].revents && tunnel_sts[i].s != -1 &&
+	  tunnel_answer(&tunnel_sts[i]))
+      {
+	log_printf(LOG_WARNING, "%s: lost the worker of endpoint %d\n",
+		   addr, i);
+	tunnel_fail(&tunnel_sts[i], 1);
+      }
+
+    if (!pfd[0].revents)
+      continue;
+    if (net_read_hdr(s, &hdr))
+      break;
+    if (hdr.hdr.cmd == 2)
+    {
+      tunnel_unlink((struct net_unlink *)&hdr);
+      continue;
+    }
+    submit = (struct net_submit *)&hdr;
+    switch (process_read_submit(s, submit, buf, addr))
+    {
+    case 0:
+      if (submit->hdr.endp & 0x0f)
+      {
+	tunnel_submit(submit, buf, urb_fct, arg);
+	continue;
+      }
+      if (submit->setup[0] == 0 && submit->setup[1] == 9)
+	tunnel_stop(1);
+      len = urb_fct(arg, submit, buf, &res);
+      break;
+    case 1:
+      len = 0;
+      res = -ENOMEM;
+      break;
+    default:
+      len = -2;
+      break;
+    }
+    if (len == -2)
+      break;
+    if (len >= 0)
+      process_send_ret(s, submit, res, buf, len, addr);
+  }
+
+  tunnel_stop(0);
+  for (i = 1; i < 16; i++)
+    free(tunnel_sts[i].buf);
+}
@@ -0,0 +1,227 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2019, Mickael Torres
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <poll.h>
+
+#include "timing.h"
+#include "wheel.h"
+
+// timers due within 64 ticks are in the first level, one slot per tick,
+// later ones in coarser levels and moved down as their time comes, so
+// that adding and cancelling a timer is constant time whatever the
+// number of timers
+static struct wheel_timer wheel_slots[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t wheel_now = 0;
+static int wheel_n = 0;
+
+void wheel_insert(struct wheel_timer *t)
+{
+  struct wheel_timer *head;
+  uint64_t delta;
+  uint64_t at;
+  int level;
+
+  at = t->expires;
+  delta = at - wheel_now;
+  for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    if (delta < (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+      break;
+  // too far away for the top level, it goes in its last slot and is
+  // placed again from its real expiry on cascade
+  if (delta >= (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+    at = wheel_now + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+  head = &wheel_slots[level][(at >> (WHEEL_BITS * level)) &
+			     (WHEEL_SLOTS - 1)];
+  if (head->next == NULL)
+    head->next = head->prev = head;
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+void wheel_unlink(struct wheel_timer *t)
+{
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = NULL;
+}
+
+// arm a timer usec from now, rearming an armed timer moves it
+void wheel_add(struct wheel_timer *t, uint64_t usec, wheel_fct fct,
+	       void *arg)
+{
+  uint64_t now;
+
+  now = timing_usec();
+  if (wheel_n == 0)
+    wheel_now = now / WHEEL_TICK;
+  if (t->next != NULL)
+    wheel_unlink(t);
+  else
+    wheel_n++;
+  t->expires = (now + usec + WHEEL_TICK - 1) / WHEEL_TICK;
+  if (t->expires <= wheel_now)
+    t->expires = wheel_now + 1;
+  t->fct = fct;
+  t->arg = arg;
+  wheel_insert(t);
+}
+
+void wheel_del(struct wheel_timer *t)
+{
+  if (t->next == NULL)
+    return;
+  wheel_unlink(t);
+  wheel_n--;
+}
+
+int wheel_armed(struct wheel_timer *t)
+{
+  return t->next != NULL;
+}
+
+// put the timers of a coarse slot back in the finer levels
+void wheel_cascade(int level)
+{
+  struct wheel_timer *head;
+  struct wheel_timer *t;
+
+  head = &wheel_slots[level][(wheel_now >> (WHEEL_BITS * level)) &
+			     (WHEEL_SLOTS - 1)];
+  if (head->next == NULL)
+    return;
+  while (head->next != head)
+  {
+    t = head->next;
+    wheel_unlink(t);
+    wheel_insert(t);
+  }
+}
+
+// milliseconds until the next tick that has something to do, -1 if no
+// timer is armed
+int wheel_timeout(void)
+{
+  struct wheel_timer *head;
+  uint64_t now;
+  uint64_t at;
+  uint64_t pos;
+  int level;
+  int i;
+
+  if (wheel_n == 0)
+    return -1;
+  now = timing_usec() / WHEEL_TICK;
+  for (level = 0; level < WHEEL_LEVELS; level++)
+  {
+    pos = wheel_now >> (WHEEL_BITS * level);
+    for (i = 1; i <= WHEEL_SLOTS; i++)
+    {
+      head = &wheel_slots[level][(pos + i) & (WHEEL_SLOTS - 1)];
+      if (head->next == NULL || head->next == head)
+	continue;
+      // a coarse slot only needs its cascade
+      at = (pos + i) << (WHEEL_BITS * level);
+      return at <= now ? 0 : (at - now) * WHEEL_TICK / 1000;
+    }
+  }
+  return 0;
+}
+
+// fire the timers that are due, each one may arm timers again
+void wheel_run(void)
+{
+  struct wheel_timer *head;
+  struct wheel_timer *t;
+  uint64_t now;
+  int level;
+
+  now = timing_usec() / WHEEL_TICK;
+  if (wheel_n == 0)
+  {
+    wheel_now = now;
+    return;
+  }
+  while (wheel_now < now)
+  {
+    wheel_now++;
+    for (level = 1; level < WHEEL_LEVELS; level++)
+    {
+      if (wheel_now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1))
+	break;
+      wheel_cascade(level);
+    }
+    head = &wheel_slots[0][wheel_now & (WHEEL_SLOTS - 1)];
+    if (head->next == NULL)
+      continue;
+    while (head->next != head)
+    {
+      t = head->next;
+      wheel_unlink(t);
+      wheel_n--;
+      t->fct(t->arg);
+    }
+    if (wheel_n == 0)
+    {
+      wheel_now = now;
+      return;
+    }
+  }
+}
+
+// poll() that fires the timers, waiting no longer than the next one
+int wheel_poll(struct pollfd *pfd, int n, int timeout)
+{
+  int next;
+  int res;
+
+  next = wheel_timeout();
+  if (next != -1 && (timeout == -1 || next < timeout))
+    timeout = next;
+  res = poll(pfd, n, timeout);
+  wheel_run();
+  return res;
+}
+
+// for sessions blocking on a socket, the timers fire while it is quiet
+void wheel_wait(int s)
+{
+  struct pollfd pfd;
+
+  pfd.fd = s;
+  pfd.events = POLLIN;
+  while (wheel_n && wheel_poll(&pfd, 1, -1) == 0)
+    ;
+}